@@ -66,8 +66,6 @@ Return<V1_0::NfcStatus> Nfc::open(
 }
 
 Return<uint32_t> Nfc::write(const hidl_vec<uint8_t>& data) {
-  hidl_vec<uint8_t> copy = data;
-
   return StNfc_hal_write(data.size(), &data[0]);
 }
 
@@ -68,8 +68,6 @@ Return<V1_0::NfcStatus> Nfc::open(
 }
 
 Return<uint32_t> Nfc::write(const hidl_vec<uint8_t>& data) {
-  hidl_vec<uint8_t> copy = data;
-
   return StNfc_hal_write(data.size(), &data[0]);
 }
 
@@ -137,16 +135,14 @@ Return<V1_0::NfcStatus> Nfc::closeForPowerOffCase() {
 }
 
 Return<void> Nfc::getConfig(getConfig_cb hidl_cb) {
-  android::hardware::nfc::V1_1::NfcConfig nfcVendorConfig;
-  StNfc_hal_getConfig(nfcVendorConfig);
-  hidl_cb(nfcVendorConfig);
+  std::shared_ptr<const NfcConfig> nfcVendorConfig = StNfc_hal_getConfig();
+  hidl_cb(nfcVendorConfig->v1_1);
   return Void();
 }
 
 Return<void> Nfc::getConfig_1_2(getConfig_1_2_cb hidl_cb) {
-  NfcConfig nfcVendorConfig;
-  StNfc_hal_getConfig_1_2(nfcVendorConfig);
-  hidl_cb(nfcVendorConfig);
+  std::shared_ptr<const NfcConfig> nfcVendorConfig = StNfc_hal_getConfig();
+  hidl_cb(*nfcVendorConfig);
   return Void();
 }
 
@@ -23,6 +23,7 @@
 #include <android/hardware/nfc/1.2/INfc.h>
 #include <android/hardware/nfc/1.2/types.h>
 #include <hardware/nfc.h>
+#include <memory>
 
 using ::android::hardware::nfc::V1_2::NfcConfig;
 
@@ -48,7 +49,7 @@ void StNfc_hal_factoryReset();
 
 int StNfc_hal_closeForPowerOffCase();
 
-void StNfc_hal_getConfig(android::hardware::nfc::V1_1::NfcConfig& config);
-void StNfc_hal_getConfig_1_2(NfcConfig& config);
+/* Vendor config, shared and left unchanged until the settings change. */
+std::shared_ptr<const NfcConfig> StNfc_hal_getConfig();
 
 #endif /* _STNFC_HAL_API_H_ */
@@ -0,0 +1,119 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+
+/*
+ * Enable/disable cycle time of the 1.2 HAL, over the NFCC simulator:
+ *   st21nfc_hal_1_2_benchmark --benchmark_format=json
+ */
+
+#include <hardware/nfc.h>
+#include <semaphore.h>
+#include <vector>
+#include "StNfc_hal_api.h"
+#include "bench_common.h"
+#include "i2ctransport.h"
+
+static sem_t benchEvent; /* stack events */
+static sem_t benchData;  /* upstream frames */
+
+static void BenchEventCallback(nfc_event_t event, nfc_status_t status) {
+  (void)event;
+  (void)status;
+  sem_post(&benchEvent);
+}
+
+static void BenchDataCallback(uint16_t length, uint8_t* data) {
+  (void)length;
+  (void)data;
+  sem_post(&benchData);
+}
+
+/**
+ * Take the NFCC through CORE_RESET, CORE_INIT and the post-init config, like
+ * the stack does after the open.
+ * @return false if a step failed
+ */
+static bool BenchInitNfcc() {
+  static const uint8_t coreReset[] = {0x20, 0x00, 0x01, 0x01};
+  static const uint8_t coreInit[] = {0x20, 0x01, 0x02, 0x00, 0x00};
+  uint8_t coreInitRspParams = 0;
+
+  // CORE_RESET_RSP and CORE_RESET_NTF, then CORE_INIT_RSP
+  if ((StNfc_hal_write(sizeof(coreReset), coreReset) == 0) ||
+      !BenchWait(&benchData, 2)) {
+    return false;
+  }
+  if ((StNfc_hal_write(sizeof(coreInit), coreInit) == 0) ||
+      !BenchWait(&benchData, 1)) {
+    return false;
+  }
+  // HAL_NFC_POST_INIT_CPLT_EVT
+  StNfc_hal_core_initialized(&coreInitRspParams);
+  return BenchWait(&benchEvent, 1);
+}
+
+/**
+ * NFC enabled then disabled, as on screen on/off: open until
+ * HAL_NFC_OPEN_CPLT_EVT, optionally the NCI init, then close until it
+ * returns. Arguments: NCI init, reactor mode.
+ */
+static void BM_EnableDisable(benchmark::State& state) {
+  bool init = state.range(0);
+  std::vector<double> us;
+
+  if (!BenchConfig(state.range(1) ? "STNFC_HAL_REACTOR_MODE=1\n" : "")) {
+    state.SkipWithError("cannot write the config");
+    return;
+  }
+  I2cSetTransport(&i2cSimTransport);
+  sem_init(&benchEvent, 0, 0);
+  sem_init(&benchData, 0, 0);
+
+  for (auto _ : state) {
+    double start = BenchNowUs();
+    // HAL_NFC_OPEN_CPLT_EVT
+    if ((StNfc_hal_open(BenchEventCallback, BenchDataCallback) != 0) ||
+        !BenchWait(&benchEvent, 1) || (init && !BenchInitNfcc())) {
+      StNfc_hal_close(NFC_MODE_OFF);
+      state.SkipWithError("HAL open failed");
+      break;
+    }
+    StNfc_hal_close(NFC_MODE_OFF);
+    us.push_back(BenchNowUs() - start);
+
+    // HAL_NFC_CLOSE_CPLT_EVT, and whatever came after the init
+    while (sem_trywait(&benchEvent) == 0) {
+    }
+    while (sem_trywait(&benchData) == 0) {
+    }
+  }
+
+  sem_destroy(&benchEvent);
+  sem_destroy(&benchData);
+  BenchReportPercentiles(state, us);
+}
+BENCHMARK(BM_EnableDisable)
+    ->ArgNames({"init", "reactor"})
+    ->Args({0, 0})
+    ->Args({1, 0})
+    ->Args({1, 1})
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
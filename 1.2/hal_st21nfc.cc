@@ -23,11 +23,14 @@
 #include <cutils/properties.h>
 #include <errno.h>
 #include <hardware/nfc.h>
+#include <stdlib.h>
 #include <string.h>
+#include <atomic>
 
 #include "StNfc_hal_api.h"
 #include "android_logmsg.h"
 #include "hal_config.h"
+#include "hal_latency.h"
 #include "halcore.h"
 
 extern void HalCoreCallback(void* context, uint32_t event, const void* d,
@@ -45,12 +48,34 @@ typedef struct {
 
 const char* halVersion = "ST21NFC HAL1.2 Version 3.2.5";
 
+/* max. time a write waits for a free TX buffer before failing */
+#define HAL_WRITE_TIMEOUT_MS 1000
+
 uint8_t cmd_set_nfc_mode_enable[] = {0x2f, 0x02, 0x02, 0x02, 0x01};
-uint8_t hal_is_closed = 1;
+/* HAL lifecycle, changed with hal_mtx held */
+#define HAL_STATE_CLOSED 0
+#define HAL_STATE_OPENING 1   /* writes wait for hal_mtx, as for the others */
+#define HAL_STATE_OPEN 2      /* writes go without hal_mtx */
+#define HAL_STATE_CLOSING 3   /* writes fail, the ones in flight are drained */
+#define HAL_STATE_POST_INIT 4 /* writes wait for hal_mtx, until READY */
+
+/* held by the state transitions (open, close, post init) and the calls that
+   must not run during one, StNfc_hal_write only takes it while the HAL is
+   opening or sending the post-init config */
 pthread_mutex_t hal_mtx = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<int> hal_state(HAL_STATE_CLOSED);
+/* StNfc_hal_write calls which saw HAL_STATE_OPEN, not returned yet */
+static std::atomic<int> hal_writers(0);
+static pthread_mutex_t hal_writers_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hal_writers_cond = PTHREAD_COND_INITIALIZER;
 st21nfc_dev_t dev;
 uint8_t hal_dta_state = 0;
-int nfc_mode = 0;
+
+/* vendor config, rebuilt when the config generation changes */
+static pthread_mutex_t config_mtx = PTHREAD_MUTEX_INITIALIZER;
+static std::shared_ptr<const android::hardware::nfc::V1_2::NfcConfig>
+    config_cache;
+static uint32_t config_cache_generation;
 
 using namespace android::hardware::nfc::V1_1;
 using namespace android::hardware::nfc::V1_2;
@@ -74,16 +99,46 @@ This prevents a possible deadlock in upper layer on some sequences.
 We need to synchronize finely for the callback called for hal close,
 otherwise the upper layer either does not receive the event, or deadlocks,
 because the HAL is closing while the callback may be blocked.
+Events are queued in order, so that the posting thread (HAL Core worker, I2C
+thread) only waits for binder if the queue is full. The callback thread itself
+cannot wait for room, the queue grows for the events it posts.
+The thread is created at the first open and kept for the life of the
+service: open resumes it, close quiesces it once the queued events are
+delivered. Events posted while it is quiesced are delivered inline.
  */
+#define ASYNC_CALLBACK_QUEUE_SIZE 16 /* initial size */
+/* max. time close waits for the stack to return from its last event */
+#define ASYNC_CALLBACK_QUIESCE_TIMEOUT_MS 10
+
+typedef struct {
+  nfc_event_t event;
+  nfc_status_t event_status;
+  struct timespec post_time;
+} async_callback_event_t;
+
 static struct async_callback_struct {
   pthread_mutex_t mutex;
-  pthread_cond_t cond;
+  pthread_cond_t cond;       /* event queued */
+  pthread_cond_t room_cond;  /* event taken from the queue */
+  pthread_cond_t idle_cond;  /* event delivered */
   pthread_t thr;
-  int event_pending;
-  int stop_thread;
-  int thread_running;
-  nfc_event_t event;
-  nfc_status_t event_status;
+  int initialized;    /* mutex and conditions are usable */
+  int thread_started; /* thr is running, until a pthread call fails */
+  int active;         /* events are queued, between resume and quiesce */
+  int quiesce;        /* quiesce once the queue is empty */
+  int delivering;     /* an event is being delivered */
+  /* events not delivered yet, oldest at queue_head */
+  async_callback_event_t* queue;
+  uint32_t queue_size;
+  uint32_t queue_head;
+  uint32_t queue_count;
+  /* statistics since the last resume, reported when quiesced */
+  uint32_t stat_events;
+  uint32_t stat_max_depth;
+  uint32_t stat_full; /* posts which had to wait for room */
+  /* StNfc_hal_open time, until HAL_NFC_OPEN_CPLT_EVT is delivered */
+  struct timespec open_time;
+  int open_pending;
 } async_callback_data;
 
 static void* async_callback_thread_fct(void* arg) {
@@ -93,143 +148,255 @@ static void* async_callback_thread_fct(void* arg) {
   ret = pthread_mutex_lock(&pcb_data->mutex);
   if (ret != 0) {
     STLOG_HAL_E("HAL: %s pthread_mutex_lock failed", __func__);
-    goto error;
+    return NULL;
   }
 
-  do {
-    if (pcb_data->event_pending == 0) {
+  for (;;) {
+    while (pcb_data->queue_count == 0) {
       ret = pthread_cond_wait(&pcb_data->cond, &pcb_data->mutex);
       if (ret != 0) {
         STLOG_HAL_E("HAL: %s pthread_cond_wait failed", __func__);
-        break;
+        goto error;
       }
     }
 
-    if (pcb_data->event_pending) {
-      nfc_event_t event = pcb_data->event;
-      nfc_status_t event_status = pcb_data->event_status;
-      int ending = pcb_data->stop_thread;
-      pcb_data->event_pending = 0;
-      ret = pthread_cond_signal(&pcb_data->cond);
-      if (ret != 0) {
-        STLOG_HAL_E("HAL: %s pthread_cond_signal failed", __func__);
-        break;
-      }
-      if (ending) {
-        pcb_data->thread_running = 0;
-      }
-      ret = pthread_mutex_unlock(&pcb_data->mutex);
-      if (ret != 0) {
-        STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
-      }
-      STLOG_HAL_D("HAL st21nfc: %s event %hhx status %hhx", __func__, event,
-                  event_status);
-      dev.p_cback_unwrap(event, event_status);
-      if (ending) {
-        return NULL;
-      }
-      ret = pthread_mutex_lock(&pcb_data->mutex);
-      if (ret != 0) {
-        STLOG_HAL_E("HAL: %s pthread_mutex_lock failed", __func__);
-        goto error;
-      }
+    async_callback_event_t e = pcb_data->queue[pcb_data->queue_head];
+    pcb_data->queue_head = (pcb_data->queue_head + 1) % pcb_data->queue_size;
+    pcb_data->queue_count--;
+    bool open_done =
+        (e.event == HAL_NFC_OPEN_CPLT_EVT) && pcb_data->open_pending;
+    struct timespec open_time = pcb_data->open_time;
+    if (open_done) {
+      pcb_data->open_pending = 0;
+    }
+    // Events posted after the last one of a closing HAL are delivered inline
+    if (pcb_data->quiesce && (pcb_data->queue_count == 0)) {
+      pcb_data->active = 0;
+      pcb_data->quiesce = 0;
+    }
+    pcb_data->delivering = 1;
+    ret = pthread_cond_broadcast(&pcb_data->room_cond);
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_cond_broadcast failed", __func__);
+    }
+    ret = pthread_mutex_unlock(&pcb_data->mutex);
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
     }
-  } while (pcb_data->stop_thread == 0 || pcb_data->event_pending);
 
-  ret = pthread_mutex_unlock(&pcb_data->mutex);
-  if (ret != 0) {
-    STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
+    STLOG_HAL_D("HAL st21nfc: %s event %hhx status %hhx", __func__, e.event,
+                e.event_status);
+    HalLatencyRecord(HAL_LATENCY_EVENT, &e.post_time);
+    if (open_done) {
+      HalLatencyRecord(HAL_LATENCY_OPEN, &open_time);
+    }
+    dev.p_cback_unwrap(e.event, e.event_status);
+
+    ret = pthread_mutex_lock(&pcb_data->mutex);
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_mutex_lock failed", __func__);
+      return NULL;
+    }
+    pcb_data->delivering = 0;
+    ret = pthread_cond_broadcast(&pcb_data->idle_cond);
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_cond_broadcast failed", __func__);
+    }
   }
 
 error:
-  pcb_data->thread_running = 0;
+  // Stop queueing, the next resume starts a new thread
+  pcb_data->thread_started = 0;
+  pcb_data->active = 0;
+  (void)pthread_cond_broadcast(&pcb_data->room_cond);
+  (void)pthread_cond_broadcast(&pcb_data->idle_cond);
+  (void)pthread_mutex_unlock(&pcb_data->mutex);
   return NULL;
 }
 
-static int async_callback_thread_start() {
+/**
+ * Let the callback thread queue events again, starting it the first time.
+ * Called with hal_mtx held.
+ * @param open_time When StNfc_hal_open was called, the open latency is
+ * recorded when HAL_NFC_OPEN_CPLT_EVT is delivered
+ * @return 0, or the error of the failed pthread call
+ */
+static int async_callback_resume(const struct timespec* open_time) {
   int ret;
 
-  memset(&async_callback_data, 0, sizeof(async_callback_data));
+  if (!async_callback_data.initialized) {
+    ret = pthread_mutex_init(&async_callback_data.mutex, NULL);
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_mutex_init failed", __func__);
+      return ret;
+    }
+    ret = pthread_cond_init(&async_callback_data.cond, NULL);
+    if (ret == 0) {
+      ret = pthread_cond_init(&async_callback_data.room_cond, NULL);
+    }
+    if (ret == 0) {
+      ret = pthread_cond_init(&async_callback_data.idle_cond, NULL);
+    }
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_cond_init failed", __func__);
+      return ret;
+    }
+    async_callback_data.queue = (async_callback_event_t*)malloc(
+        ASYNC_CALLBACK_QUEUE_SIZE * sizeof(async_callback_event_t));
+    if (async_callback_data.queue == NULL) {
+      STLOG_HAL_E("HAL: %s out of memory", __func__);
+      return ENOMEM;
+    }
+    async_callback_data.queue_size = ASYNC_CALLBACK_QUEUE_SIZE;
+    async_callback_data.initialized = 1;
+  }
 
-  ret = pthread_mutex_init(&async_callback_data.mutex, NULL);
+  ret = pthread_mutex_lock(&async_callback_data.mutex);
   if (ret != 0) {
-    STLOG_HAL_E("HAL: %s pthread_mutex_init failed", __func__);
+    STLOG_HAL_E("HAL: %s pthread_mutex_lock failed", __func__);
     return ret;
   }
 
-  ret = pthread_cond_init(&async_callback_data.cond, NULL);
-  if (ret != 0) {
-    STLOG_HAL_E("HAL: %s pthread_cond_init failed", __func__);
-    return ret;
+  if (!async_callback_data.thread_started) {
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&async_callback_data.thr, &attr,
+                         async_callback_thread_fct, &async_callback_data);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_create failed", __func__);
+      (void)pthread_mutex_unlock(&async_callback_data.mutex);
+      return ret;
+    }
+    async_callback_data.thread_started = 1;
   }
 
-  async_callback_data.thread_running = 1;
+  if (!async_callback_data.active) {
+    async_callback_data.stat_events = 0;
+    async_callback_data.stat_max_depth = 0;
+    async_callback_data.stat_full = 0;
+  }
+  async_callback_data.active = 1;
+  async_callback_data.quiesce = 0;
+  async_callback_data.open_time = *open_time;
+  async_callback_data.open_pending = 1;
 
-  ret = pthread_create(&async_callback_data.thr, NULL,
-                       async_callback_thread_fct, &async_callback_data);
+  ret = pthread_mutex_unlock(&async_callback_data.mutex);
   if (ret != 0) {
-    STLOG_HAL_E("HAL: %s pthread_create failed", __func__);
-    async_callback_data.thread_running = 0;
-    return ret;
+    STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
   }
-
-  return 0;
+  return ret;
 }
 
-static int async_callback_thread_end() {
-  if (async_callback_data.thread_running != 0) {
-    int ret;
+/**
+ * Wait for the callback thread to take the queued events, the last one
+ * being the close event, then for the stack to return from it, up to
+ * ASYNC_CALLBACK_QUIESCE_TIMEOUT_MS. The thread is kept for the next open.
+ * @return 0, or the error of the failed pthread call
+ */
+static int async_callback_quiesce() {
+  int ret;
+  bool on_callback_thread;
+  struct timespec deadline;
 
-    ret = pthread_mutex_lock(&async_callback_data.mutex);
-    if (ret != 0) {
-      STLOG_HAL_E("HAL: %s pthread_mutex_lock failed", __func__);
-      return ret;
-    }
+  if (!async_callback_data.initialized) {
+    return 0;
+  }
 
-    async_callback_data.stop_thread = 1;
+  ret = pthread_mutex_lock(&async_callback_data.mutex);
+  if (ret != 0) {
+    STLOG_HAL_E("HAL: %s pthread_mutex_lock failed", __func__);
+    return ret;
+  }
+  if (!async_callback_data.active) {
+    (void)pthread_mutex_unlock(&async_callback_data.mutex);
+    return 0;
+  }
 
-    // Wait for the thread to have no event pending
-    while (async_callback_data.thread_running &&
-           async_callback_data.event_pending) {
-      ret = pthread_cond_signal(&async_callback_data.cond);
-      if (ret != 0) {
-        STLOG_HAL_E("HAL: %s pthread_cond_signal failed", __func__);
-        return ret;
-      }
-      ret = pthread_cond_wait(&async_callback_data.cond,
-                              &async_callback_data.mutex);
-      if (ret != 0) {
-        STLOG_HAL_E("HAL: %s pthread_cond_wait failed", __func__);
-        break;
-      }
-    }
+  on_callback_thread = async_callback_data.thread_started &&
+                       pthread_equal(pthread_self(), async_callback_data.thr);
+  if (async_callback_data.queue_count == 0) {
+    async_callback_data.active = 0;
+  } else {
+    async_callback_data.quiesce = 1;
+  }
 
-    ret = pthread_mutex_unlock(&async_callback_data.mutex);
+  // The thread cannot take the events while we wait from it
+  while (!on_callback_thread && async_callback_data.active &&
+         async_callback_data.queue_count) {
+    ret = pthread_cond_wait(&async_callback_data.room_cond,
+                            &async_callback_data.mutex);
     if (ret != 0) {
-      STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
-      return ret;
+      STLOG_HAL_E("HAL: %s pthread_cond_wait failed", __func__);
+      break;
     }
+  }
 
-    ret = pthread_cond_signal(&async_callback_data.cond);
-    if (ret != 0) {
-      STLOG_HAL_E("HAL: %s pthread_cond_signal failed", __func__);
-      return ret;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += ASYNC_CALLBACK_QUIESCE_TIMEOUT_MS * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  while (!on_callback_thread && async_callback_data.delivering) {
+    ret = pthread_cond_timedwait(&async_callback_data.idle_cond,
+                                 &async_callback_data.mutex, &deadline);
+    if (ret == ETIMEDOUT) {
+      STLOG_HAL_W("HAL: %s stack still busy with the last event", __func__);
+      ret = 0;
+      break;
+    } else if (ret != 0) {
+      STLOG_HAL_E("HAL: %s pthread_cond_timedwait failed", __func__);
+      break;
     }
+  }
 
-    ret = pthread_detach(async_callback_data.thr);
-    if (ret != 0) {
-      STLOG_HAL_E("HAL: %s pthread_detach failed", __func__);
-      return ret;
-    }
+  STLOG_HAL_D(
+      "HAL st21nfc: %s %u events posted, max queue depth %u, %u posts "
+      "waited for room",
+      __func__, async_callback_data.stat_events,
+      async_callback_data.stat_max_depth, async_callback_data.stat_full);
+
+  if (pthread_mutex_unlock(&async_callback_data.mutex) != 0) {
+    STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
   }
-  return 0;
+  return ret;
+}
+
+/**
+ * Double the size of the event queue, keeping the queued events in order.
+ * Called with async_callback_data.mutex held.
+ * @return false if out of memory
+ */
+static bool async_callback_grow() {
+  uint32_t size = async_callback_data.queue_size * 2;
+  async_callback_event_t* queue =
+      (async_callback_event_t*)malloc(size * sizeof(async_callback_event_t));
+
+  if (queue == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < async_callback_data.queue_count; i++) {
+    queue[i] = async_callback_data.queue[(async_callback_data.queue_head + i) %
+                                         async_callback_data.queue_size];
+  }
+  free(async_callback_data.queue);
+  async_callback_data.queue = queue;
+  async_callback_data.queue_size = size;
+  async_callback_data.queue_head = 0;
+  return true;
 }
 
 static void async_callback_post(nfc_event_t event, nfc_status_t event_status) {
   int ret;
+  bool on_callback_thread;
 
-  if (pthread_equal(pthread_self(), async_callback_data.thr)) {
+  if (!async_callback_data.initialized) {
+    STLOG_HAL_E("HAL: %s callback thread not resumed", __func__);
     dev.p_cback_unwrap(event, event_status);
+    return;
   }
 
   ret = pthread_mutex_lock(&async_callback_data.mutex);
@@ -238,51 +405,134 @@ static void async_callback_post(nfc_event_t event, nfc_status_t event_status) {
     return;
   }
 
-  if (async_callback_data.thread_running == 0) {
+  on_callback_thread = async_callback_data.thread_started &&
+                       pthread_equal(pthread_self(), async_callback_data.thr);
+  if (async_callback_data.active == 0) {
     (void)pthread_mutex_unlock(&async_callback_data.mutex);
-    STLOG_HAL_E("HAL: %s thread is not running", __func__);
+    STLOG_HAL_E("HAL: %s callback thread not resumed", __func__);
     dev.p_cback_unwrap(event, event_status);
     return;
   }
 
-  while (async_callback_data.event_pending) {
-    ret = pthread_cond_wait(&async_callback_data.cond,
+  if (async_callback_data.queue_count == async_callback_data.queue_size) {
+    async_callback_data.stat_full++;
+    if (on_callback_thread) {
+      // Nobody else can make room, queue it behind the others anyway
+      if (!async_callback_grow()) {
+        (void)pthread_mutex_unlock(&async_callback_data.mutex);
+        STLOG_HAL_E("HAL: %s queue full, event %d delivered inline",
+                    __func__, event);
+        dev.p_cback_unwrap(event, event_status);
+        return;
+      }
+      STLOG_HAL_W("HAL: %s queue full, grown to %u events", __func__,
+                  async_callback_data.queue_size);
+    } else {
+      STLOG_HAL_W("HAL: %s queue full, waiting for the callback thread",
+                  __func__);
+    }
+  }
+  while (async_callback_data.active &&
+         (async_callback_data.queue_count == async_callback_data.queue_size)) {
+    ret = pthread_cond_wait(&async_callback_data.room_cond,
                             &async_callback_data.mutex);
     if (ret != 0) {
       STLOG_HAL_E("HAL: %s pthread_cond_wait failed", __func__);
+      (void)pthread_mutex_unlock(&async_callback_data.mutex);
       return;
     }
   }
-
-  async_callback_data.event_pending = 1;
-  async_callback_data.event = event;
-  async_callback_data.event_status = event_status;
-
-  ret = pthread_mutex_unlock(&async_callback_data.mutex);
-  if (ret != 0) {
-    STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
+  if (async_callback_data.active == 0) {
+    // Quiesced while we were waiting
+    (void)pthread_mutex_unlock(&async_callback_data.mutex);
+    dev.p_cback_unwrap(event, event_status);
     return;
   }
 
+  async_callback_event_t* e =
+      &async_callback_data.queue[(async_callback_data.queue_head +
+                                  async_callback_data.queue_count) %
+                                 async_callback_data.queue_size];
+  e->event = event;
+  e->event_status = event_status;
+  clock_gettime(CLOCK_MONOTONIC, &e->post_time);
+  async_callback_data.queue_count++;
+  async_callback_data.stat_events++;
+  if (async_callback_data.queue_count > async_callback_data.stat_max_depth) {
+    async_callback_data.stat_max_depth = async_callback_data.queue_count;
+  }
+
   ret = pthread_cond_signal(&async_callback_data.cond);
   if (ret != 0) {
     STLOG_HAL_E("HAL: %s pthread_cond_signal failed", __func__);
+  }
+
+  ret = pthread_mutex_unlock(&async_callback_data.mutex);
+  if (ret != 0) {
+    STLOG_HAL_E("HAL: %s pthread_mutex_unlock failed", __func__);
     return;
   }
 }
 /* ------ */
 
+/**
+ * Mode the NFCC is left in when the HAL is closed: on if card emulation is
+ * kept in switch off state (CE_ON_SWITCH_OFF_STATE), quick boot if it is also
+ * kept while charging (STNFC_USB_CHARGING_MODE), off otherwise.
+ */
+static int hal_nfc_mode() {
+  if (HalConfigNum<HAL_CFG_CE_ON_SWITCH_OFF_STATE>() != 0x1) {
+    return NFC_MODE_OFF;
+  }
+  if (HalConfigNum<HAL_CFG_STNFC_USB_CHARGING_MODE>() == 1) {
+    return NFC_MODE_QuickBoot;
+  }
+  return NFC_MODE_ON;
+}
+
+/**
+ * Take the writes off the lock-free path, and wait for the ones in flight.
+ * Called with hal_mtx held.
+ * @param state HAL_STATE_CLOSING to make the writes fail,
+ *              HAL_STATE_POST_INIT to make them wait for hal_mtx
+ */
+static void hal_writers_drain(int state) {
+  hal_state = state;
+
+  (void)pthread_mutex_lock(&hal_writers_mtx);
+  while (hal_writers != 0) {
+    (void)pthread_cond_wait(&hal_writers_cond, &hal_writers_mtx);
+  }
+  (void)pthread_mutex_unlock(&hal_writers_mtx);
+}
+
+/**
+ * End of a write counted in hal_writers, waking hal_writers_drain up if it
+ * was the last one.
+ */
+static void hal_writer_exit() {
+  if ((--hal_writers == 0) && (hal_state != HAL_STATE_OPEN)) {
+    (void)pthread_mutex_lock(&hal_writers_mtx);
+    (void)pthread_cond_broadcast(&hal_writers_cond);
+    (void)pthread_mutex_unlock(&hal_writers_mtx);
+  }
+}
+
 int StNfc_hal_open(nfc_stack_callback_t* p_cback,
                    nfc_stack_data_callback_t* p_data_cback) {
   bool result = false;
+  struct timespec open_time;
 
   STLOG_HAL_D("HAL st21nfc: %s %s", __func__, halVersion);
 
+  clock_gettime(CLOCK_MONOTONIC, &open_time);
   (void)pthread_mutex_lock(&hal_mtx);
 
-  if (!hal_is_closed) {
-    hal_wrapper_close(0, nfc_mode);
+  if (hal_state != HAL_STATE_CLOSED) {
+    hal_writers_drain(HAL_STATE_CLOSING);
+    hal_wrapper_close(0, hal_nfc_mode());
   }
+  hal_state = HAL_STATE_OPENING;
 
   dev.p_cback = p_cback;  // will be replaced by wrapper version
   dev.p_cback_unwrap = p_cback;
@@ -291,9 +541,9 @@ int StNfc_hal_open(nfc_stack_callback_t* p_cback,
   // Initialize and get global logging level
   InitializeSTLogLevel();
 
-  if ((hal_is_closed || !async_callback_data.thread_running) &&
-      (async_callback_thread_start() != 0)) {
+  if (async_callback_resume(&open_time) != 0) {
     dev.p_cback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_FAILED);
+    hal_state = HAL_STATE_CLOSED;
     (void)pthread_mutex_unlock(&hal_mtx);
     return -1;  // We are doomed, stop it here, NOW !
   }
@@ -302,10 +552,11 @@ int StNfc_hal_open(nfc_stack_callback_t* p_cback,
 
   if (!result || !(dev.hHAL)) {
     async_callback_post(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_FAILED);
+    hal_state = HAL_STATE_CLOSED;
     (void)pthread_mutex_unlock(&hal_mtx);
     return -1;  // We are doomed, stop it here, NOW !
   }
-  hal_is_closed = 0;
+  hal_state = HAL_STATE_OPEN;
   (void)pthread_mutex_unlock(&hal_mtx);
   return 0;
 }
@@ -313,22 +564,39 @@ int StNfc_hal_open(nfc_stack_callback_t* p_cback,
 int StNfc_hal_write(uint16_t data_len, const uint8_t* p_data) {
   STLOG_HAL_D("HAL st21nfc: %s", __func__);
 
-  /* check if HAL is closed */
   int ret = (int)data_len;
-  (void)pthread_mutex_lock(&hal_mtx);
-  if (hal_is_closed) {
-    ret = 0;
-  }
 
   if (!ret) {
-    (void)pthread_mutex_unlock(&hal_mtx);
     return ret;
   }
-  if (!HalSendDownstream(dev.hHAL, p_data, data_len)) {
-    STLOG_HAL_E("HAL st21nfc %s  SendDownstream failed", __func__);
+
+  // Once open, writes only have to keep close from stopping HAL Core under
+  // them, see hal_writers_drain
+  hal_writers++;
+  if (hal_state == HAL_STATE_OPEN) {
+    // Don't sleep forever on a stuck bus
+    if (!HalTrySendDownstream(dev.hHAL, p_data, data_len,
+                              HAL_WRITE_TIMEOUT_MS)) {
+      STLOG_HAL_E("HAL st21nfc %s  SendDownstream failed", __func__);
+      ret = 0;
+    }
+    hal_writer_exit();
+    return ret;
+  }
+  hal_writer_exit();
+
+  // Closed, being opened or sending the post-init config: wait for the end
+  // of the transition
+  (void)pthread_mutex_lock(&hal_mtx);
+  if (hal_state != HAL_STATE_OPEN) {
     (void)pthread_mutex_unlock(&hal_mtx);
     return 0;
   }
+  if (!HalTrySendDownstream(dev.hHAL, p_data, data_len,
+                            HAL_WRITE_TIMEOUT_MS)) {
+    STLOG_HAL_E("HAL st21nfc %s  SendDownstream failed", __func__);
+    ret = 0;
+  }
   (void)pthread_mutex_unlock(&hal_mtx);
 
   return ret;
@@ -340,7 +608,16 @@ int StNfc_hal_core_initialized(uint8_t* p_core_init_rsp_params) {
   (void)pthread_mutex_lock(&hal_mtx);
   hal_dta_state = *p_core_init_rsp_params;
 
-  hal_wrapper_send_config();
+  // The config commands wait for their answer one by one, keep the writes
+  // from slipping in between until the wrapper is READY. The data written
+  // before goes out first, HAL Core orders the commands of the wrapper.
+  if (hal_state == HAL_STATE_OPEN) {
+    hal_writers_drain(HAL_STATE_POST_INIT);
+    hal_wrapper_send_config();
+    hal_state = HAL_STATE_OPEN;
+  } else {
+    hal_wrapper_send_config();
+  }
   (void)pthread_mutex_unlock(&hal_mtx);
 
   return 0;  // return != 0 to signal ready immediate
@@ -357,26 +634,26 @@ int StNfc_hal_close(int nfc_mode_value) {
 
   /* check if HAL is closed */
   (void)pthread_mutex_lock(&hal_mtx);
-  if (hal_is_closed) {
+  if (hal_state == HAL_STATE_CLOSED) {
     (void)pthread_mutex_unlock(&hal_mtx);
     return 1;
   }
+  hal_writers_drain(HAL_STATE_CLOSING);
   if (hal_wrapper_close(1, nfc_mode_value) == 0) {
-    hal_is_closed = 1;
+    hal_state = HAL_STATE_CLOSED;
     (void)pthread_mutex_unlock(&hal_mtx);
     return 1;
   }
-  hal_is_closed = 1;
+  hal_state = HAL_STATE_CLOSED;
   (void)pthread_mutex_unlock(&hal_mtx);
 
   hal_dta_state = 0;
 
-  if (async_callback_thread_end() != 0) {
-    STLOG_HAL_E("HAL st21nfc: %s async_callback_thread_end failed", __func__);
+  if (async_callback_quiesce() != 0) {
+    STLOG_HAL_E("HAL st21nfc: %s async_callback_quiesce failed", __func__);
     return -1;  // We are doomed, stop it here, NOW !
   }
 
-  usleep(10000);  // give 10ms for the callback thread to pass the binder
   STLOG_HAL_D("HAL st21nfc: %s close", __func__);
   return 0;
 }
@@ -393,7 +670,7 @@ int StNfc_hal_power_cycle() {
   /* check if HAL is closed */
   int ret = HAL_NFC_STATUS_OK;
   (void)pthread_mutex_lock(&hal_mtx);
-  if (hal_is_closed) {
+  if (hal_state != HAL_STATE_OPEN) {
     ret = HAL_NFC_STATUS_FAILED;
   }
 
@@ -415,120 +692,102 @@ void StNfc_hal_factoryReset() {
 
 int StNfc_hal_closeForPowerOffCase() {
   STLOG_HAL_D("HAL st21nfc: %s", __func__);
-  if (nfc_mode == 1) {
+  int nfc_mode = hal_nfc_mode();
+  if (nfc_mode == NFC_MODE_ON) {
     return 0;
   } else {
     return StNfc_hal_close(nfc_mode);
   }
 }
 
-void StNfc_hal_getConfig(android::hardware::nfc::V1_1::NfcConfig& config) {
-  STLOG_HAL_D("HAL st21nfc: %s", __func__);
-  unsigned long num = 0;
+/**
+ * Build the vendor config from the current settings.
+ * @return the config, owned by the caller
+ */
+static android::hardware::nfc::V1_2::NfcConfig* hal_config_build() {
+  android::hardware::nfc::V1_2::NfcConfig* config =
+      new android::hardware::nfc::V1_2::NfcConfig();
+  android::hardware::nfc::V1_1::NfcConfig& v1_1 = config->v1_1;
   std::array<uint8_t, 10> buffer;
 
   buffer.fill(0);
   long retlen = 0;
 
-  memset(&config, 0x00, sizeof(android::hardware::nfc::V1_1::NfcConfig));
-
-  if (GetNumValue(NAME_CE_ON_SWITCH_OFF_STATE, &num, sizeof(num))) {
-    if (num == 0x1) {
-      nfc_mode = 0x1;
-    }
-  }
-
-  if (GetNumValue(NAME_POLL_BAIL_OUT_MODE, &num, sizeof(num))) {
-    config.nfaPollBailOutMode = num;
-  }
-
-  if (GetNumValue(NAME_ISO_DEP_MAX_TRANSCEIVE, &num, sizeof(num))) {
-    config.maxIsoDepTransceiveLength = num;
-  }
-  if (GetNumValue(NAME_DEFAULT_OFFHOST_ROUTE, &num, sizeof(num))) {
-    config.defaultOffHostRoute = num;
-  }
-  if (GetNumValue(NAME_DEFAULT_NFCF_ROUTE, &num, sizeof(num))) {
-    config.defaultOffHostRouteFelica = num;
-  }
-  if (GetNumValue(NAME_DEFAULT_SYS_CODE_ROUTE, &num, sizeof(num))) {
-    config.defaultSystemCodeRoute = num;
-  }
-  if (GetNumValue(NAME_DEFAULT_SYS_CODE_PWR_STATE, &num, sizeof(num))) {
-    config.defaultSystemCodePowerState = num;
-  }
-  if (GetNumValue(NAME_DEFAULT_ROUTE, &num, sizeof(num))) {
-    config.defaultRoute = num;
-  }
-  if (GetByteArrayValue(NAME_DEVICE_HOST_WHITE_LIST, (char*)buffer.data(),
-                        buffer.size(), &retlen)) {
-    config.hostWhitelist.resize(retlen);
+  // Absent settings are left to 0, their registry default
+  v1_1.nfaPollBailOutMode = HalConfigNum<HAL_CFG_POLL_BAIL_OUT_MODE>();
+  v1_1.maxIsoDepTransceiveLength =
+      HalConfigNum<HAL_CFG_ISO_DEP_MAX_TRANSCEIVE>();
+  v1_1.defaultOffHostRoute = HalConfigNum<HAL_CFG_DEFAULT_OFFHOST_ROUTE>();
+  v1_1.defaultOffHostRouteFelica = HalConfigNum<HAL_CFG_DEFAULT_NFCF_ROUTE>();
+  v1_1.defaultSystemCodeRoute = HalConfigNum<HAL_CFG_DEFAULT_SYS_CODE_ROUTE>();
+  v1_1.defaultSystemCodePowerState =
+      HalConfigNum<HAL_CFG_DEFAULT_SYS_CODE_PWR_STATE>();
+  v1_1.defaultRoute = HalConfigNum<HAL_CFG_DEFAULT_ROUTE>();
+  // retlen is -1 if the value does not fit, the setting is ignored then
+  if ((HalConfigBytes<HAL_CFG_DEVICE_HOST_WHITE_LIST>(
+          buffer.data(), buffer.size(), &retlen)) &&
+      (retlen >= 0)) {
+    v1_1.hostWhitelist.resize(retlen);
     for (int i = 0; i < retlen; i++) {
-      config.hostWhitelist[i] = buffer[i];
+      v1_1.hostWhitelist[i] = buffer[i];
     }
   }
 
-  if (GetNumValue(NAME_OFF_HOST_ESE_PIPE_ID, &num, sizeof(num))) {
-    config.offHostESEPipeId = num;
-  }
-  if (GetNumValue(NAME_OFF_HOST_SIM_PIPE_ID, &num, sizeof(num))) {
-    config.offHostSIMPipeId = num;
-  }
-  if ((GetByteArrayValue(NAME_NFA_PROPRIETARY_CFG, (char*)buffer.data(),
-                         buffer.size(), &retlen)) &&
+  v1_1.offHostESEPipeId = HalConfigNum<HAL_CFG_OFF_HOST_ESE_PIPE_ID>();
+  v1_1.offHostSIMPipeId = HalConfigNum<HAL_CFG_OFF_HOST_SIM_PIPE_ID>();
+  if ((HalConfigBytes<HAL_CFG_NFA_PROPRIETARY_CFG>(buffer.data(),
+                                                   buffer.size(), &retlen)) &&
       (retlen == 9)) {
-    config.nfaProprietaryCfg.protocol18092Active = (uint8_t)buffer[0];
-    config.nfaProprietaryCfg.protocolBPrime = (uint8_t)buffer[1];
-    config.nfaProprietaryCfg.protocolDual = (uint8_t)buffer[2];
-    config.nfaProprietaryCfg.protocol15693 = (uint8_t)buffer[3];
-    config.nfaProprietaryCfg.protocolKovio = (uint8_t)buffer[4];
-    config.nfaProprietaryCfg.protocolMifare = (uint8_t)buffer[5];
-    config.nfaProprietaryCfg.discoveryPollKovio = (uint8_t)buffer[6];
-    config.nfaProprietaryCfg.discoveryPollBPrime = (uint8_t)buffer[7];
-    config.nfaProprietaryCfg.discoveryListenBPrime = (uint8_t)buffer[8];
+    v1_1.nfaProprietaryCfg.protocol18092Active = (uint8_t)buffer[0];
+    v1_1.nfaProprietaryCfg.protocolBPrime = (uint8_t)buffer[1];
+    v1_1.nfaProprietaryCfg.protocolDual = (uint8_t)buffer[2];
+    v1_1.nfaProprietaryCfg.protocol15693 = (uint8_t)buffer[3];
+    v1_1.nfaProprietaryCfg.protocolKovio = (uint8_t)buffer[4];
+    v1_1.nfaProprietaryCfg.protocolMifare = (uint8_t)buffer[5];
+    v1_1.nfaProprietaryCfg.discoveryPollKovio = (uint8_t)buffer[6];
+    v1_1.nfaProprietaryCfg.discoveryPollBPrime = (uint8_t)buffer[7];
+    v1_1.nfaProprietaryCfg.discoveryListenBPrime = (uint8_t)buffer[8];
   } else {
-    memset(&config.nfaProprietaryCfg, 0xFF, sizeof(ProtocolDiscoveryConfig));
+    memset(&v1_1.nfaProprietaryCfg, 0xFF, sizeof(ProtocolDiscoveryConfig));
   }
-  if (GetNumValue(NAME_PRESENCE_CHECK_ALGORITHM, &num, sizeof(num))) {
-    config.presenceCheckAlgorithm = (PresenceCheckAlgorithm)num;
-  }
-
-  if (GetNumValue(NAME_STNFC_USB_CHARGING_MODE, &num, sizeof(num))) {
-    if ((num == 1) && (nfc_mode == 0x1)) {
-      nfc_mode = 0x2;
-    }
-  }
-}
+  v1_1.presenceCheckAlgorithm =
+      (PresenceCheckAlgorithm)HalConfigNum<HAL_CFG_PRESENCE_CHECK_ALGORITHM>();
 
-void StNfc_hal_getConfig_1_2(android::hardware::nfc::V1_2::NfcConfig& config) {
-  STLOG_HAL_D("HAL st21nfc: %s", __func__);
-  unsigned long num = 0;
-  std::array<uint8_t, 10> buffer;
-
-  buffer.fill(0);
-  long retlen = 0;
-
-  memset(&config, 0x00, sizeof(android::hardware::nfc::V1_2::NfcConfig));
-
-  StNfc_hal_getConfig(config.v1_1);
-
-  if (GetByteArrayValue(NAME_OFFHOST_ROUTE_UICC, (char*)buffer.data(),
-                        buffer.size(), &retlen)) {
-    config.offHostRouteUicc.resize(retlen);
+  if ((HalConfigBytes<HAL_CFG_OFFHOST_ROUTE_UICC>(buffer.data(), buffer.size(),
+                                                  &retlen)) &&
+      (retlen >= 0)) {
+    config->offHostRouteUicc.resize(retlen);
     for (int i = 0; i < retlen; i++) {
-      config.offHostRouteUicc[i] = buffer[i];
+      config->offHostRouteUicc[i] = buffer[i];
     }
   }
 
-  if (GetByteArrayValue(NAME_OFFHOST_ROUTE_ESE, (char*)buffer.data(),
-                        buffer.size(), &retlen)) {
-    config.offHostRouteEse.resize(retlen);
+  if ((HalConfigBytes<HAL_CFG_OFFHOST_ROUTE_ESE>(buffer.data(), buffer.size(),
+                                                 &retlen)) &&
+      (retlen >= 0)) {
+    config->offHostRouteEse.resize(retlen);
     for (int i = 0; i < retlen; i++) {
-      config.offHostRouteEse[i] = buffer[i];
+      config->offHostRouteEse[i] = buffer[i];
     }
   }
 
-  if (GetNumValue(NAME_DEFAULT_ISODEP_ROUTE, &num, sizeof(num))) {
-    config.defaultIsoDepRoute = num;
-  }
+  config->defaultIsoDepRoute = HalConfigNum<HAL_CFG_DEFAULT_ISODEP_ROUTE>();
+  return config;
+}
+
+std::shared_ptr<const android::hardware::nfc::V1_2::NfcConfig>
+StNfc_hal_getConfig() {
+  STLOG_HAL_D("HAL st21nfc: %s", __func__);
+  // Read first: a reload during the build makes the next call rebuild it
+  uint32_t generation = HalConfigGeneration();
+
+  (void)pthread_mutex_lock(&config_mtx);
+  if (!config_cache || (config_cache_generation != generation)) {
+    config_cache.reset(hal_config_build());
+    config_cache_generation = generation;
+  }
+  std::shared_ptr<const android::hardware::nfc::V1_2::NfcConfig> config =
+      config_cache;
+  (void)pthread_mutex_unlock(&config_mtx);
+  return config;
 }
@@ -0,0 +1,295 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+
+/*
+ * Writes of several threads against the lifecycle of the 1.2 HAL, over the
+ * NFCC simulator.
+ */
+
+#include <gtest/gtest.h>
+#include <hardware/nfc.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "StNfc_hal_api.h"
+#include "bench_common.h"
+#include "i2ctransport.h"
+
+#define WRITER_THREADS 4
+/* time the NFCC takes to process CORE_SET_CONFIG */
+#define SET_CONFIG_DELAY_US 20000
+
+/* one CORE_SET_CONFIG command, sent at post init */
+static const char testConfig[] =
+    "CORE_CONF_PROP={ 20, 02, 0a, 03, a1, 01, 19, a2, 01, 15, 80, 01, 01 }\n";
+
+/* the same, the FW DBG config is then set at post init */
+static const char testFwDbgConfig[] =
+    "STNFC_FW_DEBUG_ENABLED=1\n"
+    "CORE_CONF_PROP={ 20, 02, 0a, 03, a1, 01, 19, a2, 01, 15, 80, 01, 01 }\n";
+
+static sem_t testEvent; /* stack events */
+static sem_t testData;  /* upstream frames */
+
+/* set from the CORE_SET_CONFIG command until the answer to the last post-init
+   command is read, see testRecordingTransport */
+static std::atomic<bool> testConfigPending;
+static std::atomic<uint32_t> testConfigCmds;
+/* data packets written to the NFCC while testConfigPending was set */
+static std::atomic<uint32_t> testInterleaved;
+static std::atomic<uint32_t> testDataPackets;
+/* passes CORE_SET_CONFIG to the simulator after SET_CONFIG_DELAY_US */
+static std::thread testSetConfig;
+/* the FW DBG config command is lost instead of sent to the simulator */
+static std::atomic<bool> testDropFwDbg;
+static std::atomic<uint32_t> testFwDbgDropped;
+
+static ssize_t TestTransportRead(int fd, uint8_t* buffer, size_t length) {
+  static const uint8_t getConfigRsp[] = {0x4F, 0x02, 0x06};
+  ssize_t n = i2cSimTransport.read(fd, buffer, length);
+
+  // PROP_RSP to the FW DBG config read, the last post-init command
+  for (ssize_t i = 0; i + (ssize_t)sizeof(getConfigRsp) <= n; i++) {
+    if (memcmp(buffer + i, getConfigRsp, sizeof(getConfigRsp)) == 0) {
+      testConfigPending = false;
+      break;
+    }
+  }
+  return n;
+}
+
+static ssize_t TestTransportWrite(int fd, const uint8_t* buffer,
+                                  size_t length) {
+  if ((length >= 2) && (buffer[0] == 0x20) && (buffer[1] == 0x02)) {
+    std::vector<uint8_t> cmd(buffer, buffer + length);
+    testConfigCmds++;
+    testConfigPending = true;
+    // Meanwhile, the link is free for the writes
+    testSetConfig = std::thread([fd, cmd] {
+      usleep(SET_CONFIG_DELAY_US);
+      i2cSimTransport.write(fd, cmd.data(), cmd.size());
+    });
+    return length;
+  } else if (testDropFwDbg && (length >= 4) && (buffer[0] == 0x2F) &&
+             (buffer[1] == 0x02) && (buffer[3] == 0x04)) {
+    // PROP_SET_CONFIG of the FW DBG traces, never answered
+    testFwDbgDropped++;
+    return length;
+  } else if ((length >= 1) && ((buffer[0] & 0xE0) == 0x00)) {
+    testDataPackets++;
+    if (testConfigPending) {
+      testInterleaved++;
+    }
+  }
+  return i2cSimTransport.write(fd, buffer, length);
+}
+
+/* the simulator, slow to set the config, watching the data packets sent
+   during the post-init config, optionally losing the FW DBG config */
+static const I2cTransport testRecordingTransport = {
+    "test",
+    i2cSimTransport.open,
+    i2cSimTransport.close,
+    TestTransportRead,
+    TestTransportWrite,
+    i2cSimTransport.getWakeup,
+    i2cSimTransport.resetPulse,
+    i2cSimTransport.setPolarity,
+};
+
+static void TestEventCallback(nfc_event_t event, nfc_status_t status) {
+  (void)event;
+  (void)status;
+  sem_post(&testEvent);
+}
+
+static void TestDataCallback(uint16_t length, uint8_t* data) {
+  (void)length;
+  (void)data;
+  sem_post(&testData);
+}
+
+class HalSt21nfcTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(BenchConfig(testConfig));
+    I2cSetTransport(&testRecordingTransport);
+    sem_init(&testEvent, 0, 0);
+    sem_init(&testData, 0, 0);
+    testConfigPending = false;
+    testConfigCmds = 0;
+    testInterleaved = 0;
+    testDataPackets = 0;
+    testDropFwDbg = false;
+    testFwDbgDropped = 0;
+    stop = false;
+    writes = 0;
+    failedWrites = 0;
+  }
+
+  void TearDown() override {
+    StopWriters();
+    StNfc_hal_close(NFC_MODE_OFF);
+    if (testSetConfig.joinable()) {
+      testSetConfig.join();
+    }
+    sem_destroy(&testEvent);
+    sem_destroy(&testData);
+  }
+
+  /* Open until HAL_NFC_OPEN_CPLT_EVT, then CORE_RESET and CORE_INIT */
+  void Open() {
+    static const uint8_t coreReset[] = {0x20, 0x00, 0x01, 0x01};
+    static const uint8_t coreInit[] = {0x20, 0x01, 0x02, 0x00, 0x00};
+
+    ASSERT_EQ(0, StNfc_hal_open(TestEventCallback, TestDataCallback));
+    ASSERT_TRUE(BenchWait(&testEvent, 1));
+    // CORE_RESET_RSP and CORE_RESET_NTF, then CORE_INIT_RSP
+    ASSERT_NE(0, StNfc_hal_write(sizeof(coreReset), coreReset));
+    ASSERT_TRUE(BenchWait(&testData, 2));
+    ASSERT_NE(0, StNfc_hal_write(sizeof(coreInit), coreInit));
+    ASSERT_TRUE(BenchWait(&testData, 1));
+  }
+
+  /* Data packets from WRITER_THREADS threads, until StopWriters */
+  void StartWriters() {
+    for (int i = 0; i < WRITER_THREADS; i++) {
+      writers.emplace_back([this, i] {
+        const uint8_t data[] = {0x00, 0x00, 0x02, (uint8_t)i, 0x00};
+        while (!stop) {
+          if (StNfc_hal_write(sizeof(data), data) != 0) {
+            writes++;
+          } else {
+            failedWrites++;
+          }
+          usleep(100);
+        }
+      });
+    }
+  }
+
+  void StopWriters() {
+    stop = true;
+    for (auto& t : writers) {
+      t.join();
+    }
+    writers.clear();
+  }
+
+  /* Wait for count writes accepted in total */
+  bool WaitForWrites(uint32_t count) {
+    for (int ms = 0; ms < BENCH_TIMEOUT_MS; ms++) {
+      if (writes >= count) {
+        return true;
+      }
+      usleep(1000);
+    }
+    return false;
+  }
+
+  /* StNfc_hal_core_initialized, aborting if it does not return: it holds
+     hal_mtx, nothing could be cleaned up */
+  void PostInit() {
+    uint8_t coreInitRspParams = 0;
+    sem_t done;
+
+    sem_init(&done, 0, 0);
+    std::thread post([&done, &coreInitRspParams] {
+      EXPECT_EQ(0, StNfc_hal_core_initialized(&coreInitRspParams));
+      sem_post(&done);
+    });
+    if (!BenchWait(&done, 1)) {
+      fprintf(stderr, "StNfc_hal_core_initialized does not return\n");
+      abort();
+    }
+    post.join();
+    sem_destroy(&done);
+  }
+
+  /* Wait for the accepted writes to go through HAL Core to the NFCC */
+  bool WaitForDataPackets() {
+    for (int ms = 0; ms < BENCH_TIMEOUT_MS; ms++) {
+      if (testDataPackets == writes) {
+        return true;
+      }
+      usleep(1000);
+    }
+    return false;
+  }
+
+  std::vector<std::thread> writers;
+  std::atomic<bool> stop;
+  std::atomic<uint32_t> writes;
+  std::atomic<uint32_t> failedWrites;
+};
+
+TEST_F(HalSt21nfcTest, WritesWaitForPostInitConfig) {
+  Open();
+  StartWriters();
+  // Let the writers reach the lock-free path first
+  ASSERT_TRUE(WaitForWrites(WRITER_THREADS));
+
+  // Returns once the wrapper is READY, HAL_NFC_POST_INIT_CPLT_EVT
+  PostInit();
+  EXPECT_TRUE(BenchWait(&testEvent, 1));
+  EXPECT_TRUE(WaitForWrites(writes + WRITER_THREADS));
+  StopWriters();
+
+  EXPECT_EQ(1u, testConfigCmds.load());
+  EXPECT_FALSE(testConfigPending.load());
+  EXPECT_EQ(0u, testInterleaved.load());
+  EXPECT_EQ(0u, failedWrites.load());
+  EXPECT_TRUE(WaitForDataPackets());
+}
+
+TEST_F(HalSt21nfcTest, CloseDrainsWrites) {
+  Open();
+  StartWriters();
+  ASSERT_TRUE(WaitForWrites(10 * WRITER_THREADS));
+
+  EXPECT_EQ(0, StNfc_hal_close(NFC_MODE_OFF));
+  // Writes accepted before close reached the NFCC, the later ones fail
+  while (failedWrites < WRITER_THREADS) {
+    usleep(100);
+  }
+  StopWriters();
+  EXPECT_EQ(writes.load(), testDataPackets.load());
+}
+
+TEST_F(HalSt21nfcTest, PostInitEndsWithoutFwDbgAnswer) {
+  ASSERT_TRUE(BenchConfig(testFwDbgConfig));
+  testDropFwDbg = true;
+  Open();
+  StartWriters();
+  ASSERT_TRUE(WaitForWrites(WRITER_THREADS));
+
+  // The command timer expires and the NFCC is reset, post init gives up
+  PostInit();
+  EXPECT_EQ(1u, testFwDbgDropped.load());
+  // The writes held meanwhile go through again
+  EXPECT_TRUE(WaitForWrites(writes + WRITER_THREADS));
+  StopWriters();
+  EXPECT_EQ(0u, failedWrites.load());
+}
@@ -17,11 +17,81 @@
  *
  ******************************************************************************/
 #include "android_logmsg.h"
+#include "hal_config.h"
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include "halring.h"
+
+/* largest NCI frame */
+#define TRACE_DATA_MAX 258
+/* records waiting to be formatted, dropped beyond */
+#define TRACE_RING_SIZE 512
+/* the drain thread collects what was recorded meanwhile before formatting */
+#define TRACE_DRAIN_DELAY_MS 10
+#define TRACE_DRAIN_NICE 10
+
+typedef struct {
+  struct timespec time;
+  const char* title; /* static string */
+  uint16_t length;   /* frame size */
+  uint16_t stored;   /* bytes kept in data */
+  bool hidden;       /* payload removed for privacy */
+  uint8_t data[TRACE_DATA_MAX];
+} TraceRecord;
 
 void DispHal(const char* title, const void* data, size_t length);
 unsigned char hal_trace_level = STNFC_TRACE_LEVEL_DEBUG;
 
+static std::atomic<bool> traceDeferred(false);
+static HalRing<TraceRecord> traceRing;
+static std::atomic<bool> drainParked(false);
+static std::atomic<uint32_t> traceDropped(0);
+static int drainEventFd = -1;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_once_t levelListenerOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drainMtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void TraceStart();
+
+/*******************************************************************************
+**
+** Function:        LogLevelChanged
+**
+** Description:     Apply a new STNFC_HAL_LOGLEVEL after a config reload.
+**
+** Returns:         None
+**
+*******************************************************************************/
+static void LogLevelChanged(const char* name) {
+  unsigned long num = 0;
+  (void)name;
+
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_LOGLEVEL>(&num)) {
+    hal_trace_level = (unsigned char)num;
+  }
+  STLOG_HAL_D("%s: level=%u", __func__, hal_trace_level);
+}
+
+/*******************************************************************************
+**
+** Function:        LogLevelListen
+**
+** Description:     Follow STNFC_HAL_LOGLEVEL across config reloads.
+**
+** Returns:         None
+**
+*******************************************************************************/
+static void LogLevelListen() {
+  AddConfigListener(NAME_STNFC_HAL_LOGLEVEL, LogLevelChanged);
+}
+
 /*******************************************************************************
 **
 ** Function:        InitializeGlobalAppLogLevel
@@ -44,72 +114,262 @@ unsigned char hal_trace_level = STNFC_TRACE_LEVEL_DEBUG;
 unsigned char InitializeSTLogLevel() {
   unsigned long num = 0;
 
-  num = 1;
-  if (GetNumValue(NAME_STNFC_HAL_LOGLEVEL, &num, sizeof(num)))
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_LOGLEVEL>(&num))
     hal_trace_level = (unsigned char)num;
+  pthread_once(&levelListenerOnce, LogLevelListen);
+
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_TRACE_DEFERRED>() == 1) {
+    pthread_once(&traceOnce, TraceStart);
+  }
 
   STLOG_HAL_D("%s: level=%u", __func__, hal_trace_level);
   return hal_trace_level;
 }
 
-void DispHal(const char* title, const void* data, size_t length) {
-  uint8_t* d = (uint8_t*)data;
+/*******************************************************************************
+**
+** Function:        TraceFormat
+**
+** Description:     Print an NCI frame as hex to the log, 32 bytes per line.
+**
+** Returns:         None
+**
+*******************************************************************************/
+static void TraceFormat(const TraceRecord* r) {
   char line[100];
+  char prefix[32];
   size_t i, k;
   bool first_line = true;
-  bool privacy = false;
 
-  if (hal_trace_level & STNFC_TRACE_FLAG_PRIVACY) {
-    if ((length > 3) &&
-        // DATA message
-        (((d[0] & 0xE0) == 0) ||
-         // routing table contains the AIDs
-         ((d[0] == 0x21) && (d[1] == 0x01)) ||
-         // NTF showing which AID was selected
-         ((d[0] == 0x61) && (d[1] == 0x09)))) {
-      // We hide the payload for GSMA TS27 15.9.3.2.*
-      privacy = true;
-    }
+  if (r->length == 0) {
+    STLOG_HAL_D("%s", r->title);
+    return;
   }
 
-  line[0] = 0;
-  if (length == 0) {
-    STLOG_HAL_D("%s", title);
-    return;
+  // Formatted later on, tell when the frame was seen
+  prefix[0] = 0;
+  if (traceDeferred.load(std::memory_order_relaxed)) {
+    snprintf(prefix, sizeof(prefix), "[%ld.%06ld] ", (long)r->time.tv_sec,
+             r->time.tv_nsec / 1000);
   }
-  for (i = 0, k = 0; i < (privacy ? 3 : length); i++, k++) {
+
+  line[0] = 0;
+  for (i = 0, k = 0; i < r->stored; i++, k++) {
     if (k > 31) {
       k = 0;
       if (first_line == true) {
         first_line = false;
-        if (title[0] == 'R') {
-          STLOG_HAL_D("Rx %s\n", line);
-        } else if (title[0] == 'T') {
-          STLOG_HAL_D("Tx %s\n", line);
+        if (r->title[0] == 'R') {
+          STLOG_HAL_D("%sRx %s\n", prefix, line);
+        } else if (r->title[0] == 'T') {
+          STLOG_HAL_D("%sTx %s\n", prefix, line);
         } else {
-          STLOG_HAL_D("%s\n", line);
+          STLOG_HAL_D("%s%s\n", prefix, line);
         }
       } else {
         STLOG_HAL_D("%s\n", line);
       }
       line[k] = 0;
     }
-    sprintf(&line[k * 3], "%02x ", d[i]);
+    sprintf(&line[k * 3], "%02x ", r->data[i]);
   }
 
-  if (privacy) {
+  if (r->hidden) {
     sprintf(&line[k * 3], "(hidden)");
   }
 
   if (first_line == true) {
-    if (title[0] == 'R') {
-      STLOG_HAL_D("Rx %s\n", line);
-    } else if (title[0] == 'T') {
-      STLOG_HAL_D("Tx %s\n", line);
+    if (r->title[0] == 'R') {
+      STLOG_HAL_D("%sRx %s\n", prefix, line);
+    } else if (r->title[0] == 'T') {
+      STLOG_HAL_D("%sTx %s\n", prefix, line);
     } else {
-      STLOG_HAL_D("%s\n", line);
+      STLOG_HAL_D("%s%s\n", prefix, line);
     }
   } else {
     STLOG_HAL_D("%s\n", line);
   }
 }
+
+/*******************************************************************************
+**
+** Function:        DispHalFlush
+**
+** Description:     Format the frames recorded so far by DispHal.
+**
+** Returns:         None
+**
+*******************************************************************************/
+void DispHalFlush() {
+  TraceRecord r;
+
+  if (!traceDeferred.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  (void)pthread_mutex_lock(&drainMtx);
+  uint32_t dropped = traceDropped.exchange(0);
+  if (dropped) {
+    STLOG_HAL_W("trace ring full, %u frames not logged\n", dropped);
+  }
+  while (traceRing.pop(&r)) {
+    TraceFormat(&r);
+  }
+  (void)pthread_mutex_unlock(&drainMtx);
+}
+
+/*******************************************************************************
+**
+** Function:        TraceDrainThread
+**
+** Description:     Low priority thread formatting the recorded frames. It
+**                  parks on an eventfd the first recorder after it signals.
+**
+** Returns:         None
+**
+*******************************************************************************/
+static void* TraceDrainThread(void* arg) {
+  struct pollfd pfd;
+  uint64_t count;
+  (void)arg;
+
+  setpriority(PRIO_PROCESS, 0, TRACE_DRAIN_NICE);
+
+  pfd.fd = drainEventFd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    DispHalFlush();
+
+    // Pairs with the fence in DispHal, as for the HAL worker
+    drainParked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!traceRing.empty()) {
+      drainParked.store(false);
+      continue;
+    }
+
+    pfd.revents = 0;
+    if ((poll(&pfd, 1, -1) > 0) && (pfd.revents & POLLIN)) {
+      read(drainEventFd, &count, sizeof(count));
+    }
+    drainParked.store(false);
+    // Let the rest of the burst be recorded
+    usleep(TRACE_DRAIN_DELAY_MS * 1000);
+  }
+  return NULL;
+}
+
+/*******************************************************************************
+**
+** Function:        TraceStart
+**
+** Description:     Allocate the trace ring and start the drain thread, once
+**                  per process.
+**
+** Returns:         None
+**
+*******************************************************************************/
+static void TraceStart() {
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (!traceRing.init(TRACE_RING_SIZE)) {
+    STLOG_HAL_E("%s: no memory for trace ring, tracing inline", __func__);
+    return;
+  }
+  drainEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (drainEventFd == -1) {
+    STLOG_HAL_E("%s: unable to open eventfd, tracing inline", __func__);
+    traceRing.release();
+    return;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, TraceDrainThread, NULL) != 0) {
+    STLOG_HAL_E("%s: unable to start drain thread, tracing inline", __func__);
+    close(drainEventFd);
+    drainEventFd = -1;
+    traceRing.release();
+  } else {
+    traceDeferred.store(true, std::memory_order_release);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/*******************************************************************************
+**
+** Function:        DispHalPrivate
+**
+** Description:     Tell whether the payload of an NCI frame must not be
+**                  traced, see STNFC_TRACE_FLAG_PRIVACY.
+**
+** Returns:         true if only the header may be traced
+**
+*******************************************************************************/
+bool DispHalPrivate(const void* data, size_t length) {
+  const uint8_t* d = (const uint8_t*)data;
+
+  if (hal_trace_level & STNFC_TRACE_FLAG_PRIVACY) {
+    if ((length > 3) &&
+        // DATA message
+        (((d[0] & 0xE0) == 0) ||
+         // routing table contains the AIDs
+         ((d[0] == 0x21) && (d[1] == 0x01)) ||
+         // NTF showing which AID was selected
+         ((d[0] == 0x61) && (d[1] == 0x09)))) {
+      // We hide the payload for GSMA TS27 15.9.3.2.*
+      return true;
+    }
+  }
+  return false;
+}
+
+/*******************************************************************************
+**
+** Function:        DispHal
+**
+** Description:     Trace an NCI frame. The bytes are recorded in the trace
+**                  ring and formatted later on by the drain thread, or right
+**                  away if STNFC_HAL_TRACE_DEFERRED is 0.
+**                  The title must be a static string.
+**
+** Returns:         None
+**
+*******************************************************************************/
+void DispHal(const char* title, const void* data, size_t length) {
+  const uint8_t* d = (const uint8_t*)data;
+  TraceRecord r;
+
+  if ((hal_trace_level & STNFC_TRACE_LEVEL_MASK) < STNFC_TRACE_LEVEL_DEBUG) {
+    return;
+  }
+
+  r.hidden = DispHalPrivate(d, length);
+  if (length > TRACE_DATA_MAX) {
+    length = TRACE_DATA_MAX;
+  }
+  r.title = title;
+  r.length = length;
+  r.stored = r.hidden ? 3 : length;
+  // Only the header of a hidden frame is ever copied
+  memcpy(r.data, d, r.stored);
+
+  if (!traceDeferred.load(std::memory_order_acquire)) {
+    TraceFormat(&r);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &r.time);
+  if (!traceRing.push(r)) {
+    traceDropped++;
+    return;
+  }
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (drainParked.exchange(false)) {
+    uint64_t one = 1;
+    write(drainEventFd, &one, sizeof(one));
+  }
+}
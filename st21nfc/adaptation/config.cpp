@@ -20,13 +20,23 @@
  *
  *
  ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
 #include <log/log.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <list>
+#include <unistd.h>
+#include <atomic>
 #include <string>
 #include <vector>
 #include "android_logmsg.h"
+#include "hal_config.h"
 const char alternative_config_path[] = "";
 const char* transport_config_paths[] = {"/odm/etc/", "/vendor/etc/", "/etc/"};
 
@@ -35,46 +45,99 @@ const int transport_config_path_size =
 #define config_name "libnfc-hal-st.conf"
 #define extra_config_base "libnfc-st-"
 #define extra_config_ext ".conf"
+/* compiled form of the base config file, in the vendor data of the HAL */
+#define config_cache_path "/data/vendor/nfc/libnfc-hal-st.bin"
+#define CONFIG_CACHE_MAGIC 0x46435453 /* "STCF" */
+#define CONFIG_CACHE_VERSION 1
 #define IsStringValue 0x80000000
+/* quiet time after a file change before reloading */
+#define CONFIG_RELOAD_DELAY_MS 100
+/* poll period while waiting for readers of a replaced snapshot */
+#define CONFIG_GRACE_POLL_US 1000
+#define CONFIG_LISTENER_MAX 16
 
 using namespace ::std;
 
-class CNfcParam : public string {
- public:
-  CNfcParam();
-  CNfcParam(const char* name, const string& value);
-  CNfcParam(const char* name, unsigned long value);
-  virtual ~CNfcParam();
-  unsigned long numValue() const { return m_numValue; }
-  const char* str_value() const { return m_str_value.c_str(); }
-  size_t str_len() const { return m_str_value.length(); }
+/* one setting, its name and string value are in the string pool */
+typedef struct {
+  uint32_t hash;      /* FNV-1a of the name */
+  uint32_t name;      /* offset of the name in the pool */
+  uint32_t value;     /* offset of the string value in the pool */
+  uint32_t valueLen;  /* length of the string value, 0 if numerical */
+  unsigned long numValue;
+} CNfcParam;
 
- private:
-  string m_str_value;
-  unsigned long m_numValue;
-};
+/*
+ * Cache file header, followed by the settings, the hash index and the string
+ * pool, each starting on an 8 bytes boundary. The cache is used as long as
+ * the base file has the recorded path, size, inode and mtime.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t paramSize; /* sizeof(CNfcParam), differs between ABIs */
+  uint32_t paramCount;
+  uint32_t indexSize;
+  uint32_t poolSize;
+  uint64_t sourceSize;
+  uint64_t sourceIno;
+  int64_t sourceMtimeNs;
+  char sourcePath[256];
+} CNfcConfigCacheHeader;
 
-class CNfcConfig : public vector<const CNfcParam*> {
+/*
+ * Settings of the base file and of the optional files read on top of it.
+ * A snapshot is never modified once published, a reload builds a new one.
+ */
+class CNfcConfig {
  public:
+  CNfcConfig();
+  CNfcConfig(const CNfcConfig& other);
   virtual ~CNfcConfig();
-  static CNfcConfig& GetInstance();
-  friend void readOptionalConfig(const char* optional);
 
-  bool getValue(const char* name, char* pValue, size_t& len) const;
-  bool getValue(const char* name, unsigned long& rValue) const;
-  bool getValue(const char* name, unsigned short& rValue) const;
-  bool getValue(const char* name, char* pValue, long len, long* readlen) const;
+  bool readConfig(const char* name);
+  bool readCache(const char* path, const char* source,
+                 const struct stat* pSourceStat);
+  void writeCache(const char* path, const char* source,
+                  const struct stat* pSourceStat) const;
+  bool getValue(const CNfcParam* pParam, char* pValue, size_t& len) const;
+  bool getValue(const CNfcParam* pParam, unsigned long& rValue) const;
+  bool getValue(const CNfcParam* pParam, char* pValue, long len,
+                long* readlen) const;
   const CNfcParam* find(const char* p_name) const;
-  void clean();
+  const CNfcParam* find(HalConfigKey key) const {
+    return (m_keys[key] != 0) ? &m_paramData[m_keys[key] - 1] : NULL;
+  }
+  void resolveKeys();
+  const char* strValue(const CNfcParam* pParam) const {
+    return &m_poolData[pParam->value];
+  }
+  bool empty() const { return m_paramCount == 0; }
+  bool changed(const CNfcConfig* pOther, const char* p_name) const;
 
  private:
-  CNfcConfig();
-  bool readConfig(const char* name, bool bResetContent);
-  void moveFromList();
-  void moveToList();
-  void add(const CNfcParam* pParam);
-  list<const CNfcParam*> m_list;
-  bool mValidFile;
+  const CNfcParam* find(const char* p_name, uint32_t hash) const;
+  void parse(const char* data, size_t length);
+  void add(const string& name, const string& strValue, unsigned long numValue);
+  uint32_t poolAdd(const char* data, size_t length);
+  void rehash(size_t slots);
+  void sync();
+  /* names and string values, NUL terminated */
+  vector<char> m_pool;
+  vector<CNfcParam> m_params;
+  /* open addressing on the name hash, index in m_params + 1, 0 if free */
+  vector<uint32_t> m_index;
+  /* what lookups use: the vectors above or a mapped cache file */
+  const char* m_poolData;
+  size_t m_poolSize;
+  const CNfcParam* m_paramData;
+  size_t m_paramCount;
+  const uint32_t* m_indexData;
+  size_t m_indexSize;
+  void* m_map;
+  size_t m_mapSize;
+  /* settings of the registry, index in m_paramData + 1, 0 if absent */
+  uint32_t m_keys[HAL_CFG_KEY_COUNT];
 
   unsigned long state;
 
@@ -83,6 +146,48 @@ class CNfcConfig : public vector<const CNfcParam*> {
   inline void Reset(unsigned long f) { state &= ~f; }
 };
 
+typedef struct {
+  const char* name;
+  ConfigListener listener;
+} CNfcConfigListener;
+
+typedef struct {
+  const char* name;
+  uint32_t hash;
+} CNfcConfigKey;
+
+/* names and hashes of the registry, by HalConfigKey */
+static constexpr CNfcConfigKey configKeys[HAL_CFG_KEY_COUNT] = {
+#define HAL_CONFIG_NAME(name, type, def) \
+  {NAME_##name, HalConfigHash(NAME_##name)},
+    HAL_CONFIG_KEYS(HAL_CONFIG_NAME)
+#undef HAL_CONFIG_NAME
+};
+
+/* published snapshot, readers use it without locking */
+static std::atomic<const CNfcConfig*> configCurrent(NULL);
+/* incremented after each snapshot replacing the first one */
+static std::atomic<uint32_t> configGeneration(0);
+/*
+ * Readers between configAcquire() and configRelease(), counted on the side
+ * given by the parity of configEpoch when they entered.
+ */
+static std::atomic<uint32_t> configEpoch(0);
+static std::atomic<uint32_t> configReaders[2];
+static pthread_once_t configOnce = PTHREAD_ONCE_INIT;
+/* serializes the writers: reload, optional files, listeners */
+static pthread_mutex_t configWriteMtx = PTHREAD_MUTEX_INITIALIZER;
+static string configPath;
+static string configDir; /* HalConfigSetDir, empty for the default paths */
+static vector<string> configOptionalPaths;
+static CNfcConfigListener configListeners[CONFIG_LISTENER_MAX];
+static int configListenerCount = 0;
+/* inotify instance watching the config directories, -1 if disabled */
+static int configWatchFd = -1;
+/* snapshot parsed from the base file alone, to save by HalConfigSaveCache */
+static const CNfcConfig* configCachePending = NULL;
+static struct stat configCacheSource;
+
 /*******************************************************************************
 **
 ** Function:    isPrintable()
@@ -160,13 +265,48 @@ void findConfigFile(const string& configName, string& filePath) {
 **
 ** Function:    CNfcConfig::readConfig()
 **
-** Description: read Config settings and parse them into a linked list
-**              move the element from linked list to a array at the end
+** Description: map a config file and parse its settings on top of the
+**              current ones
 **
-** Returns:     1, if there are any config data, 0 otherwise
+** Returns:     true if the file could be opened
 **
 *******************************************************************************/
-bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
+bool CNfcConfig::readConfig(const char* name) {
+  struct stat file_stat;
+  int fd;
+
+  /* open config file, map it for parsing */
+  if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+    STLOG_HAL_W("%s Cannot open config file %s\n", __func__, name);
+    return false;
+  }
+  STLOG_HAL_D("%s Opened config %s\n", __func__, name);
+
+  if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+    void* data =
+        mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      parse((const char*)data, file_stat.st_size);
+      munmap(data, file_stat.st_size);
+    } else {
+      STLOG_HAL_W("%s Cannot map config file %s\n", __func__, name);
+    }
+  }
+  close(fd);
+
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::parse()
+**
+** Description: parse the content of a config file into settings
+**
+** Returns:     none
+**
+*******************************************************************************/
+void CNfcConfig::parse(const char* data, size_t length) {
   enum {
     BEGIN_LINE = 1,
     TOKEN,
@@ -177,37 +317,17 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
     END_LINE
   };
 
-  FILE* fd = NULL;
   string token;
   string strValue;
   unsigned long numValue = 0;
-  CNfcParam* pParam = NULL;
   int i = 0;
   int base = 0;
   char c = 0;
   int bflag = 0;
   state = BEGIN_LINE;
-  /* open config file, read it into a buffer */
-  if ((fd = fopen(name, "rb")) == NULL) {
-    STLOG_HAL_W("%s Cannot open config file %s\n", __func__, name);
-    if (bResetContent) {
-      STLOG_HAL_W("%s Using default value for all settings\n", __func__);
-      mValidFile = false;
-    }
-    return false;
-  }
-  STLOG_HAL_D("%s Opened %s config %s\n", __func__,
-              (bResetContent ? "base" : "optional"), name);
-
-  mValidFile = true;
-  if (size() > 0) {
-    if (bResetContent)
-      clean();
-    else
-      moveToList();
-  }
 
-  while (!feof(fd) && fread(&c, 1, 1, fd) == 1) {
+  for (size_t pos = 0; pos < length; pos++) {
+    c = data[pos];
     switch (state & 0xff) {
       case BEGIN_LINE:
         if (c == '#')
@@ -305,11 +425,7 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
             int n = (i + 1) / 2;
             while (n-- > 0) strValue.push_back(((numValue >> (n * 8)) & 0xFF));
           }
-          if (strValue.length() > 0)
-            pParam = new CNfcParam(token.c_str(), strValue);
-          else
-            pParam = new CNfcParam(token.c_str(), numValue);
-          add(pParam);
+          add(token, strValue, numValue);
           strValue.erase();
           numValue = 0;
         }
@@ -318,8 +434,7 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
         if (c == '"') {
           strValue.push_back('\0');
           state = END_LINE;
-          pParam = new CNfcParam(token.c_str(), strValue);
-          add(pParam);
+          add(token, strValue, 0);
         } else if (isPrintable(c))
           strValue.push_back(c);
         break;
@@ -330,11 +445,6 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
         break;
     }
   }
-
-  fclose(fd);
-
-  moveFromList();
-  return size() > 0;
 }
 
 /*******************************************************************************
@@ -346,46 +456,51 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcConfig::CNfcConfig() : mValidFile(true) {}
+CNfcConfig::CNfcConfig()
+    : m_poolData(NULL),
+      m_poolSize(0),
+      m_paramData(NULL),
+      m_paramCount(0),
+      m_indexData(NULL),
+      m_indexSize(0),
+      m_map(NULL),
+      m_mapSize(0),
+      state(0) {
+  memset(m_keys, 0, sizeof(m_keys));
+}
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::~CNfcConfig()
+** Function:    CNfcConfig::CNfcConfig()
 **
-** Description: class destructor
+** Description: class copy constructor, the copy can be extended even if the
+**              original is a mapped cache file
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcConfig::~CNfcConfig() {}
+CNfcConfig::CNfcConfig(const CNfcConfig& other)
+    : m_pool(other.m_poolData, other.m_poolData + other.m_poolSize),
+      m_params(other.m_paramData, other.m_paramData + other.m_paramCount),
+      m_index(other.m_indexData, other.m_indexData + other.m_indexSize),
+      m_map(NULL),
+      m_mapSize(0),
+      state(0) {
+  memcpy(m_keys, other.m_keys, sizeof(m_keys));
+  sync();
+}
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::GetInstance()
+** Function:    CNfcConfig::~CNfcConfig()
 **
-** Description: get class singleton object
+** Description: class destructor
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcConfig& CNfcConfig::GetInstance() {
-  static CNfcConfig theInstance;
-
-  if (theInstance.size() == 0 && theInstance.mValidFile) {
-    string strPath;
-    if (alternative_config_path[0] != '\0') {
-      strPath.assign(alternative_config_path);
-      strPath += config_name;
-      theInstance.readConfig(strPath.c_str(), true);
-      if (!theInstance.empty()) {
-        return theInstance;
-      }
-    }
-    findConfigFile(config_name, strPath);
-    theInstance.readConfig(strPath.c_str(), true);
-  }
-
-  return theInstance;
+CNfcConfig::~CNfcConfig() {
+  if (m_map != NULL) munmap(m_map, m_mapSize);
 }
 
 /*******************************************************************************
@@ -398,14 +513,14 @@ CNfcConfig& CNfcConfig::GetInstance() {
 **              false if setting does not exist
 **
 *******************************************************************************/
-bool CNfcConfig::getValue(const char* name, char* pValue, size_t& len) const {
-  const CNfcParam* pParam = find(name);
+bool CNfcConfig::getValue(const CNfcParam* pParam, char* pValue,
+                          size_t& len) const {
   if (pParam == NULL || pValue == NULL) return false;
 
-  if (pParam->str_len() > 0) {
+  if (pParam->valueLen > 0) {
     memset(pValue, 0, len);
-    if (len > pParam->str_len()) len = pParam->str_len();
-    memcpy(pValue, pParam->str_value(), len);
+    if (len > pParam->valueLen) len = pParam->valueLen;
+    memcpy(pValue, strValue(pParam), len);
     return true;
   }
   return false;
@@ -420,15 +535,14 @@ bool CNfcConfig::getValue(const char* name, char* pValue, size_t& len) const {
 **              false if setting does not exist
 **
 *******************************************************************************/
-bool CNfcConfig::getValue(const char* name, char* pValue, long len,
+bool CNfcConfig::getValue(const CNfcParam* pParam, char* pValue, long len,
                           long* readlen) const {
-  const CNfcParam* pParam = find(name);
   if (pParam == NULL) return false;
-  if (pParam->str_len() > 0) {
-    if (pParam->str_len() <= (unsigned long)len) {
+  if (pParam->valueLen > 0) {
+    if (pParam->valueLen <= (unsigned long)len) {
       memset(pValue, 0, len);
-      memcpy(pValue, pParam->str_value(), pParam->str_len());
-      *readlen = pParam->str_len();
+      memcpy(pValue, strValue(pParam), pParam->valueLen);
+      *readlen = pParam->valueLen;
     } else {
       *readlen = -1;
     }
@@ -440,194 +554,661 @@ bool CNfcConfig::getValue(const char* name, char* pValue, long len,
 **
 ** Function:    CNfcConfig::getValue()
 **
-** Description: get a long numerical value of a setting
+** Description: get a numerical value of a setting, byte arrays of up to
+**              3 bytes are read as big endian numbers
 **
 ** Returns:     true if setting exists
 **              false if setting does not exist
 **
 *******************************************************************************/
-bool CNfcConfig::getValue(const char* name, unsigned long& rValue) const {
-  const CNfcParam* pParam = find(name);
+bool CNfcConfig::getValue(const CNfcParam* pParam,
+                          unsigned long& rValue) const {
   if (pParam == NULL) return false;
 
-  if (pParam->str_len() == 0) {
-    rValue = static_cast<unsigned long>(pParam->numValue());
-    return true;
+  unsigned long v = pParam->numValue;
+  if (v == 0 && pParam->valueLen > 0 && pParam->valueLen < 4) {
+    const unsigned char* p = (const unsigned char*)strValue(pParam);
+    for (size_t i = 0; i < pParam->valueLen; ++i) {
+      v *= 256;
+      v += *p++;
+    }
   }
-  return false;
+  rValue = v;
+  return true;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::getValue()
+** Function:    CNfcConfig::find()
 **
-** Description: get a short numerical value of a setting
+** Description: look a setting up in the hash index, no allocation
 **
-** Returns:     true if setting exists
-**              false if setting does not exist
+** Returns:     pointer to the setting object
 **
 *******************************************************************************/
-bool CNfcConfig::getValue(const char* name, unsigned short& rValue) const {
-  const CNfcParam* pParam = find(name);
-  if (pParam == NULL) return false;
-
-  if (pParam->str_len() == 0) {
-    rValue = static_cast<unsigned short>(pParam->numValue());
-    return true;
-  }
-  return false;
+const CNfcParam* CNfcConfig::find(const char* p_name) const {
+  return find(p_name, HalConfigHash(p_name));
 }
 
 /*******************************************************************************
 **
 ** Function:    CNfcConfig::find()
 **
-** Description: search if a setting exist in the setting array
+** Description: look a setting up in the hash index, its hash already known
 **
 ** Returns:     pointer to the setting object
 **
 *******************************************************************************/
-const CNfcParam* CNfcConfig::find(const char* p_name) const {
-  if (size() == 0) return NULL;
-
-  for (const_iterator it = begin(), itEnd = end(); it != itEnd; ++it) {
-    if (**it < p_name)
-      continue;
-    else if (**it == p_name) {
-      if ((*it)->str_len() > 0) {
-        STLOG_HAL_D("%s found %s=%s\n", __func__, p_name, (*it)->str_value());
-      } else {
-        STLOG_HAL_D("%s found %s=(0x%lX)\n", __func__, p_name,
-                    (*it)->numValue());
-      }
-      return *it;
-    } else
-      break;
+const CNfcParam* CNfcConfig::find(const char* p_name, uint32_t hash) const {
+  if (m_paramCount == 0) return NULL;
+
+  size_t mask = m_indexSize - 1;
+
+  for (size_t slot = hash & mask; m_indexData[slot] != 0;
+       slot = (slot + 1) & mask) {
+    const CNfcParam* pParam = &m_paramData[m_indexData[slot] - 1];
+    if (pParam->hash == hash &&
+        strcmp(&m_poolData[pParam->name], p_name) == 0) {
+      return pParam;
+    }
   }
   return NULL;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::clean()
+** Function:    CNfcConfig::resolveKeys()
+**
+** Description: look the settings of the registry up once, so that the typed
+**              accessors only index an array. Called before publishing.
+**
+** Returns:     none
+**
+*******************************************************************************/
+void CNfcConfig::resolveKeys() {
+  for (int key = 0; key < HAL_CFG_KEY_COUNT; key++) {
+    const CNfcParam* pParam = find(configKeys[key].name, configKeys[key].hash);
+    m_keys[key] = (pParam != NULL) ? (pParam - m_paramData) + 1 : 0;
+  }
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::changed()
+**
+** Description: compare a setting with the one of another snapshot
+**
+** Returns:     true if the setting was added, removed or has another value
+**
+*******************************************************************************/
+bool CNfcConfig::changed(const CNfcConfig* pOther, const char* p_name) const {
+  const CNfcParam* pParam = find(p_name);
+  const CNfcParam* pOtherParam = pOther ? pOther->find(p_name) : NULL;
+
+  if (pParam == NULL || pOtherParam == NULL) return pParam != pOtherParam;
+  return pParam->numValue != pOtherParam->numValue ||
+         pParam->valueLen != pOtherParam->valueLen ||
+         memcmp(strValue(pParam), pOther->strValue(pOtherParam),
+                pParam->valueLen) != 0;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::poolAdd()
+**
+** Description: copy a name or a string value to the pool, NUL terminated
+**
+** Returns:     offset of the copy in the pool
+**
+*******************************************************************************/
+uint32_t CNfcConfig::poolAdd(const char* data, size_t length) {
+  uint32_t offset = m_pool.size();
+
+  m_pool.insert(m_pool.end(), data, data + length);
+  m_pool.push_back('\0');
+  return offset;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::rehash()
+**
+** Description: rebuild the hash index with the given number of slots,
+**              a power of two
+**
+** Returns:     none
+**
+*******************************************************************************/
+void CNfcConfig::rehash(size_t slots) {
+  size_t mask = slots - 1;
+
+  m_index.assign(slots, 0);
+  for (size_t i = 0; i < m_params.size(); i++) {
+    size_t slot = m_params[i].hash & mask;
+    while (m_index[slot] != 0) slot = (slot + 1) & mask;
+    m_index[slot] = i + 1;
+  }
+  sync();
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::add()
+**
+** Description: add a setting, replacing an earlier one with the same name
+**
+** Returns:     none
+**
+*******************************************************************************/
+void CNfcConfig::add(const string& name, const string& strValue,
+                     unsigned long numValue) {
+  // The token keeps the NUL added when '=' was met
+  const char* p_name = name.c_str();
+  CNfcParam* pParam = (CNfcParam*)find(p_name);
+
+  if (pParam == NULL) {
+    CNfcParam param;
+    param.hash = HalConfigHash(p_name);
+    param.name = poolAdd(p_name, strlen(p_name));
+    m_params.push_back(param);
+    // Keep the index at most half full
+    if (m_params.size() * 2 > m_index.size()) {
+      rehash(m_index.empty() ? 64 : m_index.size() * 2);
+    } else {
+      size_t mask = m_index.size() - 1;
+      size_t slot = param.hash & mask;
+      while (m_index[slot] != 0) slot = (slot + 1) & mask;
+      m_index[slot] = m_params.size();
+    }
+    pParam = &m_params.back();
+  }
+
+  pParam->valueLen = strValue.length();
+  pParam->value = poolAdd(strValue.data(), strValue.length());
+  pParam->numValue = (strValue.length() > 0) ? 0 : numValue;
+  sync();
+
+  if (pParam->valueLen > 0) {
+    STLOG_HAL_D("%s %s=%s\n", __func__, p_name, strValue.c_str());
+  } else {
+    STLOG_HAL_D("%s %s=(0x%lX)\n", __func__, p_name, numValue);
+  }
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::sync()
 **
-** Description: reset the setting array
+** Description: point the lookups at the vectors after they changed
 **
 ** Returns:     none
 **
 *******************************************************************************/
-void CNfcConfig::clean() {
-  if (size() == 0) return;
+void CNfcConfig::sync() {
+  m_poolData = m_pool.data();
+  m_poolSize = m_pool.size();
+  m_paramData = m_params.data();
+  m_paramCount = m_params.size();
+  m_indexData = m_index.data();
+  m_indexSize = m_index.size();
+}
+
+/*******************************************************************************
+**
+** Function:    configCacheAlign()
+**
+** Description: round a cache file offset up to 8 bytes
+**
+** Returns:     aligned offset
+**
+*******************************************************************************/
+static size_t configCacheAlign(size_t offset) { return (offset + 7) & ~7; }
+
+/*******************************************************************************
+**
+** Function:    configMtimeNs()
+**
+** Description: modification time of a file in nanoseconds
+**
+** Returns:     the time
+**
+*******************************************************************************/
+static int64_t configMtimeNs(const struct stat* pStat) {
+  return (int64_t)pStat->st_mtim.tv_sec * 1000000000 + pStat->st_mtim.tv_nsec;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::readCache()
+**
+** Description: map the compiled form of a config file, if it is the one of
+**              the current content of the source file
+**
+** Returns:     true if the cache is used
+**
+*******************************************************************************/
+bool CNfcConfig::readCache(const char* path, const char* source,
+                           const struct stat* pSourceStat) {
+  struct stat file_stat;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return false;
+  if (fstat(fd, &file_stat) != 0 ||
+      (size_t)file_stat.st_size < sizeof(CNfcConfigCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  const CNfcConfigCacheHeader* pHeader = (const CNfcConfigCacheHeader*)data;
+  size_t fileSize = file_stat.st_size;
+
+  // The source is checked with the stat done anyway to find it, the content
+  // only against what the HAL itself could have written
+  bool valid =
+      pHeader->magic == CONFIG_CACHE_MAGIC &&
+      pHeader->version == CONFIG_CACHE_VERSION &&
+      pHeader->paramSize == sizeof(CNfcParam) &&
+      pHeader->sourceSize == (uint64_t)pSourceStat->st_size &&
+      pHeader->sourceIno == (uint64_t)pSourceStat->st_ino &&
+      pHeader->sourceMtimeNs == configMtimeNs(pSourceStat) &&
+      strncmp(pHeader->sourcePath, source, sizeof(pHeader->sourcePath)) == 0 &&
+      pHeader->paramCount <= fileSize / sizeof(CNfcParam) &&
+      pHeader->indexSize <= fileSize / sizeof(uint32_t) &&
+      pHeader->paramCount < pHeader->indexSize &&
+      (pHeader->indexSize & (pHeader->indexSize - 1)) == 0 &&
+      pHeader->poolSize > 0 && pHeader->poolSize <= fileSize;
+
+  size_t paramOffset = configCacheAlign(sizeof(CNfcConfigCacheHeader));
+  size_t indexOffset =
+      configCacheAlign(paramOffset + pHeader->paramCount * sizeof(CNfcParam));
+  size_t poolOffset =
+      configCacheAlign(indexOffset + pHeader->indexSize * sizeof(uint32_t));
+  const CNfcParam* pParams = (const CNfcParam*)((char*)data + paramOffset);
+  const uint32_t* pIndex = (const uint32_t*)((char*)data + indexOffset);
+  const char* pPool = (const char*)data + poolOffset;
+
+  valid = valid && poolOffset + pHeader->poolSize == fileSize &&
+          pPool[pHeader->poolSize - 1] == '\0';
+  uint32_t used = 0;
+  for (uint32_t i = 0; valid && i < pHeader->indexSize; i++) {
+    valid = pIndex[i] <= pHeader->paramCount;
+    used += (pIndex[i] != 0);
+  }
+  valid = valid && used == pHeader->paramCount;
+  for (uint32_t i = 0; valid && i < pHeader->paramCount; i++) {
+    valid = pParams[i].name < pHeader->poolSize &&
+            pParams[i].value < pHeader->poolSize &&
+            pParams[i].valueLen < pHeader->poolSize - pParams[i].value;
+  }
+  if (!valid) {
+    STLOG_HAL_D("%s %s is out of date\n", __func__, path);
+    munmap(data, file_stat.st_size);
+    return false;
+  }
 
-  for (iterator it = begin(), itEnd = end(); it != itEnd; ++it) delete *it;
-  clear();
+  m_map = data;
+  m_mapSize = file_stat.st_size;
+  m_poolData = pPool;
+  m_poolSize = pHeader->poolSize;
+  m_paramData = pParams;
+  m_paramCount = pHeader->paramCount;
+  m_indexData = pIndex;
+  m_indexSize = pHeader->indexSize;
+  STLOG_HAL_D("%s Using %s for %s\n", __func__, path, source);
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function:    configWriteAt()
+**
+** Description: write a block of the cache file at the given offset
+**
+** Returns:     true if everything was written
+**
+*******************************************************************************/
+static bool configWriteAt(int fd, const void* data, size_t length,
+                          size_t offset) {
+  while (length > 0) {
+    ssize_t n = pwrite(fd, data, length, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data = (const char*)data + n;
+    length -= n;
+    offset += n;
+  }
+  return true;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::Add()
+** Function:    CNfcConfig::writeCache()
 **
-** Description: add a setting object to the list
+** Description: save the compiled form of the settings read from a config
+**              file, replacing the previous one at once
 **
 ** Returns:     none
 **
 *******************************************************************************/
-void CNfcConfig::add(const CNfcParam* pParam) {
-  if (m_list.size() == 0) {
-    m_list.push_back(pParam);
+void CNfcConfig::writeCache(const char* path, const char* source,
+                            const struct stat* pSourceStat) const {
+  CNfcConfigCacheHeader header;
+  string tmpPath(path);
+  int fd;
+
+  if (m_paramCount == 0 || strlen(source) >= sizeof(header.sourcePath)) {
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = CONFIG_CACHE_MAGIC;
+  header.version = CONFIG_CACHE_VERSION;
+  header.paramSize = sizeof(CNfcParam);
+  header.paramCount = m_paramCount;
+  header.indexSize = m_indexSize;
+  header.poolSize = m_poolSize;
+  header.sourceSize = pSourceStat->st_size;
+  header.sourceIno = pSourceStat->st_ino;
+  header.sourceMtimeNs = configMtimeNs(pSourceStat);
+  strcpy(header.sourcePath, source);
+
+  size_t paramOffset = configCacheAlign(sizeof(header));
+  size_t indexOffset =
+      configCacheAlign(paramOffset + m_paramCount * sizeof(CNfcParam));
+  size_t poolOffset =
+      configCacheAlign(indexOffset + m_indexSize * sizeof(uint32_t));
+
+  tmpPath += ".tmp";
+  if ((fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0600)) < 0) {
+    STLOG_HAL_D("%s Cannot create %s (%s)\n", __func__, tmpPath.c_str(),
+                strerror(errno));
     return;
   }
-  for (list<const CNfcParam*>::iterator it = m_list.begin(),
-                                        itEnd = m_list.end();
-       it != itEnd; ++it) {
-    if (**it < pParam->c_str()) continue;
-    m_list.insert(it, pParam);
+  bool written =
+      configWriteAt(fd, &header, sizeof(header), 0) &&
+      configWriteAt(fd, m_paramData, m_paramCount * sizeof(CNfcParam),
+                    paramOffset) &&
+      configWriteAt(fd, m_indexData, m_indexSize * sizeof(uint32_t),
+                    indexOffset) &&
+      configWriteAt(fd, m_poolData, m_poolSize, poolOffset);
+  if (close(fd) != 0) written = false;
+
+  if (!written || rename(tmpPath.c_str(), path) != 0) {
+    STLOG_HAL_W("%s Cannot write %s\n", __func__, path);
+    unlink(tmpPath.c_str());
     return;
   }
-  m_list.push_back(pParam);
+  STLOG_HAL_D("%s %s compiled to %s\n", __func__, source, path);
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::moveFromList()
+** Function:    configBuild()
+**
+** Description: read the base file and the optional files into a new
+**              snapshot
 **
-** Description: move the setting object from list to array
+** Returns:     the snapshot, NULL if the base file cannot be read
+**
+*******************************************************************************/
+static CNfcConfig* configBuild() {
+  CNfcConfig* pConfig = new CNfcConfig();
+  struct stat source;
+
+  configCachePending = NULL;
+  // Only the base file alone is compiled, optional files come later
+  bool cached = configOptionalPaths.empty() &&
+                stat(configPath.c_str(), &source) == 0 &&
+                S_ISREG(source.st_mode);
+  if (cached &&
+      pConfig->readCache(config_cache_path, configPath.c_str(), &source)) {
+    return pConfig;
+  }
+
+  if (!pConfig->readConfig(configPath.c_str())) {
+    delete pConfig;
+    return NULL;
+  }
+  for (size_t i = 0; i < configOptionalPaths.size(); i++) {
+    pConfig->readConfig(configOptionalPaths[i].c_str());
+  }
+  // Written at the next HAL open, not on the path of the first lookup
+  configCachePending = cached ? pConfig : NULL;
+  configCacheSource = source;
+  return pConfig;
+}
+
+/*******************************************************************************
+**
+** Function:    configPublish()
+**
+** Description: replace the current snapshot, notify the listeners of the
+**              settings that changed and free the previous snapshot once no
+**              reader can use it anymore. Called with configWriteMtx held.
 **
 ** Returns:     none
 **
 *******************************************************************************/
-void CNfcConfig::moveFromList() {
-  if (m_list.size() == 0) return;
+static void configPublish(CNfcConfig* pConfig) {
+  pConfig->resolveKeys();
+  const CNfcConfig* pOld = configCurrent.exchange(pConfig);
+  configGeneration.fetch_add(1);
 
-  for (list<const CNfcParam*>::iterator it = m_list.begin(),
-                                        itEnd = m_list.end();
-       it != itEnd; ++it)
-    push_back(*it);
-  m_list.clear();
+  for (int i = 0; i < configListenerCount; i++) {
+    if (pConfig->changed(pOld, configListeners[i].name)) {
+      configListeners[i].listener(configListeners[i].name);
+    }
+  }
+
+  // Readers count themselves before loading the snapshot, so any reader of
+  // the previous one is counted on one side or the other. New readers go to
+  // the other side after each flip, the side waited for can only drain.
+  for (int i = 0; i < 2; i++) {
+    uint32_t side = configEpoch.fetch_add(1) & 1;
+    while (configReaders[side].load() != 0) {
+      usleep(CONFIG_GRACE_POLL_US);
+    }
+  }
+  delete pOld;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::moveToList()
+** Function:    configReload()
 **
-** Description: move the setting object from array to list
+** Description: read the config files again and publish them, unless the
+**              base file cannot be read
 **
 ** Returns:     none
 **
 *******************************************************************************/
-void CNfcConfig::moveToList() {
-  if (m_list.size() != 0) m_list.clear();
+static void configReload() {
+  (void)pthread_mutex_lock(&configWriteMtx);
+  CNfcConfig* pConfig = configBuild();
+  if (pConfig == NULL) {
+    STLOG_HAL_W("%s Keeping current settings\n", __func__);
+  } else {
+    STLOG_HAL_D("%s Reloaded %s\n", __func__, configPath.c_str());
+    configPublish(pConfig);
+  }
+  (void)pthread_mutex_unlock(&configWriteMtx);
+}
+
+/*******************************************************************************
+**
+** Function:    configWatched()
+**
+** Description: determine if a file name is the one of a config file
+**
+** Returns:     true if the file is watched
+**
+*******************************************************************************/
+static bool configWatched(const char* name) {
+  size_t len = strlen(name);
+  size_t baseLen = strlen(extra_config_base);
+  size_t extLen = strlen(extra_config_ext);
 
-  for (iterator it = begin(), itEnd = end(); it != itEnd; ++it)
-    m_list.push_back(*it);
-  clear();
+  if (strcmp(name, config_name) == 0) return true;
+  return len > baseLen + extLen &&
+         strncmp(name, extra_config_base, baseLen) == 0 &&
+         strcmp(name + len - extLen, extra_config_ext) == 0;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcParam::CNfcParam()
+** Function:    configWatchDir()
 **
-** Description: class constructor
+** Description: watch the directory of a config file, files are often
+**              replaced by a rename rather than written in place
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcParam::CNfcParam() : m_numValue(0) {}
+static void configWatchDir(const string& path) {
+  if (configWatchFd < 0) return;
+
+  string dir = path.substr(0, path.rfind('/') + 1);
+  if (dir.empty()) dir = ".";
+  if (inotify_add_watch(configWatchFd, dir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+    STLOG_HAL_W("%s Cannot watch %s (%s)\n", __func__, dir.c_str(),
+                strerror(errno));
+  }
+}
 
 /*******************************************************************************
 **
-** Function:    CNfcParam::~CNfcParam()
+** Function:    configWatchThread()
 **
-** Description: class destructor
+** Description: reload the config when one of its files changes, once no
+**              further change is seen for CONFIG_RELOAD_DELAY_MS
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcParam::~CNfcParam() {}
+static void* configWatchThread(void* arg) {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd = {configWatchFd, POLLIN, 0};
+  (void)arg;
+
+  for (;;) {
+    ssize_t n = read(configWatchFd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+
+    bool changed = false;
+    for (char* p = buffer; p < buffer + n;) {
+      struct inotify_event* event = (struct inotify_event*)p;
+      if ((event->mask & IN_Q_OVERFLOW) ||
+          (event->len > 0 && configWatched(event->name))) {
+        changed = true;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+    if (!changed) continue;
+
+    // Let a burst of writes settle, the reload reads the files anyway
+    while (poll(&pfd, 1, CONFIG_RELOAD_DELAY_MS) > 0) {
+      if (read(configWatchFd, buffer, sizeof(buffer)) <= 0) break;
+    }
+    configReload();
+  }
+
+  STLOG_HAL_E("%s Stopped watching config files (%s)\n", __func__,
+              strerror(errno));
+  return NULL;
+}
 
 /*******************************************************************************
 **
-** Function:    CNfcParam::CNfcParam()
+** Function:    configInit()
 **
-** Description: class copy constructor
+** Description: read and publish the first snapshot, then start watching
+**              the config files unless STNFC_HAL_CONFIG_RELOAD is 0
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcParam::CNfcParam(const char* name, const string& value)
-    : string(name), m_str_value(value), m_numValue(0) {}
+static void configInit() {
+  CNfcConfig* pConfig = NULL;
+  unsigned long num = 1;
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (alternative_config_path[0] != '\0') {
+    configPath.assign(alternative_config_path);
+    configPath += config_name;
+    pConfig = configBuild();
+    if (pConfig != NULL && pConfig->empty()) {
+      delete pConfig;
+      pConfig = NULL;
+    }
+  }
+  if (pConfig == NULL) {
+    findConfigFile(config_name, configPath);
+    pConfig = configBuild();
+  }
+  if (pConfig == NULL) {
+    STLOG_HAL_W("%s Using default value for all settings\n", __func__);
+    pConfig = new CNfcConfig();
+  }
+  pConfig->resolveKeys();
+  configCurrent.store(pConfig);
+
+  pConfig->getValue(pConfig->find(HAL_CFG_STNFC_HAL_CONFIG_RELOAD), num);
+  if (num != 1) return;
+
+  configWatchFd = inotify_init1(IN_CLOEXEC);
+  if (configWatchFd < 0) {
+    STLOG_HAL_W("%s inotify_init1 failed (%s)\n", __func__, strerror(errno));
+    return;
+  }
+  configWatchDir(configPath);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, configWatchThread, NULL) != 0) {
+    STLOG_HAL_W("%s Cannot start config watch thread\n", __func__);
+    close(configWatchFd);
+    configWatchFd = -1;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/*******************************************************************************
+**
+** Function:    configAcquire()
+**
+** Description: get the current snapshot, valid until configRelease()
+**
+** Returns:     the snapshot, pSide is set for configRelease()
+**
+*******************************************************************************/
+static const CNfcConfig* configAcquire(uint32_t* pSide) {
+  pthread_once(&configOnce, configInit);
+  *pSide = configEpoch.load() & 1;
+  configReaders[*pSide].fetch_add(1);
+  return configCurrent.load();
+}
 
 /*******************************************************************************
 **
-** Function:    CNfcParam::CNfcParam()
+** Function:    configRelease()
 **
-** Description: class copy constructor
+** Description: tell the snapshot got with configAcquire() is not used
+**              anymore
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcParam::CNfcParam(const char* name, unsigned long value)
-    : string(name), m_numValue(value) {}
+static void configRelease(uint32_t side) {
+  configReaders[side].fetch_sub(1);
+}
 
 /*******************************************************************************
 **
@@ -640,9 +1221,12 @@ CNfcParam::CNfcParam(const char* name, unsigned long value)
 *******************************************************************************/
 extern "C" int GetStrValue(const char* name, char* pValue, unsigned long l) {
   size_t len = l;
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
+  uint32_t side;
+  const CNfcConfig* pConfig = configAcquire(&side);
+  bool found = pConfig->getValue(pConfig->find(name), pValue, len);
 
-  return rConfig.getValue(name, pValue, len);
+  configRelease(side);
+  return found;
 }
 
 /*******************************************************************************
@@ -664,8 +1248,12 @@ extern "C" int GetStrValue(const char* name, char* pValue, unsigned long l) {
 *******************************************************************************/
 extern "C" int GetByteArrayValue(const char* name, char* pValue, long bufflen,
                                  long* len) {
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
-  return rConfig.getValue(name, pValue, bufflen, len);
+  uint32_t side;
+  const CNfcConfig* pConfig = configAcquire(&side);
+  bool found = pConfig->getValue(pConfig->find(name), pValue, bufflen, len);
+
+  configRelease(side);
+  return found;
 }
 
 /*******************************************************************************
@@ -680,18 +1268,13 @@ extern "C" int GetByteArrayValue(const char* name, char* pValue, long bufflen,
 extern "C" int GetNumValue(const char* name, void* pValue, unsigned long len) {
   if (!pValue) return false;
 
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
-  const CNfcParam* pParam = rConfig.find(name);
+  uint32_t side;
+  const CNfcConfig* pConfig = configAcquire(&side);
+  unsigned long v = 0;
+  bool found = pConfig->getValue(pConfig->find(name), v);
 
-  if (pParam == NULL) return false;
-  unsigned long v = pParam->numValue();
-  if (v == 0 && pParam->str_len() > 0 && pParam->str_len() < 4) {
-    const unsigned char* p = (const unsigned char*)pParam->str_value();
-    for (size_t i = 0; i < pParam->str_len(); ++i) {
-      v *= 256;
-      v += *p++;
-    }
-  }
+  configRelease(side);
+  if (!found) return false;
   switch (len) {
     case sizeof(unsigned long):
       *(static_cast<unsigned long*>(pValue)) = (unsigned long)v;
@@ -708,19 +1291,167 @@ extern "C" int GetNumValue(const char* name, void* pValue, unsigned long len) {
   return true;
 }
 
+/*******************************************************************************
+**
+** Function:    HalConfigGetNum
+**
+** Description: get a numerical setting of the registry, see HalConfigNum
+**
+** Returns:     True if found, otherwise False.
+**
+*******************************************************************************/
+bool HalConfigGetNum(HalConfigKey key, unsigned long* value) {
+  uint32_t side;
+  const CNfcConfig* pConfig = configAcquire(&side);
+  bool found = pConfig->getValue(pConfig->find(key), *value);
+
+  configRelease(side);
+  return found;
+}
+
+/*******************************************************************************
+**
+** Function:    HalConfigGetStr
+**
+** Description: get a string setting of the registry, see HalConfigStr
+**
+** Returns:     True if found, otherwise False.
+**
+*******************************************************************************/
+bool HalConfigGetStr(HalConfigKey key, char* buffer, size_t size) {
+  uint32_t side;
+  const CNfcConfig* pConfig = configAcquire(&side);
+  bool found = pConfig->getValue(pConfig->find(key), buffer, size);
+
+  configRelease(side);
+  return found;
+}
+
+/*******************************************************************************
+**
+** Function:    HalConfigGetBytes
+**
+** Description: get a byte array setting of the registry, see HalConfigBytes
+**
+** Returns:     True if found, otherwise False.
+**
+*******************************************************************************/
+bool HalConfigGetBytes(HalConfigKey key, uint8_t* buffer, size_t size,
+                       long* length) {
+  uint32_t side;
+  const CNfcConfig* pConfig = configAcquire(&side);
+  bool found =
+      pConfig->getValue(pConfig->find(key), (char*)buffer, size, length);
+
+  configRelease(side);
+  return found;
+}
+
+/*******************************************************************************
+**
+** Function:    HalConfigGeneration
+**
+** Description: get the generation of the current snapshot
+**
+** Returns:     a value changing each time a new snapshot is published
+**
+*******************************************************************************/
+uint32_t HalConfigGeneration() {
+  pthread_once(&configOnce, configInit);
+  return configGeneration.load();
+}
+
+/*******************************************************************************
+**
+** Function:    HalConfigSaveCache
+**
+** Description: save the compiled form of the base file if it was parsed,
+**              see HalConfigSaveCache in hal_config.h
+**
+** Returns:     none
+**
+*******************************************************************************/
+void HalConfigSaveCache() {
+  pthread_once(&configOnce, configInit);
+
+  (void)pthread_mutex_lock(&configWriteMtx);
+  // Snapshots are only freed with configWriteMtx held, and the pending one
+  // is saved only if it is still the current one
+  if (configCachePending != NULL &&
+      configCachePending == configCurrent.load()) {
+    configCachePending->writeCache(config_cache_path, configPath.c_str(),
+                                   &configCacheSource);
+  }
+  configCachePending = NULL;
+  (void)pthread_mutex_unlock(&configWriteMtx);
+}
+
+/*******************************************************************************
+**
+** Function:    HalConfigSetDir
+**
+** Description: read the config files from another directory and publish
+**              them, see HalConfigSetDir in hal_config.h
+**
+** Returns:     none
+**
+*******************************************************************************/
+void HalConfigSetDir(const char* dir) {
+  pthread_once(&configOnce, configInit);
+
+  (void)pthread_mutex_lock(&configWriteMtx);
+  configDir.assign(dir);
+  configPath = configDir + config_name;
+  configOptionalPaths.clear();
+  CNfcConfig* pConfig = configBuild();
+  if (pConfig == NULL) {
+    STLOG_HAL_W("%s Using default value for all settings\n", __func__);
+    pConfig = new CNfcConfig();
+  }
+  configWatchDir(configPath);
+  configPublish(pConfig);
+  (void)pthread_mutex_unlock(&configWriteMtx);
+}
+
+/*******************************************************************************
+**
+** Function:    AddConfigListener
+**
+** Description: API function for getting notified when a setting is changed
+**              by a reload
+**
+** Returns:     none
+**
+*******************************************************************************/
+extern "C" void AddConfigListener(const char* name, ConfigListener listener) {
+  (void)pthread_mutex_lock(&configWriteMtx);
+  if (configListenerCount < CONFIG_LISTENER_MAX) {
+    configListeners[configListenerCount].name = name;
+    configListeners[configListenerCount].listener = listener;
+    configListenerCount++;
+  } else {
+    STLOG_HAL_E("%s Too many listeners, %s ignored\n", __func__, name);
+  }
+  (void)pthread_mutex_unlock(&configWriteMtx);
+}
+
 /*******************************************************************************
 **
 ** Function:    resetConfig
 **
-** Description: reset settings array
+** Description: forget the optional files and read the base file again
 **
 ** Returns:     none
 **
 *******************************************************************************/
 extern void resetConfig() {
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
+  pthread_once(&configOnce, configInit);
 
-  rConfig.clean();
+  (void)pthread_mutex_lock(&configWriteMtx);
+  configOptionalPaths.clear();
+  CNfcConfig* pConfig = configBuild();
+  if (pConfig != NULL) configPublish(pConfig);
+  (void)pthread_mutex_unlock(&configWriteMtx);
 }
 
 /*******************************************************************************
@@ -738,12 +1469,26 @@ void readOptionalConfig(const char* extra) {
   configName += extra;
   configName += extra_config_ext;
 
-  if (alternative_config_path[0] != '\0') {
+  pthread_once(&configOnce, configInit);
+
+  if (!configDir.empty()) {
+    strPath = configDir + configName;
+  } else if (alternative_config_path[0] != '\0') {
     strPath.assign(alternative_config_path);
     strPath += configName;
   } else {
     findConfigFile(configName, strPath);
   }
 
-  CNfcConfig::GetInstance().readConfig(strPath.c_str(), false);
+  // The files read so far are not read again, extend a copy of them
+  (void)pthread_mutex_lock(&configWriteMtx);
+  CNfcConfig* pConfig = new CNfcConfig(*configCurrent.load());
+  if (pConfig->readConfig(strPath.c_str())) {
+    configOptionalPaths.push_back(strPath);
+    configWatchDir(strPath);
+    configPublish(pConfig);
+  } else {
+    delete pConfig;
+  }
+  (void)pthread_mutex_unlock(&configWriteMtx);
 }
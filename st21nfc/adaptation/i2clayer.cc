@@ -28,12 +28,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <atomic>
 
 #include "android_logmsg.h"
+#include "hal_config.h"
+#include "hal_latency.h"
 #include "halcore.h"
 #include "halcore_private.h"
+#include "i2ctransport.h"
 
 #define ST21NFC_MAGIC 0xEA
 
@@ -46,10 +52,81 @@
 
 #define LINUX_DBGBUFFER_SIZE 300
 
+/* number of NCI frames queued from HAL Core to the I2C thread: each slot
+ * holds a HAL Core TX buffer, so the ring can take all of them, the slab of
+ * HAL_TX_POLICY_GROW included, and never fills */
+#define I2C_TX_RING_SIZE (2 * HAL_TX_POOL_SIZE_MAX)
+static_assert((I2C_TX_RING_SIZE & (I2C_TX_RING_SIZE - 1)) == 0,
+              "the ring indexes wrap around, its size must be a power of 2");
+
+/* default write retry schedule: 3 tries 4 ms apart, repeated up to 10 more
+ * times after 500 ms, because some CPUs have shown such long unavailability */
+#define I2C_WRITE_RETRIES 3
+#define I2C_WRITE_RETRY_DELAY_MS 4
+#define I2C_WRITE_BACKOFF_ROUNDS 10
+#define I2C_WRITE_BACKOFF_DELAY_MS 500
+
+/* poll table layout */
+#define I2C_POLL_DEVICE 0
+#define I2C_POLL_CMD 1
+#define I2C_POLL_RETRY 2
+#define I2C_POLL_HAL_WAKEUP 3 /* reactor mode only */
+#define I2C_POLL_HAL_TIMER 4  /* reactor mode only */
+#define I2C_POLL_MAX 5
+
+typedef struct {
+  HalBuffer* buffer; /* HAL Core TX buffer, the ring holds a reference */
+  uint32_t retries;  /* failed write attempts so far */
+} I2cTxFrame;
+
+typedef struct {
+  uint32_t retries;     /* attempts per round */
+  uint32_t retryDelay;  /* ms between attempts of a round */
+  uint32_t rounds;      /* additional rounds after the first one */
+  uint32_t roundDelay;  /* ms between rounds */
+} I2cRetrySchedule;
+
+static const I2cTransport* transport = &i2cDeviceTransport;
+static const I2cTransport* transportOverride = NULL; /* I2cSetTransport */
 static int fidI2c = 0;
-static int cmdPipe[2] = {0, 0};
-
-static struct pollfd event_table[2];
+static int cmdEventFd = -1;
+static bool reactorMode = false;
+
+/* single producer (HAL Core) / single consumer (I2C thread) frame ring */
+static I2cTxFrame txRing[I2C_TX_RING_SIZE];
+static std::atomic<uint32_t> txRingHead(0); /* next slot to write to I2C */
+static std::atomic<uint32_t> txRingTail(0); /* next slot to fill */
+static std::atomic<bool> i2cThreadParked(false);
+static std::atomic<bool> closeRequest(false);
+static thread_local bool onI2cThread = false;
+
+/* RX frames collected during one IRQ burst, handed over in one message */
+static bool rxBatchMode = false;
+static uint8_t rxBatchData[MAX_BUFFER_SIZE * HAL_RX_BATCH_MAX];
+static size_t rxBatchLength[HAL_RX_BATCH_MAX];
+static size_t rxBatchCount = 0;
+static size_t rxBatchBytes = 0;
+
+/* write retries, driven by a timerfd so RX is still served meanwhile */
+static int retryTimerFd = -1;
+static bool retryArmed = false; /* head of txRing waits for retryTimerFd */
+static I2cRetrySchedule retrySchedule;
+static uint32_t statRetriedFrames = 0;
+static uint32_t statRetries = 0;
+static uint32_t statMaxRetries = 0;
+static uint32_t statDroppedFrames = 0;
+
+/* RX framing: bytes read from the device, parsed into NCI frames */
+#define I2C_RX_BUFFER_SIZE (2 * MAX_BUFFER_SIZE)
+static uint8_t rxBuffer[I2C_RX_BUFFER_SIZE];
+static size_t rxStart = 0; /* first byte not parsed yet */
+static size_t rxEnd = 0;   /* end of the bytes read */
+static size_t rxChunk = 0; /* minimum read size, 0 to read only what's needed */
+static uint32_t statRxFrames = 0;
+static uint32_t statRxReads = 0;
+static uint32_t statRxIoctls = 0;
+
+static struct pollfd event_table[I2C_POLL_MAX];
 static pthread_t threadHandle = (pthread_t)NULL;
 pthread_mutex_t i2ctransport_mtx = PTHREAD_MUTEX_INITIALIZER;
 
@@ -64,6 +141,12 @@ static int i2cResetPulse(int fid);
 static int i2cRead(int fid, uint8_t* pvBuffer, int length);
 static int i2cGetGPIOState(int fid);
 static int i2cWrite(int fd, const uint8_t* pvBuffer, int length);
+static void i2cServiceTx(HALHANDLE hHAL);
+static void i2cReadFrames(HALHANDLE hHAL);
+static void i2cCancelTx(HALHANDLE hHAL);
+static void i2cSignalThread();
+static void i2cQueueRxFrame(HALHANDLE hHAL, const uint8_t* data, size_t len);
+static void i2cFlushRxBatch(HALHANDLE hHAL);
 
 /**************************************************************************************************
  *
@@ -80,144 +163,323 @@ static void* I2cWorkerThread(void* arg) {
   bool closeThread = false;
   HALHANDLE hHAL = (HALHANDLE)arg;
   STLOG_HAL_D("echo thread started...\n");
-  bool readOk = false;
+  int nfds = I2C_POLL_RETRY + 1;
 
-  do {
-    event_table[0].fd = fidI2c;
-    event_table[0].events = POLLIN;
-    event_table[0].revents = 0;
+  onI2cThread = true;
+
+  if (reactorMode) {
+    // Also serve the HAL Core messages and timer from this thread
+    nfds = I2C_POLL_MAX;
+    HalReactorDispatch(hHAL, false, false);
+  }
 
-    event_table[1].fd = cmdPipe[0];
-    event_table[1].events = POLLIN;
-    event_table[1].revents = 0;
+  do {
+    event_table[I2C_POLL_DEVICE].fd = fidI2c;
+    event_table[I2C_POLL_DEVICE].events = POLLIN;
+    event_table[I2C_POLL_DEVICE].revents = 0;
+
+    event_table[I2C_POLL_CMD].fd = cmdEventFd;
+    event_table[I2C_POLL_CMD].events = POLLIN;
+    event_table[I2C_POLL_CMD].revents = 0;
+
+    event_table[I2C_POLL_RETRY].fd = retryTimerFd;
+    event_table[I2C_POLL_RETRY].events = POLLIN;
+    event_table[I2C_POLL_RETRY].revents = 0;
+
+    if (reactorMode) {
+      event_table[I2C_POLL_HAL_WAKEUP].fd = HalGetWakeupFd(hHAL);
+      event_table[I2C_POLL_HAL_WAKEUP].events = POLLIN;
+      event_table[I2C_POLL_HAL_WAKEUP].revents = 0;
+
+      event_table[I2C_POLL_HAL_TIMER].fd = HalGetTimerFd(hHAL);
+      event_table[I2C_POLL_HAL_TIMER].events = POLLIN;
+      event_table[I2C_POLL_HAL_TIMER].revents = 0;
+    }
 
     STLOG_HAL_V("echo thread go to sleep...\n");
 
-    int poll_status = poll(event_table, 2, -1);
+    // Announce we park in poll, then check once more for queued commands so
+    // that a producer racing with us either sees the flag or we see its frame.
+    // Frames behind a write waiting for its retry are sent after it.
+    int timeout = -1;
+    i2cThreadParked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ((!retryArmed && (txRingHead.load() != txRingTail.load())) ||
+        closeRequest.load()) {
+      i2cThreadParked.store(false);
+      timeout = 0;
+    }
+
+    int poll_status = poll(event_table, nfds, timeout);
+    i2cThreadParked.store(false);
 
     if (-1 == poll_status) {
       STLOG_HAL_E("error in poll call\n");
       break;
     }
 
-    if (event_table[0].revents & POLLIN) {
+    if (event_table[I2C_POLL_DEVICE].revents & POLLIN) {
       STLOG_HAL_V("echo thread wakeup from chip...\n");
 
-      uint8_t buffer[300];
-
-      do {
-        // load first four bytes:
-        int bytesRead = i2cRead(fidI2c, buffer, 3);
-
-        if (bytesRead == 3) {
-          if ((buffer[0] != 0x7E) && (buffer[1] != 0x7E)) {
-            readOk = true;
-          } else {
-            if (buffer[1] != 0x7E) {
-              STLOG_HAL_W(
-                  "Idle data: 2nd byte is 0x%02x\n, reading next 2 bytes",
-                  buffer[1]);
-              buffer[0] = buffer[1];
-              buffer[1] = buffer[2];
-              bytesRead = i2cRead(fidI2c, buffer + 2, 1);
-              if (bytesRead == 1) {
-                readOk = true;
-              }
-            } else if (buffer[2] != 0x7E) {
-              STLOG_HAL_W("Idle data: 3rd byte is 0x%02x\n, reading next  byte",
-                          buffer[2]);
-              buffer[0] = buffer[2];
-              bytesRead = i2cRead(fidI2c, buffer + 1, 2);
-              if (bytesRead == 2) {
-                readOk = true;
-              }
-            } else {
-              STLOG_HAL_W("received idle data\n");
-            }
-          }
-
-          if (readOk == true) {
-            int remaining = buffer[2];
-            bytesRead = 0;
-            if (remaining != 0) {
-              // read and pass to HALCore
-              bytesRead = i2cRead(fidI2c, buffer + 3, remaining);
-            }
-            if (bytesRead == remaining) {
-              DispHal("RX DATA", buffer, 3 + bytesRead);
-              HalSendUpstream(hHAL, buffer, 3 + bytesRead);
-            } else {
-              readOk = false;
-              STLOG_HAL_E("! didn't read expected bytes from i2c\n");
-            }
-          }
-
-        } else {
-          STLOG_HAL_E("! didn't read 3 requested bytes from i2c\n");
-        }
-
-        readOk = false;
-        memset(buffer, 0xca, sizeof(buffer));
-
-        /* read while we have data available */
-      } while (i2cGetGPIOState(fidI2c) == 1);
+      i2cReadFrames(hHAL);
     }
 
-    if (event_table[1].revents & POLLIN) {
+    if (event_table[I2C_POLL_CMD].revents & POLLIN) {
+      uint64_t count;
       STLOG_HAL_V("thread received command.. \n");
+      // Reset the eventfd counter, one signal covers a whole batch
+      read(cmdEventFd, &count, sizeof(count));
+    }
 
-      char cmd = 0;
-      read(cmdPipe[0], &cmd, 1);
-
-      switch (cmd) {
-        case 'X':
-          STLOG_HAL_D("received close command\n");
-          closeThread = true;
-          break;
-
-        case 'W': {
-          size_t length;
-          uint8_t buffer[MAX_BUFFER_SIZE];
-          STLOG_HAL_V("received write command\n");
-          read(cmdPipe[0], &length, sizeof(length));
-          if (length <= MAX_BUFFER_SIZE) {
-            read(cmdPipe[0], buffer, length);
-            i2cWrite(fidI2c, buffer, length);
-          } else {
-            STLOG_HAL_E(
-                "! received bigger data than expected!! Data not transmitted "
-                "to NFCC \n");
-            size_t bytes_read = 1;
-            // Read all the data to empty but do not use it as not expected
-            while ((bytes_read > 0) && (length > 0)) {
-              bytes_read = read(cmdPipe[0], buffer, MAX_BUFFER_SIZE);
-              length = length - bytes_read;
-            }
-          }
-        } break;
-      }
+    if (event_table[I2C_POLL_RETRY].revents & POLLIN) {
+      uint64_t count;
+      // Backoff elapsed, the pending write is attempted again below
+      read(retryTimerFd, &count, sizeof(count));
+      retryArmed = false;
+    }
+
+    // Write the frames queued by HAL Core
+    i2cServiceTx(hHAL);
+
+    if (closeRequest.load()) {
+      STLOG_HAL_D("received close command\n");
+      // The frames the stack sent before the close still go out
+      HalFlushDownstream(hHAL);
+      i2cServiceTx(hHAL);
+      // Don't wait for the backoff of a failing write
+      i2cCancelTx(hHAL);
+      closeThread = true;
+    }
+
+    if (reactorMode && !closeThread) {
+      // Dispatch TX and timer events inline
+      HalReactorDispatch(hHAL,
+                         event_table[I2C_POLL_HAL_WAKEUP].revents & POLLIN,
+                         event_table[I2C_POLL_HAL_TIMER].revents & POLLIN);
+      // Frames queued by the dispatch
+      i2cServiceTx(hHAL);
     }
 
   } while (!closeThread);
 
-  close(fidI2c);
-  close(cmdPipe[0]);
-  close(cmdPipe[1]);
+  STLOG_HAL_D(
+      "I2C writes: %u frames retried %u times (max %u for one frame), %u "
+      "dropped\n",
+      statRetriedFrames, statRetries, statMaxRetries, statDroppedFrames);
+  STLOG_HAL_D(
+      "I2C reads: %u frames, %u read and %u ioctl calls, %u.%02u syscalls "
+      "per frame\n",
+      statRxFrames, statRxReads, statRxIoctls,
+      statRxFrames ? (statRxReads + statRxIoctls) / statRxFrames : 0,
+      statRxFrames ? ((statRxReads + statRxIoctls) * 100 / statRxFrames) % 100
+                   : 0);
+
+  transport->close(fidI2c);
+  close(retryTimerFd);
+  retryTimerFd = -1;
 
   HalDestroy(hHAL);
+  // Frames queued after the flush were freed with their buffers
+  txRingHead.store(txRingTail.load());
+
+  // HAL Core is gone, nobody can signal us anymore
+  close(cmdEventFd);
+  cmdEventFd = -1;
   STLOG_HAL_D("thread exit\n");
   return 0;
 }
 
 /**
  * Put command into queue for worker thread to process it.
- * @param x Command 'X' to close I2C layer or 'W' to write data down to I2C
- * layer followed by data frame
- * @param len Size of command or data
- * @return
+ * Frames queued before are still written before the thread exits.
+ * @param x Command 'X' to close I2C layer
+ * @param len Size of command
+ * @return Size of command, -1 if the command is unknown
  */
 int I2cWriteCmd(const uint8_t* x, size_t len) {
-  return write(cmdPipe[1], x, len);
+  if ((len != 1) || (x[0] != 'X')) {
+    STLOG_HAL_E("! unknown command for I2C thread\n");
+    return -1;
+  }
+
+  closeRequest.store(true);
+  i2cSignalThread();
+  return len;
+}
+
+/**
+ * Send an NCI frame to the NFCC.
+ * The buffer is queued in the TX ring of the I2C thread, which writes the
+ * frame from it and retries on failure. The ring takes its own reference,
+ * dropped once the frame is written or given up. Only HAL Core may call this,
+ * the ring has a single producer. It has a slot for every TX buffer, so this
+ * never waits nor drops the frame. In reactor mode HAL Core runs on the I2C
+ * thread and the frame is written once the dispatch returns.
+ * @param buffer HAL Core TX buffer holding the frame
+ */
+void I2cSendFrame(HalBuffer* buffer) {
+  uint32_t tail = txRingTail.load(std::memory_order_relaxed);
+
+  // Never full, see I2C_TX_RING_SIZE
+  I2cTxFrame* frame = &txRing[tail % I2C_TX_RING_SIZE];
+  HalRetainBuffer(buffer);
+  frame->buffer = buffer;
+  frame->retries = 0;
+  txRingTail.store(tail + 1, std::memory_order_release);
+
+  if (!onI2cThread) {
+    i2cSignalThread();
+  }
+}
+
+/**
+ * Extract the next NCI frame from the RX buffer. Idle bytes (0x7E) are
+ * skipped, as is a first byte followed by 0x7E, which can't start a frame.
+ * @param frame Set to the frame, valid until the next read
+ * @param length Set to the frame size
+ * @return 0 if a frame was extracted, otherwise the number of bytes missing
+ * to complete the next frame
+ */
+static size_t i2cParseFrame(const uint8_t** frame, size_t* length) {
+  while (rxStart < rxEnd) {
+    if (rxBuffer[rxStart] == 0x7E) {
+      rxStart++;
+    } else if ((rxEnd - rxStart >= 2) && (rxBuffer[rxStart + 1] == 0x7E)) {
+      STLOG_HAL_W("Idle data: 2nd byte is 0x7E, dropping 0x%02x\n",
+                  rxBuffer[rxStart]);
+      rxStart++;
+    } else {
+      break;
+    }
+  }
+
+  size_t avail = rxEnd - rxStart;
+  if (avail < MAX_HEADER_SIZE) {
+    return MAX_HEADER_SIZE - avail;
+  }
+
+  size_t len = MAX_HEADER_SIZE + rxBuffer[rxStart + 2];
+  if (avail < len) {
+    return len - avail;
+  }
+
+  *frame = &rxBuffer[rxStart];
+  *length = len;
+  rxStart += len;
+  return 0;
+}
+
+/**
+ * Read from the device into the RX buffer, at least the given number of
+ * bytes, or rxChunk bytes if larger.
+ * @param needed Number of bytes missing to complete the next frame
+ * @return false if nothing could be read
+ */
+static bool i2cFillRxBuffer(size_t needed) {
+  // Move the partial frame to the front, it is small
+  if (rxStart > 0) {
+    memmove(rxBuffer, rxBuffer + rxStart, rxEnd - rxStart);
+    rxEnd -= rxStart;
+    rxStart = 0;
+  }
+
+  size_t want = (needed > rxChunk) ? needed : rxChunk;
+  if (want > sizeof(rxBuffer) - rxEnd) {
+    want = sizeof(rxBuffer) - rxEnd;
+  }
+
+  int bytesRead = i2cRead(fidI2c, rxBuffer + rxEnd, want);
+  if (bytesRead <= 0) {
+    return false;
+  }
+  rxEnd += bytesRead;
+  return true;
+}
+
+/**
+ * Read and pass to HAL Core all the frames available from the NFCC.
+ * The IRQ line is only checked when no partial frame is buffered.
+ * @param hHAL HAL handle
+ */
+static void i2cReadFrames(HALHANDLE hHAL) {
+  const uint8_t* frame;
+  size_t length;
+  // poll() reported the IRQ, no need to ask again before the first read
+  bool irqHigh = true;
+
+  for (;;) {
+    size_t missing = i2cParseFrame(&frame, &length);
+
+    if (missing == 0) {
+      statRxFrames++;
+      DispHal("RX DATA", frame, length);
+      if (rxBatchMode) {
+        i2cQueueRxFrame(hHAL, frame, length);
+      } else {
+        HalSendUpstream(hHAL, frame, length);
+      }
+      continue;
+    }
+
+    /* read while we have data available */
+    if ((rxStart == rxEnd) && !irqHigh && (i2cGetGPIOState(fidI2c) != 1)) {
+      break;
+    }
+    irqHigh = false;
+
+    if (!i2cFillRxBuffer(missing)) {
+      STLOG_HAL_E("! didn't read expected bytes from i2c\n");
+      // Drop the partial frame, resynchronize on the next IRQ
+      rxStart = rxEnd = 0;
+      break;
+    }
+  }
+
+  if (rxBatchMode) {
+    i2cFlushRxBatch(hHAL);
+  }
+}
+
+/**
+ * Append an RX frame to the current batch, handing the batch over to HAL Core
+ * when it is full.
+ * @param hHAL HAL handle
+ * @param data NCI frame
+ * @param len Size of the frame
+ */
+static void i2cQueueRxFrame(HALHANDLE hHAL, const uint8_t* data, size_t len) {
+  memcpy(rxBatchData + rxBatchBytes, data, len);
+  rxBatchLength[rxBatchCount++] = len;
+  rxBatchBytes += len;
+
+  if (rxBatchCount == HAL_RX_BATCH_MAX) {
+    i2cFlushRxBatch(hHAL);
+  }
+}
+
+/**
+ * Hand the frames collected so far over to HAL Core in one message.
+ * @param hHAL HAL handle
+ */
+static void i2cFlushRxBatch(HALHANDLE hHAL) {
+  if (rxBatchCount == 0) {
+    return;
+  }
+
+  HalSendUpstreamBatch(hHAL, rxBatchData, rxBatchLength, rxBatchCount);
+  rxBatchCount = 0;
+  rxBatchBytes = 0;
+}
+
+/**
+ * Access the NFCC through another transport than /dev/st21nfc, e.g. the
+ * simulator of the test library. Takes effect at the next I2cOpenLayer.
+ * @param t Transport, NULL for /dev/st21nfc
+ */
+void I2cSetTransport(const I2cTransport* t) {
+  (void)pthread_mutex_lock(&i2ctransport_mtx);
+  transportOverride = t;
+  (void)pthread_mutex_unlock(&i2ctransport_mtx);
 }
 
 /**
@@ -228,11 +490,14 @@ int I2cWriteCmd(const uint8_t* x, size_t len) {
  */
 bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle) {
   uint32_t NoDbgFlag = HAL_FLAG_DEBUG;
+  unsigned long num = 0;
 
   (void)pthread_mutex_lock(&i2ctransport_mtx);
-  fidI2c = open("/dev/st21nfc", O_RDWR);
+  transport = transportOverride ? transportOverride : &i2cDeviceTransport;
+  STLOG_HAL_D("NFCC accessed through %s\n", transport->name);
+
+  fidI2c = transport->open();
   if (fidI2c < 0) {
-    STLOG_HAL_W("unable to open /dev/st21nfc  (%s) \n", strerror(errno));
     (void)pthread_mutex_unlock(&i2ctransport_mtx);
     return false;
   }
@@ -240,11 +505,70 @@ bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle) {
   i2cSetPolarity(fidI2c, false, false);
   i2cResetPulse(fidI2c);
 
-  if ((pipe(cmdPipe) == -1)) {
-    STLOG_HAL_W("unable to open cmdpipe\n");
+  cmdEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (cmdEventFd == -1) {
+    STLOG_HAL_W("unable to open cmd eventfd\n");
+    transport->close(fidI2c);
     (void)pthread_mutex_unlock(&i2ctransport_mtx);
     return false;
   }
+  retryTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (retryTimerFd == -1) {
+    STLOG_HAL_W("unable to open write retry timerfd\n");
+    close(cmdEventFd);
+    transport->close(fidI2c);
+    (void)pthread_mutex_unlock(&i2ctransport_mtx);
+    return false;
+  }
+  retryArmed = false;
+  txRingHead.store(0);
+  txRingTail.store(0);
+  closeRequest.store(false);
+
+  retrySchedule.retries = I2C_WRITE_RETRIES;
+  retrySchedule.retryDelay = I2C_WRITE_RETRY_DELAY_MS;
+  retrySchedule.rounds = I2C_WRITE_BACKOFF_ROUNDS;
+  retrySchedule.roundDelay = I2C_WRITE_BACKOFF_DELAY_MS;
+  if (HalConfigNum<HAL_CFG_STNFC_I2C_WRITE_RETRIES>(&num) && (num >= 1)) {
+    retrySchedule.retries = num;
+  }
+  if (HalConfigNum<HAL_CFG_STNFC_I2C_WRITE_RETRY_DELAY>(&num)) {
+    retrySchedule.retryDelay = num;
+  }
+  if (HalConfigNum<HAL_CFG_STNFC_I2C_WRITE_BACKOFF_ROUNDS>(&num)) {
+    retrySchedule.rounds = num;
+  }
+  if (HalConfigNum<HAL_CFG_STNFC_I2C_WRITE_BACKOFF_DELAY>(&num)) {
+    retrySchedule.roundDelay = num;
+  }
+  statRetriedFrames = 0;
+  statRetries = 0;
+  statMaxRetries = 0;
+  statDroppedFrames = 0;
+
+  rxStart = rxEnd = 0;
+  rxChunk = 0;
+  if (HalConfigNum<HAL_CFG_STNFC_I2C_READ_CHUNK>(&num)) {
+    rxChunk = (num > MAX_BUFFER_SIZE) ? MAX_BUFFER_SIZE : num;
+  }
+  statRxFrames = 0;
+  statRxReads = 0;
+  statRxIoctls = 0;
+
+  rxBatchMode = false;
+  rxBatchCount = 0;
+  rxBatchBytes = 0;
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_RX_BATCH>() == 1) {
+    STLOG_HAL_D("RX frames are batched per IRQ burst\n");
+    rxBatchMode = true;
+  }
+
+  reactorMode = false;
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_REACTOR_MODE>() == 1) {
+    STLOG_HAL_D("HAL Core runs in reactor mode on the I2C thread\n");
+    reactorMode = true;
+    NoDbgFlag |= HAL_FLAG_REACTOR;
+  }
 
   *pHandle = HalCreate(dev, callb, NoDbgFlag);
 
@@ -301,7 +625,21 @@ void I2cResetPulse() {
  *
  **************************************************************************************************/
 /**
- * Call the st21nfc driver to adjust wake-up polarity.
+ * Wake up the I2C thread if it is parked in poll.
+ * Only the first command of a batch pays for the eventfd write.
+ */
+static void i2cSignalThread() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (i2cThreadParked.exchange(false)) {
+    uint64_t one = 1;
+    if (write(cmdEventFd, &one, sizeof(one)) != sizeof(one)) {
+      STLOG_HAL_E("! failed to wake up I2C thread\n");
+    }
+  }
+}
+
+/**
+ * Adjust wake-up polarity, through the st21nfc driver on the device.
  * @param fid File descriptor for NFC device
  * @param low Polarity (HIGH or LOW)
  * @param edge Polarity (RISING or FALLING)
@@ -309,24 +647,8 @@ void I2cResetPulse() {
  */
 static int i2cSetPolarity(int fid, bool low, bool edge) {
   int result;
-  unsigned int io_code;
-
-  if (low) {
-    if (edge) {
-      io_code = ST21NFC_SET_POLARITY_FALLING;
-    } else {
-      io_code = ST21NFC_SET_POLARITY_LOW;
-    }
-
-  } else {
-    if (edge) {
-      io_code = ST21NFC_SET_POLARITY_RISING;
-    } else {
-      io_code = ST21NFC_SET_POLARITY_HIGH;
-    }
-  }
 
-  if (-1 == (result = ioctl(fid, io_code, NULL))) {
+  if (-1 == (result = transport->setPolarity(fid, low, edge))) {
     result = -1;
   }
 
@@ -334,14 +656,15 @@ static int i2cSetPolarity(int fid, bool low, bool edge) {
 } /* i2cSetPolarity*/
 
 /**
- * Call the st21nfc driver to generate a 30ms pulse on RESET line.
+ * Generate a 30ms pulse on RESET line, through the st21nfc driver on the
+ * device.
  * @param fid File descriptor for NFC device
  * @return Result of IOCTL system call (0 if ok)
  */
 static int i2cResetPulse(int fid) {
   int result;
 
-  if (-1 == (result = ioctl(fid, ST21NFC_PULSE_RESET, NULL))) {
+  if (-1 == (result = transport->resetPulse(fid))) {
     result = -1;
   }
   STLOG_HAL_D("! i2cResetPulse!!, result = %d", result);
@@ -349,47 +672,125 @@ static int i2cResetPulse(int fid) {
 } /* i2cResetPulse*/
 
 /**
- * Write data to st21nfc, on failure do max 3 retries.
+ * Write data to the NFCC, one attempt.
+ * Retries are scheduled by i2cServiceTx.
  * @param fid File descriptor for NFC device
  * @param pvBuffer Data to write
  * @param length Data size
- * @return 0 if bytes written, -1 if error
+ * @return 0 if the data was written, -1 otherwise
  */
 static int i2cWrite(int fid, const uint8_t* pvBuffer, int length) {
-  int retries = 0;
-  int result = 0;
-  int halfsecs = 0;
+  int result = transport->write(fid, pvBuffer, length);
 
-redo:
-  while (retries < 3) {
-    result = write(fid, pvBuffer, length);
+  if (result < 0) {
+    char msg[LINUX_DBGBUFFER_SIZE];
 
-    if (result < 0) {
-      char msg[LINUX_DBGBUFFER_SIZE];
-
-      strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
-      STLOG_HAL_W("! i2cWrite!!, errno is '%s'", msg);
-      usleep(4000);
-      retries++;
-    } else if (result > 0) {
-      result = 0;
-      return result;
+    strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
+    STLOG_HAL_W("! i2cWrite!!, errno is '%s'", msg);
+    return -1;
+  } else if (result == 0) {
+    STLOG_HAL_W("write on i2c failed, retrying\n");
+    return -1;
+  }
+  return 0;
+} /* i2cWrite */
+
+/**
+ * Arm the retry timer for a frame which failed to be written.
+ * @param frame Frame, its retries already account the failed attempt
+ * @return false if the schedule is exhausted and the frame must be dropped
+ */
+static bool i2cScheduleRetry(I2cTxFrame* frame) {
+  uint32_t delay = retrySchedule.retryDelay;
+  struct itimerspec its;
+
+  if ((frame->retries % retrySchedule.retries) == 0) {
+    // End of a round
+    if (frame->retries / retrySchedule.retries > retrySchedule.rounds) {
+      return false;
+    }
+    delay = retrySchedule.roundDelay;
+  }
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = delay / 1000;
+  its.it_value.tv_nsec = (delay % 1000) * 1000000;
+  if (delay == 0) {
+    // A zero it_value would disarm the timer
+    its.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(retryTimerFd, 0, &its, NULL) != 0) {
+    STLOG_HAL_E("! failed to arm write retry timer\n");
+    return false;
+  }
+  retryArmed = true;
+  return true;
+}
+
+/**
+ * Write the frames queued in the TX ring, in order. A frame failing to be
+ * written stays at the head of the ring until its retry timer expires.
+ * @param hHAL HAL handle, owner of the TX buffers
+ */
+static void i2cServiceTx(HALHANDLE hHAL) {
+  uint32_t head = txRingHead.load(std::memory_order_relaxed);
+
+  while (!retryArmed && (head != txRingTail.load(std::memory_order_acquire))) {
+    I2cTxFrame* frame = &txRing[head % I2C_TX_RING_SIZE];
+
+    if (i2cWrite(fidI2c, frame->buffer->data, frame->buffer->length) != 0) {
+      frame->retries++;
+      statRetries++;
+      if (frame->retries == 1) {
+        statRetriedFrames++;
+      }
+      if (i2cScheduleRetry(frame)) {
+        return;
+      }
+      /* The CLF did not recover, give up */
+      STLOG_HAL_E("! i2cWrite failed %u times, frame dropped\n",
+                  frame->retries);
+      statDroppedFrames++;
     } else {
-      STLOG_HAL_W("write on i2c failed, retrying\n");
-      usleep(4000);
-      retries++;
+      if (frame->retries) {
+        STLOG_HAL_D("i2cWrite succeeded after %u retries\n", frame->retries);
+      }
+      HalLatencyRecord(HAL_LATENCY_TX, &frame->buffer->postTime);
+    }
+
+    if (frame->retries > statMaxRetries) {
+      statMaxRetries = frame->retries;
     }
+    HalReleaseBuffer((HalInstance*)hHAL, frame->buffer);
+    head++;
+    txRingHead.store(head, std::memory_order_release);
   }
-  /* If we're here, we failed to write to NFCC. Retry after 500ms because some
-  CPUs have shown such long unavailability sometimes */
-  if (halfsecs < 10) {
-    usleep(500000);
-    halfsecs++;
-    goto redo;
+}
+
+/**
+ * Cancel the pending write retry, dropping the frames still queued.
+ * @param hHAL HAL handle, owner of the TX buffers
+ */
+static void i2cCancelTx(HALHANDLE hHAL) {
+  struct itimerspec its;
+  uint32_t head = txRingHead.load(std::memory_order_relaxed);
+  uint32_t tail = txRingTail.load(std::memory_order_acquire);
+
+  if (!retryArmed) {
+    return;
   }
-  /* The CLF did not recover, give up */
-  return -1;
-} /* i2cWrite */
+
+  memset(&its, 0, sizeof(its));
+  timerfd_settime(retryTimerFd, 0, &its, NULL);
+  retryArmed = false;
+
+  STLOG_HAL_W("write retry cancelled, %u frame(s) dropped\n", tail - head);
+  statDroppedFrames += tail - head;
+  for (uint32_t i = head; i != tail; i++) {
+    HalReleaseBuffer((HalInstance*)hHAL, txRing[i % I2C_TX_RING_SIZE].buffer);
+  }
+  txRingHead.store(tail, std::memory_order_release);
+}
 
 /**
  * Read data from st21nfc, on failure do max 3 retries.
@@ -404,7 +805,8 @@ static int i2cRead(int fid, uint8_t* pvBuffer, int length) {
   int result = -1;
 
   while ((retries < 3) && (result < 0)) {
-    result = read(fid, pvBuffer, length);
+    result = transport->read(fid, pvBuffer, length);
+    statRxReads++;
 
     if (result == -1) {
       int e = errno;
@@ -453,9 +855,68 @@ static int i2cRead(int fid, uint8_t* pvBuffer, int length) {
 static int i2cGetGPIOState(int fid) {
   int result;
 
-  if (-1 == (result = ioctl(fid, ST21NFC_GET_WAKEUP, NULL))) {
+  statRxIoctls++;
+  if (-1 == (result = transport->getWakeup(fid))) {
     result = -1;
   }
 
   return result;
 } /* i2cGetGPIOState */
+
+/**************************************************************************************************
+ *
+ *                                      st21nfc Driver Transport
+ *
+ **************************************************************************************************/
+
+static int devOpen() {
+  int fd = open("/dev/st21nfc", O_RDWR);
+  if (fd < 0) {
+    STLOG_HAL_W("unable to open /dev/st21nfc  (%s) \n", strerror(errno));
+  }
+  return fd;
+}
+
+static void devClose(int fd) { close(fd); }
+
+static ssize_t devRead(int fd, uint8_t* buffer, size_t length) {
+  return read(fd, buffer, length);
+}
+
+static ssize_t devWrite(int fd, const uint8_t* buffer, size_t length) {
+  return write(fd, buffer, length);
+}
+
+static int devGetWakeup(int fd) {
+  return ioctl(fd, ST21NFC_GET_WAKEUP, NULL);
+}
+
+static int devResetPulse(int fd) {
+  return ioctl(fd, ST21NFC_PULSE_RESET, NULL);
+}
+
+static int devSetPolarity(int fd, bool low, bool edge) {
+  unsigned int io_code;
+
+  if (low) {
+    if (edge) {
+      io_code = ST21NFC_SET_POLARITY_FALLING;
+    } else {
+      io_code = ST21NFC_SET_POLARITY_LOW;
+    }
+
+  } else {
+    if (edge) {
+      io_code = ST21NFC_SET_POLARITY_RISING;
+    } else {
+      io_code = ST21NFC_SET_POLARITY_HIGH;
+    }
+  }
+
+  return ioctl(fd, io_code, NULL);
+}
+
+const I2cTransport i2cDeviceTransport = {
+    "/dev/st21nfc", devOpen,      devClose,      devRead,
+    devWrite,       devGetWakeup, devResetPulse, devSetPolarity,
+};
@@ -0,0 +1,311 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+/*
+ * NFCC simulator, for the tests and benchmarks only: it is built into
+ * libnfc_nci.st21nfc_sim, not into the HAL, and selected with
+ * I2cSetTransport(&i2cSimTransport).
+ * The I2C layer talks to a thread emulating an ST21NFC in router mode over a
+ * socketpair, so that the HAL can run and be timed without the chip:
+ *  - CORE_RESET_NTF after a reset pulse, CORE_RESET/CORE_INIT responses
+ *    followed by the notifications hal_wrapper.cc waits for,
+ *  - PROP_NFC_MODE_SET and the FW debug configuration read,
+ *  - data packets are looped back, with a credit notification,
+ *  - reads beyond the pending bytes are padded with idle bytes (0x7E),
+ *  - the wake-up pin is active while bytes are pending.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "android_logmsg.h"
+#include "halcore.h"
+#include "halcore_private.h"
+#include "i2ctransport.h"
+
+#define SIM_IDLE_BYTE 0x7E
+
+/* CORE_RESET_NTF reset triggers */
+#define SIM_RESET_POWER_ON 0x01
+#define SIM_RESET_CMD 0x02
+#define SIM_RESET_NFC_MODE 0xA0
+
+/* PROP_CMD sub-opcodes */
+#define SIM_PROP_NFC_MODE_SET 0x02
+#define SIM_PROP_GET_CONFIG 0x03
+
+typedef struct {
+  int simFd;      /* simulator end of the socketpair */
+  int halFd;      /* end returned to the I2C layer */
+  pthread_t thread;
+  pthread_mutex_t mtx; /* one frame per send, from either thread */
+  uint32_t framesIn;
+  uint32_t framesOut;
+} SimInstance;
+
+static SimInstance sim = {-1, -1, (pthread_t)NULL, PTHREAD_MUTEX_INITIALIZER,
+                          0, 0};
+
+/**
+ * Queue a frame towards the HAL.
+ * @param data NCI frame
+ * @param length Size of the frame
+ */
+static void simSendFrame(const uint8_t* data, size_t length) {
+  (void)pthread_mutex_lock(&sim.mtx);
+  if (send(sim.simFd, data, length, MSG_NOSIGNAL) != (ssize_t)length) {
+    STLOG_HAL_W("simulator: failed to send frame (%s)\n", strerror(errno));
+  } else {
+    sim.framesOut++;
+  }
+  (void)pthread_mutex_unlock(&sim.mtx);
+}
+
+/**
+ * Send CORE_RESET_NTF, router mode, HW version of an ST21NFCD so that no
+ * firmware update is attempted.
+ * @param trigger Reset trigger
+ */
+static void simSendResetNtf(uint8_t trigger) {
+  uint8_t ntf[3 + 31];
+
+  memset(ntf, 0, sizeof(ntf));
+  ntf[0] = 0x60;
+  ntf[1] = 0x00;
+  ntf[2] = sizeof(ntf) - 3;
+  ntf[3] = trigger;
+  ntf[4] = 0x00;  // configuration status
+  ntf[5] = 0x20;  // NCI 2.0
+  ntf[6] = 0x02;  // manufacturer ID
+  ntf[7] = sizeof(ntf) - 8;
+  ntf[8] = 0x04;  // HW version
+  ntf[10] = 0x01;  // FW version
+  ntf[11] = 0x02;
+  ntf[12] = 0x03;
+  ntf[13] = 0x04;
+  simSendFrame(ntf, sizeof(ntf));
+}
+
+/**
+ * Answer CORE_INIT_CMD, with no static HCI credit so the HAL lends one and
+ * gets it back with CORE_CONN_CREDITS_NTF.
+ */
+static void simSendInitRsp() {
+  const uint8_t rsp[] = {0x40, 0x01, 0x0E, 0x00, 0x1A, 0x7E, 0x06,
+                         0x02, 0x01, 0x00, 0x02, 0xFF, 0xFF, 0x00,
+                         0x00, 0x00, 0x00};
+  const uint8_t ntf[] = {0x60, 0x06, 0x03, 0x01, 0x01, 0x01};
+
+  simSendFrame(rsp, sizeof(rsp));
+  simSendFrame(ntf, sizeof(ntf));
+}
+
+/**
+ * Answer a proprietary command.
+ * @param data NCI frame
+ * @param length Size of the frame
+ */
+static void simHandlePropCmd(const uint8_t* data, size_t length) {
+  uint8_t rsp[] = {0x4F, (uint8_t)(data[1] & 0x3F), 0x01, 0x00};
+
+  if ((rsp[1] == 0x02) && (length > 4) &&
+      (data[3] == SIM_PROP_NFC_MODE_SET)) {
+    simSendFrame(rsp, sizeof(rsp));
+    if (data[4] == 0x01) {
+      // The NFCC restarts in NFC mode
+      simSendResetNtf(SIM_RESET_NFC_MODE);
+    }
+  } else if ((rsp[1] == 0x02) && (length > 3) &&
+             (data[3] == SIM_PROP_GET_CONFIG)) {
+    // FW debug traces disabled
+    const uint8_t cfg[] = {0x4F, 0x02, 0x06, 0x00, 0x01,
+                           0x14, 0x02, 0x00, 0x00};
+    simSendFrame(cfg, sizeof(cfg));
+  } else {
+    simSendFrame(rsp, sizeof(rsp));
+  }
+}
+
+/**
+ * Emulate the processing of a frame by the NFCC.
+ * @param data NCI frame
+ * @param length Size of the frame
+ */
+static void simHandleFrame(const uint8_t* data, size_t length) {
+  uint8_t mt = data[0] & 0xE0;
+  uint8_t gid = data[0] & 0x0F;
+  uint8_t oid = data[1] & 0x3F;
+
+  if (mt == 0x00) {
+    // Data packet: loop it back and return the credit
+    uint8_t ntf[] = {0x60, 0x06, 0x03, 0x01, gid, 0x01};
+    simSendFrame(data, length);
+    simSendFrame(ntf, sizeof(ntf));
+    return;
+  }
+
+  if (mt != 0x20) {
+    STLOG_HAL_W("simulator: unexpected message type 0x%02x\n", data[0]);
+    return;
+  }
+
+  if ((gid == 0x00) && (oid == 0x00)) {
+    const uint8_t rsp[] = {0x40, 0x00, 0x01, 0x00};
+    simSendFrame(rsp, sizeof(rsp));
+    simSendResetNtf(SIM_RESET_CMD);
+  } else if ((gid == 0x00) && (oid == 0x01)) {
+    simSendInitRsp();
+  } else if ((gid == 0x00) && (oid == 0x02)) {
+    // CORE_SET_CONFIG_RSP, all parameters accepted
+    const uint8_t rsp[] = {0x40, 0x02, 0x02, 0x00, 0x00};
+    simSendFrame(rsp, sizeof(rsp));
+  } else if (gid == 0x0F) {
+    simHandlePropCmd(data, length);
+  } else {
+    uint8_t rsp[] = {(uint8_t)(0x40 | gid), oid, 0x01, 0x00};
+    simSendFrame(rsp, sizeof(rsp));
+  }
+}
+
+/**
+ * Read exactly the given number of bytes from the HAL.
+ * @return false once the HAL closed its end
+ */
+static bool simReadAll(uint8_t* buffer, size_t length) {
+  while (length > 0) {
+    ssize_t n = read(sim.simFd, buffer, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buffer += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * Simulator thread: process the frames written by the HAL until it closes
+ * the transport.
+ */
+static void* simThread(void* arg) {
+  uint8_t frame[MAX_BUFFER_SIZE];
+  (void)arg;
+
+  while (simReadAll(frame, MAX_HEADER_SIZE) &&
+         simReadAll(frame + MAX_HEADER_SIZE, frame[2])) {
+    sim.framesIn++;
+    simHandleFrame(frame, MAX_HEADER_SIZE + frame[2]);
+  }
+
+  STLOG_HAL_D("simulator: %u frames received, %u sent\n", sim.framesIn,
+              sim.framesOut);
+  return NULL;
+}
+
+static int simOpen() {
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    STLOG_HAL_W("simulator: socketpair failed (%s)\n", strerror(errno));
+    return -1;
+  }
+  sim.halFd = sv[0];
+  sim.simFd = sv[1];
+  sim.framesIn = 0;
+  sim.framesOut = 0;
+
+  if (pthread_create(&sim.thread, NULL, simThread, NULL) != 0) {
+    STLOG_HAL_W("simulator: failed to start thread\n");
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  return sim.halFd;
+}
+
+static void simClose(int fd) {
+  // The simulator thread sees the end of stream and exits
+  shutdown(fd, SHUT_RDWR);
+  pthread_join(sim.thread, NULL);
+  close(fd);
+  close(sim.simFd);
+  sim.halFd = sim.simFd = -1;
+}
+
+static ssize_t simRead(int fd, uint8_t* buffer, size_t length) {
+  ssize_t n = recv(fd, buffer, length, MSG_DONTWAIT);
+
+  if (n < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      return -1;
+    }
+    n = 0;
+  }
+  // Like on I2C, the NFCC clocks out idle bytes when it has nothing to send
+  memset(buffer + n, SIM_IDLE_BYTE, length - n);
+  return length;
+}
+
+static ssize_t simWrite(int fd, const uint8_t* buffer, size_t length) {
+  return send(fd, buffer, length, MSG_NOSIGNAL);
+}
+
+static int simGetWakeup(int fd) {
+  int pending = 0;
+
+  if (ioctl(fd, FIONREAD, &pending) != 0) {
+    return -1;
+  }
+  return (pending > 0) ? 1 : 0;
+}
+
+static int simResetPulse(int fd) {
+  int pending = 0;
+
+  // Whatever the NFCC had not sent yet is lost
+  while ((ioctl(fd, FIONREAD, &pending) == 0) && (pending > 0)) {
+    uint8_t discard[MAX_BUFFER_SIZE];
+    if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+      break;
+    }
+  }
+  simSendResetNtf(SIM_RESET_POWER_ON);
+  return 0;
+}
+
+static int simSetPolarity(int fd, bool low, bool edge) {
+  // simGetWakeup already reports the pin as active or not
+  (void)fd;
+  (void)low;
+  (void)edge;
+  return 0;
+}
+
+const I2cTransport i2cSimTransport = {
+    "simulator", simOpen,      simClose,      simRead,
+    simWrite,    simGetWakeup, simResetPulse, simSetPolarity,
+};
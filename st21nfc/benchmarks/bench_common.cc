@@ -0,0 +1,116 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+#include "bench_common.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include "android_logmsg.h"
+#include "hal_config.h"
+
+#ifdef __ANDROID__
+#define BENCH_DIR_TEMPLATE "/data/local/tmp/st21nfc_benchXXXXXX"
+#else
+#define BENCH_DIR_TEMPLATE "/tmp/st21nfc_benchXXXXXX"
+#endif
+
+/* settings of every benchmark, before its own ones */
+static const char benchBaseConfig[] =
+    "STNFC_HAL_LOGLEVEL=0\n"
+    "STNFC_HAL_RECORDER_SECONDS=0\n"
+    "STNFC_HAL_CONFIG_RELOAD=0\n";
+
+double BenchNowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+bool BenchWait(sem_t* sem, int count) {
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += BENCH_TIMEOUT_MS / 1000;
+  while (count--) {
+    while (sem_timedwait(sem, &deadline) != 0) {
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+const char* BenchDir() {
+  static char dir[] = BENCH_DIR_TEMPLATE "/";
+  static bool created = false;
+
+  if (!created) {
+    // mkdtemp wants the template without the final '/'
+    dir[sizeof(dir) - 2] = '\0';
+    if (mkdtemp(dir) == NULL) {
+      return NULL;
+    }
+    dir[sizeof(dir) - 2] = '/';
+    created = true;
+  }
+  return dir;
+}
+
+bool BenchWriteFile(const char* name, const char* content) {
+  const char* dir = BenchDir();
+  char path[256];
+
+  if (dir == NULL) {
+    return false;
+  }
+  snprintf(path, sizeof(path), "%s%s", dir, name);
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    return false;
+  }
+  size_t length = strlen(content);
+  bool written = (fwrite(content, 1, length, f) == length);
+  return (fclose(f) == 0) && written;
+}
+
+bool BenchConfig(const char* settings) {
+  std::string content(benchBaseConfig);
+
+  content += settings;
+  if (!BenchWriteFile("libnfc-hal-st.conf", content.c_str())) {
+    return false;
+  }
+  HalConfigSetDir(BenchDir());
+  InitializeSTLogLevel();
+  return true;
+}
+
+void BenchReportPercentiles(benchmark::State& state, std::vector<double>& us) {
+  if (us.empty()) {
+    return;
+  }
+  std::sort(us.begin(), us.end());
+  state.counters["p50_us"] = us[us.size() / 2];
+  state.counters["p99_us"] = us[std::min(us.size() - 1, us.size() * 99 / 100)];
+}
@@ -0,0 +1,72 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+#ifndef __BENCH_COMMON_H_
+#define __BENCH_COMMON_H_
+
+#include <benchmark/benchmark.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <vector>
+
+/* max. wait for an answer of the simulator or of HAL Core */
+#define BENCH_TIMEOUT_MS 1000
+
+/**
+ * Get a monotonic time stamp.
+ * @return Time in us
+ */
+double BenchNowUs();
+
+/**
+ * Wait for a semaphore to be posted count times.
+ * @return false after BENCH_TIMEOUT_MS
+ */
+bool BenchWait(sem_t* sem, int count);
+
+/**
+ * Get the temp dir of the benchmark, created at the first call.
+ * @return Path ending with '/', NULL if it cannot be created
+ */
+const char* BenchDir();
+
+/**
+ * Write a file in the temp dir.
+ * @param name File name
+ * @param content Text to write
+ * @return false if the file cannot be written
+ */
+bool BenchWriteFile(const char* name, const char* content);
+
+/**
+ * Write the HAL config file in the temp dir and read it: logs and recorder
+ * off, no reload, then settings.
+ * @param settings Lines added to the config file
+ * @return false if the file cannot be written
+ */
+bool BenchConfig(const char* settings);
+
+/**
+ * Report the p50 and p99 of the iteration times.
+ * @param state Benchmark state
+ * @param us Time of each iteration in us, sorted here
+ */
+void BenchReportPercentiles(benchmark::State& state, std::vector<double>& us);
+
+#endif
@@ -0,0 +1,147 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+
+/*
+ * Parse and lookup cost of the config store, over generated config files.
+ */
+
+#include <stdio.h>
+#include <string>
+#include "android_logmsg.h"
+#include "bench_common.h"
+#include "hal_config.h"
+
+/**
+ * Build a config with keys settings besides the base ones: numbers, and
+ * every tenth a string then a byte array, like the real files.
+ * @param keys Number of generated settings
+ */
+static std::string BenchConfigText(int keys) {
+  std::string text("ISO_DEP_MAX_TRANSCEIVE=0xFEFF\n");
+  char line[128];
+
+  for (int i = 0; i < keys; i++) {
+    if (i % 10 == 5) {
+      snprintf(line, sizeof(line), "STNFC_BENCH_STR_%d=\"/vendor/etc/%d\"\n",
+               i, i);
+    } else if (i % 10 == 9) {
+      snprintf(line, sizeof(line),
+               "# byte array\nSTNFC_BENCH_BYTES_%d={%02X:01:02:03:04:05:06:07}"
+               "\n",
+               i, i & 0xFF);
+    } else {
+      snprintf(line, sizeof(line), "STNFC_BENCH_NUM_%d=0x%X\n", i, i);
+    }
+    text += line;
+  }
+  return text;
+}
+
+/**
+ * Read and publish a config file. Argument: number of generated settings.
+ */
+static void BM_ConfigParse(benchmark::State& state) {
+  if (!BenchConfig(BenchConfigText(state.range(0)).c_str())) {
+    state.SkipWithError("cannot write the config");
+    return;
+  }
+
+  for (auto _ : state) {
+    HalConfigSetDir(BenchDir());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ConfigParse)->ArgName("keys")->Arg(100)->Arg(5000);
+
+/**
+ * Numerical setting looked up by name, as done by the callers outside the
+ * key registry. Argument: number of generated settings.
+ */
+static void BM_ConfigGetNumValue(benchmark::State& state) {
+  unsigned long num = 0;
+
+  if (!BenchConfig(BenchConfigText(state.range(0)).c_str())) {
+    state.SkipWithError("cannot write the config");
+    return;
+  }
+
+  if (!GetNumValue("STNFC_BENCH_NUM_42", &num, sizeof(num)) || (num != 42)) {
+    state.SkipWithError("setting not found");
+    return;
+  }
+
+  for (auto _ : state) {
+    GetNumValue("STNFC_BENCH_NUM_42", &num, sizeof(num));
+    benchmark::DoNotOptimize(num);
+  }
+}
+BENCHMARK(BM_ConfigGetNumValue)->ArgName("keys")->Arg(100)->Arg(5000);
+
+/**
+ * Byte array setting looked up by name. Argument: number of generated
+ * settings.
+ */
+static void BM_ConfigGetByteArrayValue(benchmark::State& state) {
+  char bytes[16];
+  long length = 0;
+
+  if (!BenchConfig(BenchConfigText(state.range(0)).c_str())) {
+    state.SkipWithError("cannot write the config");
+    return;
+  }
+
+  if (!GetByteArrayValue("STNFC_BENCH_BYTES_49", bytes, sizeof(bytes),
+                         &length) ||
+      (length != 8)) {
+    state.SkipWithError("setting not found");
+    return;
+  }
+
+  for (auto _ : state) {
+    GetByteArrayValue("STNFC_BENCH_BYTES_49", bytes, sizeof(bytes), &length);
+    benchmark::DoNotOptimize(length);
+  }
+}
+BENCHMARK(BM_ConfigGetByteArrayValue)->ArgName("keys")->Arg(100)->Arg(5000);
+
+/**
+ * The same registry setting looked up by name through the C entry point,
+ * then through its typed accessor. Argument: 0 by name, 1 typed.
+ */
+static void BM_ConfigRegistryNum(benchmark::State& state) {
+  unsigned long num = 0;
+  bool typed = state.range(0);
+
+  if (!BenchConfig(BenchConfigText(100).c_str()) ||
+      !HalConfigNum<HAL_CFG_ISO_DEP_MAX_TRANSCEIVE>(&num) || (num != 0xFEFF)) {
+    state.SkipWithError("setting not found");
+    return;
+  }
+
+  for (auto _ : state) {
+    if (typed) {
+      HalConfigNum<HAL_CFG_ISO_DEP_MAX_TRANSCEIVE>(&num);
+    } else {
+      GetNumValue(NAME_ISO_DEP_MAX_TRANSCEIVE, &num, sizeof(num));
+    }
+    benchmark::DoNotOptimize(num);
+  }
+}
+BENCHMARK(BM_ConfigRegistryNum)->ArgName("typed")->Arg(0)->Arg(1);
@@ -0,0 +1,291 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+/*
+ * Latency benchmarks of the HAL stack. The HAL runs over the NFCC simulator,
+ * so they need neither the chip nor a device:
+ *   st21nfc_hal_benchmark --benchmark_format=json
+ * Besides the average, each benchmark reports the p50 and p99 of its
+ * iterations in us (counters p50_us and p99_us).
+ */
+
+#include <hardware/nfc.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include "bench_common.h"
+#include "halcore.h"
+#include "i2ctransport.h"
+
+typedef struct {
+  struct nfc_nci_device nci_device;  // nci_device must be first struct member
+  // below declarations are private variables within HAL
+  nfc_stack_callback_t* p_cback;
+  nfc_stack_data_callback_t* p_data_cback;
+  HALHANDLE hHAL;
+} st21nfc_dev_t;  // beware, is a duplication of structure in hal_wrapper.cc
+
+extern bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
+                             nfc_stack_data_callback_t* p_data_cback,
+                             HALHANDLE* pHandle);
+extern int hal_wrapper_close(int call_cb, int nfc_mode);
+extern void hal_wrapper_send_config();
+
+static st21nfc_dev_t benchDev;
+static HALHANDLE benchHal;
+static sem_t benchEvent; /* stack events */
+static sem_t benchData;  /* upstream frames */
+
+/* transport calls of the I2C thread, see benchCountingTransport */
+static std::atomic<uint32_t> benchReads;
+static std::atomic<uint32_t> benchWakeups;
+
+static ssize_t BenchTransportRead(int fd, uint8_t* buffer, size_t length) {
+  benchReads++;
+  return i2cSimTransport.read(fd, buffer, length);
+}
+
+static int BenchTransportGetWakeup(int fd) {
+  benchWakeups++;
+  return i2cSimTransport.getWakeup(fd);
+}
+
+/* the simulator, counting the read() and GPIO ioctl() calls of the reader */
+static const I2cTransport benchCountingTransport = {
+    "bench",
+    i2cSimTransport.open,
+    i2cSimTransport.close,
+    BenchTransportRead,
+    i2cSimTransport.write,
+    BenchTransportGetWakeup,
+    i2cSimTransport.resetPulse,
+    i2cSimTransport.setPolarity,
+};
+
+static void BenchEventCallback(nfc_event_t event, nfc_status_t status) {
+  (void)event;
+  (void)status;
+  sem_post(&benchEvent);
+}
+
+static void BenchDataCallback(uint16_t length, uint8_t* data) {
+  (void)length;
+  (void)data;
+  sem_post(&benchData);
+}
+
+/**
+ * Open the HAL over the simulator and take the NFCC through CORE_RESET,
+ * CORE_INIT and the post-init config, like the stack does.
+ * @return false if a step failed
+ */
+static bool BenchOpen() {
+  static const uint8_t coreReset[] = {0x20, 0x00, 0x01, 0x01};
+  static const uint8_t coreInit[] = {0x20, 0x01, 0x02, 0x00, 0x00};
+
+  sem_init(&benchEvent, 0, 0);
+  sem_init(&benchData, 0, 0);
+  memset(&benchDev, 0, sizeof(benchDev));
+  benchHal = NULL;
+
+  I2cSetTransport(&benchCountingTransport);
+  hal_wrapper_open(&benchDev, BenchEventCallback, BenchDataCallback,
+                   &benchHal);
+  if (benchHal == NULL) {
+    return false;
+  }
+  // HAL_NFC_OPEN_CPLT_EVT
+  if (!BenchWait(&benchEvent, 1)) {
+    return false;
+  }
+
+  // CORE_RESET_RSP and CORE_RESET_NTF, then CORE_INIT_RSP
+  HalSendDownstream(benchHal, coreReset, sizeof(coreReset));
+  if (!BenchWait(&benchData, 2)) {
+    return false;
+  }
+  HalSendDownstream(benchHal, coreInit, sizeof(coreInit));
+  if (!BenchWait(&benchData, 1)) {
+    return false;
+  }
+
+  // HAL_NFC_POST_INIT_CPLT_EVT
+  hal_wrapper_send_config();
+  return BenchWait(&benchEvent, 1);
+}
+
+/**
+ * Close the HAL opened by BenchOpen, switching the NFCC off.
+ */
+static void BenchClose() {
+  if (benchHal != NULL) {
+    hal_wrapper_close(1, 0);
+    benchHal = NULL;
+  }
+  sem_destroy(&benchEvent);
+  sem_destroy(&benchData);
+}
+
+/**
+ * A data packet sent downstream until the simulator loops it back: HAL Core,
+ * I2C thread, simulator, RX path and wrapper. Argument: reactor mode.
+ */
+static void BM_DataRoundTrip(benchmark::State& state) {
+  static const uint8_t data[] = {0x00, 0x00, 0x04, 0x01, 0x02, 0x03, 0x04};
+  std::vector<double> us;
+
+  if (!BenchConfig(state.range(0) ? "STNFC_HAL_REACTOR_MODE=1\n" : "") ||
+      !BenchOpen()) {
+    BenchClose();
+    state.SkipWithError("HAL open failed");
+    return;
+  }
+
+  for (auto _ : state) {
+    double start = BenchNowUs();
+    HalSendDownstream(benchHal, data, sizeof(data));
+    // The packet comes back with a credit notification
+    if (!BenchWait(&benchData, 2)) {
+      state.SkipWithError("no loopback");
+      break;
+    }
+    us.push_back(BenchNowUs() - start);
+  }
+
+  BenchClose();
+  BenchReportPercentiles(state, us);
+}
+BENCHMARK(BM_DataRoundTrip)->ArgName("reactor")->Arg(0)->Arg(1)->UseRealTime();
+
+/**
+ * Data round trip with small and full size packets: the frame is copied once,
+ * from the caller into its TX buffer, so the size costs little. Arguments:
+ * payload size, STNFC_HAL_TX_POOL_SIZE.
+ */
+static void BM_DataFrameSize(benchmark::State& state) {
+  uint8_t data[3 + 255] = {0x00, 0x00, (uint8_t)state.range(0)};
+  char settings[64];
+  std::vector<double> us;
+
+  snprintf(settings, sizeof(settings), "STNFC_HAL_TX_POOL_SIZE=%d\n",
+           (int)state.range(1));
+  if (!BenchConfig(settings) || !BenchOpen()) {
+    BenchClose();
+    state.SkipWithError("HAL open failed");
+    return;
+  }
+
+  for (auto _ : state) {
+    double start = BenchNowUs();
+    HalSendDownstream(benchHal, data, 3 + state.range(0));
+    // The packet comes back with a credit notification
+    if (!BenchWait(&benchData, 2)) {
+      state.SkipWithError("no loopback");
+      break;
+    }
+    us.push_back(BenchNowUs() - start);
+  }
+
+  BenchClose();
+  BenchReportPercentiles(state, us);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DataFrameSize)
+    ->ArgNames({"payload", "pool"})
+    ->Args({4, 1})
+    ->Args({255, 1})
+    ->Args({4, 10})
+    ->Args({255, 10})
+    ->UseRealTime();
+
+/**
+ * Bursts of data packets sent downstream and looped back by the simulator, so
+ * that several frames wait for the RX reader at once. Arguments: number of
+ * packets, STNFC_I2C_READ_CHUNK. Reports the transport calls per upstream
+ * frame (syscalls_per_frame).
+ */
+static void BM_UpstreamBurst(benchmark::State& state) {
+  static const uint8_t data[] = {0x00, 0x00, 0x04, 0x01, 0x02, 0x03, 0x04};
+  int burst = state.range(0);
+  char settings[64];
+  uint64_t frames = 0;
+
+  snprintf(settings, sizeof(settings), "STNFC_I2C_READ_CHUNK=%d\n",
+           (int)state.range(1));
+  if (!BenchConfig(settings) || !BenchOpen()) {
+    BenchClose();
+    state.SkipWithError("HAL open failed");
+    return;
+  }
+  benchReads = 0;
+  benchWakeups = 0;
+
+  for (auto _ : state) {
+    for (int i = 0; i < burst; i++) {
+      HalSendDownstream(benchHal, data, sizeof(data));
+    }
+    // Each packet comes back with a credit notification
+    if (!BenchWait(&benchData, 2 * burst)) {
+      state.SkipWithError("no loopback");
+      break;
+    }
+    frames += 2 * burst;
+  }
+
+  if (frames > 0) {
+    state.counters["syscalls_per_frame"] =
+        (double)(benchReads + benchWakeups) / frames;
+  }
+  BenchClose();
+}
+BENCHMARK(BM_UpstreamBurst)
+    ->ArgNames({"burst", "chunk"})
+    ->Args({16, 0})
+    ->Args({16, 258})
+    ->UseRealTime();
+
+/**
+ * A whole HAL open, NFCC init and close cycle. Argument: reactor mode.
+ */
+static void BM_OpenClose(benchmark::State& state) {
+  std::vector<double> us;
+
+  if (!BenchConfig(state.range(0) ? "STNFC_HAL_REACTOR_MODE=1\n" : "")) {
+    state.SkipWithError("cannot write the config");
+    return;
+  }
+
+  for (auto _ : state) {
+    double start = BenchNowUs();
+    bool opened = BenchOpen();
+    BenchClose();
+    if (!opened) {
+      state.SkipWithError("HAL open failed");
+      break;
+    }
+    us.push_back(BenchNowUs() - start);
+  }
+
+  BenchReportPercentiles(state, us);
+}
+BENCHMARK(BM_OpenClose)->ArgName("reactor")->Arg(0)->Arg(1)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,200 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+
+/*
+ * Enqueue-to-dispatch latency of the HAL Core worker, and the cost of its
+ * message ring next to the mutex and semaphore queue it replaced.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include "bench_common.h"
+#include "halcore.h"
+#include "halcore_private.h"
+
+static HALHANDLE benchCore;
+static sem_t benchDispatched;
+static std::atomic<uint64_t> benchDispatchNs;
+
+/**
+ * HAL Core callback: account for the dispatch latency of the upstream frames
+ * and wake up their producer. The downstream ones are dropped.
+ */
+static void BenchCoreCallback(void* context, uint32_t event, const void* data,
+                              size_t length) {
+  double sentUs;
+  (void)context;
+
+  if ((event != HAL_EVENT_DATAIND) ||
+      (length != MAX_HEADER_SIZE + sizeof(sentUs))) {
+    return;
+  }
+  memcpy(&sentUs, (const uint8_t*)data + MAX_HEADER_SIZE, sizeof(sentUs));
+  benchDispatchNs += (uint64_t)((BenchNowUs() - sentUs) * 1000);
+  sem_post(&benchDispatched);
+}
+
+/**
+ * Frames posted upstream by one thread, like the I2C thread does, each
+ * waiting for HAL Core to hand it to the callback, while the other threads
+ * send data packets downstream, like the stack writers. Reports the one-way
+ * enqueue-to-dispatch latency of the upstream frames (dispatch_us).
+ */
+static void BM_UpstreamDispatch(benchmark::State& state) {
+  uint8_t frame[MAX_HEADER_SIZE + sizeof(double)] = {0x00, 0x00,
+                                                     sizeof(double)};
+
+  if (state.thread_index() == 0) {
+    BenchConfig("");
+    sem_init(&benchDispatched, 0, 0);
+    benchDispatchNs = 0;
+    benchCore = HalCreate(NULL, BenchCoreCallback, HAL_FLAG_NO_DEBUG);
+  }
+
+  for (auto _ : state) {
+    if (benchCore == NULL) {
+      state.SkipWithError("HalCreate failed");
+      break;
+    }
+    if (state.thread_index() != 0) {
+      // Stack writer, contending for the worker and the message ring
+      if (!HalSendDownstream(benchCore, frame, sizeof(frame))) {
+        state.SkipWithError("frame not sent");
+        break;
+      }
+      continue;
+    }
+    double sentUs = BenchNowUs();
+    memcpy(frame + MAX_HEADER_SIZE, &sentUs, sizeof(sentUs));
+    if (!HalSendUpstream(benchCore, frame, sizeof(frame)) ||
+        !BenchWait(&benchDispatched, 1)) {
+      state.SkipWithError("frame not dispatched");
+      break;
+    }
+  }
+
+  if (state.thread_index() == 0) {
+    if (benchCore != NULL) {
+      HalDestroy(benchCore);
+      benchCore = NULL;
+    }
+    sem_destroy(&benchDispatched);
+    // Over the upstream frames only, the writers iterate too
+    state.counters["dispatch_us"] =
+        benchDispatchNs / 1000.0 / std::max<double>(state.iterations(), 1);
+  }
+}
+BENCHMARK(BM_UpstreamDispatch)->ThreadRange(1, 4)->UseRealTime();
+
+/**
+ * The worker queue before HalRing: a ring under a mutex, with a semaphore
+ * counting the messages.
+ */
+class BenchLockedQueue {
+ public:
+  bool init(size_t capacity) {
+    mCapacity = capacity;
+    mCount = 0;
+    mFirst = 0;
+    mCells = (ThreadMesssage*)calloc(capacity, sizeof(ThreadMesssage));
+    pthread_mutex_init(&mMutex, NULL);
+    sem_init(&mSem, 0, 0);
+    return mCells != NULL;
+  }
+
+  void release() {
+    sem_destroy(&mSem);
+    pthread_mutex_destroy(&mMutex);
+    free(mCells);
+    mCells = NULL;
+  }
+
+  bool push(const ThreadMesssage& item) {
+    pthread_mutex_lock(&mMutex);
+    if (mCount == mCapacity) {
+      pthread_mutex_unlock(&mMutex);
+      return false;
+    }
+    mCells[(mFirst + mCount++) % mCapacity] = item;
+    pthread_mutex_unlock(&mMutex);
+    sem_post(&mSem);
+    return true;
+  }
+
+  bool pop(ThreadMesssage* item) {
+    sem_wait(&mSem);
+    pthread_mutex_lock(&mMutex);
+    *item = mCells[mFirst];
+    mFirst = (mFirst + 1) % mCapacity;
+    mCount--;
+    pthread_mutex_unlock(&mMutex);
+    return true;
+  }
+
+ private:
+  ThreadMesssage* mCells;
+  size_t mCapacity;
+  size_t mCount;
+  size_t mFirst;
+  pthread_mutex_t mMutex;
+  sem_t mSem;
+};
+
+template <typename Q>
+static Q& BenchQueue() {
+  static Q queue;
+  return queue;
+}
+
+/**
+ * A message pushed then popped by each thread, so the threads contend on
+ * both ends of the queue.
+ */
+template <typename Q>
+static void BM_WorkerQueue(benchmark::State& state) {
+  Q& queue = BenchQueue<Q>();
+  ThreadMesssage msg;
+
+  memset(&msg, 0, sizeof(msg));
+  if ((state.thread_index() == 0) && !queue.init(HAL_QUEUE_MAX)) {
+    state.SkipWithError("out of memory");
+  }
+
+  for (auto _ : state) {
+    msg.command = MSG_RX_DATA;
+    while (!queue.push(msg)) {
+    }
+    while (!queue.pop(&msg)) {
+    }
+  }
+
+  if (state.thread_index() == 0) {
+    queue.release();
+  }
+}
+BENCHMARK_TEMPLATE(BM_WorkerQueue, HalRing<ThreadMesssage>)
+    ->ThreadRange(1, 4)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_WorkerQueue, BenchLockedQueue)
+    ->ThreadRange(1, 4)
+    ->UseRealTime();
@@ -23,6 +23,7 @@
 #include <hardware/nfc.h>
 #include <string.h>
 #include "android_logmsg.h"
+#include "hal_config.h"
 #include "halcore.h"
 /* Initialize fw info structure pointer used to access fw info structure */
 FWInfo *mFWInfo = NULL;
@@ -77,28 +78,23 @@ int hal_fd_init() {
 
   STLOG_HAL_D("  %s - enter", __func__);
 
-  if (!GetStrValue(NAME_STNFC_FW_PATH_STORAGE, (char *)FwPath,
-                   sizeof(FwPath))) {
+  if (!HalConfigStr<HAL_CFG_STNFC_FW_PATH_STORAGE>(FwPath, sizeof(FwPath))) {
     STLOG_HAL_D(
-        "%s - FW path not found in conf. use default location /vendor/firmware "
-        "\n", __func__);
-    strcpy(FwPath, "/vendor/firmware");
+        "%s - FW path not found in conf. use default location %s \n",
+        __func__, FwPath);
   }
 
-  if (!GetStrValue(NAME_STNFC_FW_BIN_NAME, (char *)fwBinName,
-                   sizeof(fwBinName))) {
+  if (!HalConfigStr<HAL_CFG_STNFC_FW_BIN_NAME>(fwBinName, sizeof(fwBinName))) {
     STLOG_HAL_D(
         "%s - FW binary file name not found in conf. use default name "
-        "/st21nfc_fw.bin \n", __func__);
-    strcpy(fwBinName, "/st21nfc_fw.bin");
+        "%s \n", __func__, fwBinName);
   }
 
-  if (!GetStrValue(NAME_STNFC_FW_CONF_NAME, (char *)fwConfName,
-                   sizeof(fwConfName))) {
+  if (!HalConfigStr<HAL_CFG_STNFC_FW_CONF_NAME>(fwConfName,
+                                                 sizeof(fwConfName))) {
     STLOG_HAL_D(
         "%s - FW config file name not found in conf. use default name "
-        "/st21nfc_conf.bin \n", __func__);
-    strcpy(fwConfName, "/st21nfc_conf.bin");
+        "%s \n", __func__, fwConfName);
   }
 
   // Getting information about FW patch, if any
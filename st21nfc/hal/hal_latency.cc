@@ -0,0 +1,134 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+#include "hal_latency.h"
+#include <atomic>
+#include "android_logmsg.h"
+
+/*
+ * Log-linear histogram in microseconds: values below 2^SUB_BITS have their
+ * own bucket, above that each power of two is split in 2^SUB_BITS buckets,
+ * so a percentile is off by at most 12.5%.
+ */
+#define HAL_LATENCY_SUB_BITS 3
+#define HAL_LATENCY_SUB_COUNT (1 << HAL_LATENCY_SUB_BITS)
+#define HAL_LATENCY_BUCKETS \
+  (HAL_LATENCY_SUB_COUNT * (64 - HAL_LATENCY_SUB_BITS + 1))
+
+typedef struct {
+  std::atomic<uint32_t> buckets[HAL_LATENCY_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> maxUs;
+} HalLatencyHistogram;
+
+static const char* const pathNames[HAL_LATENCY_PATH_MAX] = {
+    "tx", "rx", "open", "event", "upstream", "close"};
+
+static HalLatencyHistogram histograms[HAL_LATENCY_PATH_MAX];
+
+static uint32_t HalLatencyBucket(uint64_t us) {
+  if (us < HAL_LATENCY_SUB_COUNT) {
+    return (uint32_t)us;
+  }
+  uint32_t msb = 63 - __builtin_clzll(us);
+  uint32_t shift = msb - HAL_LATENCY_SUB_BITS;
+  return ((shift + 1) << HAL_LATENCY_SUB_BITS) +
+         (uint32_t)((us >> shift) & (HAL_LATENCY_SUB_COUNT - 1));
+}
+
+/* highest value falling in a bucket */
+static uint64_t HalLatencyBucketLimit(uint32_t bucket) {
+  if (bucket < HAL_LATENCY_SUB_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> HAL_LATENCY_SUB_BITS) - 1;
+  uint64_t base = (uint64_t)(HAL_LATENCY_SUB_COUNT +
+                             (bucket & (HAL_LATENCY_SUB_COUNT - 1)))
+                  << shift;
+  return base + ((1ULL << shift) - 1);
+}
+
+void HalLatencyRecord(uint32_t path, const struct timespec* start) {
+  struct timespec now;
+
+  if (path >= HAL_LATENCY_PATH_MAX) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+               (now.tv_nsec - start->tv_nsec) / 1000;
+  if (us < 0) {
+    us = 0;
+  }
+
+  HalLatencyHistogram* h = &histograms[path];
+  h->buckets[HalLatencyBucket(us)].fetch_add(1, std::memory_order_relaxed);
+  h->count.fetch_add(1, std::memory_order_relaxed);
+  uint64_t max = h->maxUs.load(std::memory_order_relaxed);
+  while (((uint64_t)us > max) &&
+         !h->maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+  }
+}
+
+/**
+ * Find the value below which the given share of the samples fall.
+ * @param h Histogram
+ * @param count Number of samples in the histogram
+ * @param perMille Share, in 1/1000
+ */
+static uint64_t HalLatencyPercentile(HalLatencyHistogram* h, uint64_t count,
+                                     uint32_t perMille) {
+  // Rank of the sample, rounded up
+  uint64_t rank = (count * perMille + 999) / 1000;
+  uint64_t seen = 0;
+
+  for (uint32_t b = 0; b < HAL_LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return HalLatencyBucketLimit(b);
+    }
+  }
+  return h->maxUs.load(std::memory_order_relaxed);
+}
+
+void HalLatencyReport() {
+  for (uint32_t path = 0; path < HAL_LATENCY_PATH_MAX; path++) {
+    HalLatencyHistogram* h = &histograms[path];
+    uint64_t count = h->count.load(std::memory_order_relaxed);
+    uint64_t max = h->maxUs.load(std::memory_order_relaxed);
+
+    if (count == 0) {
+      continue;
+    }
+
+    // Percentiles beyond the max are bucket rounding
+    uint64_t p50 = HalLatencyPercentile(h, count, 500);
+    uint64_t p99 = HalLatencyPercentile(h, count, 990);
+    uint64_t p999 = HalLatencyPercentile(h, count, 999);
+    STLOG_HAL_D(
+        "latency path=%s count=%llu p50_us=%llu p99_us=%llu p999_us=%llu "
+        "max_us=%llu\n",
+        pathNames[path], (unsigned long long)count,
+        (unsigned long long)(p50 < max ? p50 : max),
+        (unsigned long long)(p99 < max ? p99 : max),
+        (unsigned long long)(p999 < max ? p999 : max),
+        (unsigned long long)max);
+  }
+}
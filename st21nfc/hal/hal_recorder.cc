@@ -0,0 +1,281 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+#include "hal_recorder.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include "android_logmsg.h"
+#include "hal_config.h"
+#include "halcore.h"
+
+/* entries kept, power of two */
+#define HAL_REC_RING_SIZE 1024
+/* bytes of a frame kept */
+#define HAL_REC_DATA_MAX 36
+#define HAL_REC_DATA_WORDS ((HAL_REC_DATA_MAX + 3) / 4)
+/* vendor data, writable by the HAL under the Treble sepolicy (the stack
+   NFA_STORAGE is not) */
+#define HAL_REC_FILE "/data/vendor/nfc/st21nfc_flight_recorder.txt"
+
+/* the fields are relaxed atomics: a dump may read an entry while it is being
+ * overwritten, and drops it when seq changed meanwhile */
+typedef struct {
+  std::atomic<uint64_t> seq; /* position + 1 once written, 0 while written */
+  std::atomic<uint64_t> timeUs;
+  std::atomic<uint32_t> arg0;
+  std::atomic<uint32_t> arg1;
+  std::atomic<uint16_t> length;
+  std::atomic<uint8_t> type;
+  std::atomic<uint8_t> stored;
+  std::atomic<uint32_t> data[HAL_REC_DATA_WORDS];
+} HalRecEntry;
+
+/* copy of an entry, written to the file */
+typedef struct {
+  uint64_t timeUs;
+  uint32_t arg0;
+  uint32_t arg1;
+  uint16_t length;
+  uint8_t type;
+  uint8_t stored;
+  uint8_t data[HAL_REC_DATA_MAX];
+} HalRecSnapshotEntry;
+
+typedef struct {
+  const char* reason;
+  uint64_t timeUs;
+  size_t count;
+  HalRecSnapshotEntry entries[HAL_REC_RING_SIZE];
+} HalRecSnapshot;
+
+static HalRecEntry recRing[HAL_REC_RING_SIZE];
+static std::atomic<uint64_t> recHead(0);
+static std::atomic<bool> recDumpBusy(false);
+static uint32_t recSeconds =
+    HalConfigKeyInfo<HAL_CFG_STNFC_HAL_RECORDER_SECONDS>::kDefault;
+
+static const char* const recStateNames[] = {
+    "CLOSED", "OPEN",  "OPEN_CPLT", "NFC_ENABLE_ON", "PROP_CONFIG",
+    "READY",  "CLOSING", "EXIT_HIBERNATE_INTERNAL", "UPDATE",
+    "APPLY_CUSTOM_PARAM"};
+
+static uint64_t HalRecorderNowUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Claim the next entry of the ring, overwriting the oldest one.
+ * @param pos Set to the position of the entry
+ */
+static HalRecEntry* HalRecorderClaim(uint64_t* pos) {
+  *pos = recHead.fetch_add(1, std::memory_order_relaxed);
+  HalRecEntry* e = &recRing[*pos & (HAL_REC_RING_SIZE - 1)];
+
+  // Readers skip the entry until it is published again
+  e->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e->timeUs.store(HalRecorderNowUs(), std::memory_order_relaxed);
+  return e;
+}
+
+void HalRecorderInit() {
+  recSeconds = HalConfigNum<HAL_CFG_STNFC_HAL_RECORDER_SECONDS>();
+}
+
+void HalRecorderFrame(uint32_t type, const uint8_t* data, size_t length) {
+  uint64_t pos;
+
+  if (recSeconds == 0) {
+    return;
+  }
+
+  size_t n = std::min<size_t>(DispHalPrivate(data, length) ? 3 : length,
+                              HAL_REC_DATA_MAX);
+  HalRecEntry* e = HalRecorderClaim(&pos);
+  e->type.store(type, std::memory_order_relaxed);
+  e->length.store(length, std::memory_order_relaxed);
+  e->stored.store(n, std::memory_order_relaxed);
+  for (size_t i = 0; i * 4 < n; i++) {
+    uint32_t word = 0;
+    memcpy(&word, data + i * 4, std::min<size_t>(n - i * 4, 4));
+    e->data[i].store(word, std::memory_order_relaxed);
+  }
+  e->seq.store(pos + 1, std::memory_order_release);
+}
+
+void HalRecorderEvent(uint32_t type, uint32_t arg0, uint32_t arg1) {
+  uint64_t pos;
+
+  if (recSeconds == 0) {
+    return;
+  }
+
+  HalRecEntry* e = HalRecorderClaim(&pos);
+  e->type.store(type, std::memory_order_relaxed);
+  e->arg0.store(arg0, std::memory_order_relaxed);
+  e->arg1.store(arg1, std::memory_order_relaxed);
+  e->length.store(0, std::memory_order_relaxed);
+  e->stored.store(0, std::memory_order_relaxed);
+  e->seq.store(pos + 1, std::memory_order_release);
+}
+
+/**
+ * Write one entry as a line of text.
+ * @param f File
+ * @param e Entry
+ * @param nowUs Time of the dump
+ */
+static void HalRecorderWriteEntry(FILE* f, const HalRecSnapshotEntry* e,
+                                  uint64_t nowUs) {
+  uint64_t ageUs = nowUs - e->timeUs;
+
+  fprintf(f, "-%llu.%03llu ms ", (unsigned long long)(ageUs / 1000),
+          (unsigned long long)(ageUs % 1000));
+
+  switch (e->type) {
+    case HAL_REC_TX:
+    case HAL_REC_RX:
+      fputs((e->type == HAL_REC_TX) ? "TX" : "RX", f);
+      for (uint32_t i = 0; i < e->stored; i++) {
+        fprintf(f, " %02x", e->data[i]);
+      }
+      if (e->stored < e->length) {
+        fprintf(f, " ... (%u bytes)", e->length);
+      }
+      break;
+    case HAL_REC_TIMER_START:
+      fprintf(f, "timer %u started, %u ms", e->arg0, e->arg1);
+      break;
+    case HAL_REC_TIMER_STOP:
+      fprintf(f, "timer %u stopped", e->arg0);
+      break;
+    case HAL_REC_TIMER_EXPIRED:
+      fprintf(f, "timer %u expired", e->arg0);
+      break;
+    case HAL_REC_STATE:
+      fprintf(f, "wrapper state %s -> %s",
+              (e->arg0 < std::size(recStateNames)) ? recStateNames[e->arg0]
+                                                   : "?",
+              (e->arg1 < std::size(recStateNames)) ? recStateNames[e->arg1]
+                                                   : "?");
+      break;
+  }
+  fputc('\n', f);
+}
+
+/**
+ * Write a snapshot to its file, keeping the previous one.
+ * @param arg Snapshot, freed here
+ */
+static void* HalRecorderWriteThread(void* arg) {
+  HalRecSnapshot* s = (HalRecSnapshot*)arg;
+
+  FILE* f = fopen(HAL_REC_FILE ".tmp", "w");
+  if (!f) {
+    STLOG_HAL_E("flight recorder: unable to create %s.tmp\n", HAL_REC_FILE);
+  } else {
+    fprintf(f, "# st21nfc flight recorder: %s, %zu entries over %u s\n",
+            s->reason, s->count, recSeconds);
+    for (size_t i = 0; i < s->count; i++) {
+      HalRecorderWriteEntry(f, &s->entries[i], s->timeUs);
+    }
+    fclose(f);
+    rename(HAL_REC_FILE, HAL_REC_FILE ".1");
+    if (rename(HAL_REC_FILE ".tmp", HAL_REC_FILE) == 0) {
+      STLOG_HAL_D("flight recorder: %s saved to %s\n", s->reason,
+                  HAL_REC_FILE);
+    }
+  }
+
+  free(s);
+  recDumpBusy.store(false);
+  return NULL;
+}
+
+void HalRecorderDump(const char* reason) {
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (recSeconds == 0) {
+    return;
+  }
+  if (recDumpBusy.exchange(true)) {
+    STLOG_HAL_W("flight recorder: %s not saved, busy\n", reason);
+    return;
+  }
+
+  HalRecSnapshot* s = (HalRecSnapshot*)malloc(sizeof(HalRecSnapshot));
+  if (!s) {
+    recDumpBusy.store(false);
+    return;
+  }
+  s->reason = reason;
+  s->timeUs = HalRecorderNowUs();
+  s->count = 0;
+
+  // Oldest first, skipping entries being written and the ones too old
+  uint64_t head = recHead.load(std::memory_order_acquire);
+  uint64_t pos = (head > HAL_REC_RING_SIZE) ? head - HAL_REC_RING_SIZE : 0;
+  uint64_t maxAgeUs = (uint64_t)recSeconds * 1000000;
+  for (; pos < head; pos++) {
+    HalRecEntry* e = &recRing[pos & (HAL_REC_RING_SIZE - 1)];
+    HalRecSnapshotEntry* c = &s->entries[s->count];
+
+    if (e->seq.load(std::memory_order_acquire) != pos + 1) {
+      continue;
+    }
+    c->timeUs = e->timeUs.load(std::memory_order_relaxed);
+    c->arg0 = e->arg0.load(std::memory_order_relaxed);
+    c->arg1 = e->arg1.load(std::memory_order_relaxed);
+    c->length = e->length.load(std::memory_order_relaxed);
+    c->type = e->type.load(std::memory_order_relaxed);
+    c->stored = std::min<uint8_t>(e->stored.load(std::memory_order_relaxed),
+                                  HAL_REC_DATA_MAX);
+    for (size_t i = 0; i * 4 < c->stored; i++) {
+      uint32_t word = e->data[i].load(std::memory_order_relaxed);
+      memcpy(c->data + i * 4, &word, std::min<size_t>(c->stored - i * 4, 4));
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (e->seq.load(std::memory_order_relaxed) != pos + 1) {
+      // Overwritten while copied
+      continue;
+    }
+    if ((c->timeUs > s->timeUs) || (s->timeUs - c->timeUs > maxAgeUs)) {
+      continue;
+    }
+    s->count++;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, HalRecorderWriteThread, s) != 0) {
+    STLOG_HAL_E("flight recorder: unable to start writer thread\n");
+    free(s);
+    recDumpBusy.store(false);
+  }
+  pthread_attr_destroy(&attr);
+}
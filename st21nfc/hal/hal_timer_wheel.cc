@@ -0,0 +1,245 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+#include "hal_timer_wheel.h"
+#include <stddef.h>
+
+/*
+ * The timers live in a hierarchical wheel with 1 ms ticks. Level 0 holds the
+ * timers expiring within the next 64 ticks, one slot per tick. Each slot of
+ * level 1 (resp. 2) covers 64 ticks (resp. 4096 ticks); its timers are
+ * cascaded to the level below when the wheel reaches the first tick of the
+ * slot. A bitmap per level tells which slots are non-empty, so start, stop and
+ * finding the next expiry don't depend on the number of running timers.
+ */
+
+/**
+ * Find the first non-empty slot of a level after a given slot.
+ * @param bitmap Non-empty slots of the level
+ * @param first Slot to start searching from
+ * @param distance Set to the number of slots between first and the slot found
+ * @return false if the level is empty
+ */
+static bool HalTimerWheelFindSlot(uint64_t bitmap, uint32_t first,
+                                  uint32_t* distance) {
+  if (bitmap == 0) {
+    return false;
+  }
+
+  first &= HAL_TIMER_WHEEL_SLOTS - 1;
+  if (first != 0) {
+    bitmap = (bitmap >> first) | (bitmap << (HAL_TIMER_WHEEL_SLOTS - first));
+  }
+  *distance = __builtin_ctzll(bitmap);
+  return true;
+}
+
+void HalTimerWheelUnlink(TimerWheel* wheel, Timer* t) {
+  Timer** head = (t->level == HAL_TIMER_EXPIRED_LEVEL)
+                     ? &wheel->expired
+                     : &wheel->slots[t->level][t->slot];
+
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    *head = t->next;
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  t->prev = t->next = NULL;
+
+  if ((t->level != HAL_TIMER_EXPIRED_LEVEL) && (*head == NULL)) {
+    wheel->bitmap[t->level] &= ~(1ULL << t->slot);
+  }
+}
+
+/**
+ * Append a timer to the expired list. The wheel is at or past its expiry,
+ * and past the expiry of the timers already on the list, so the list stays
+ * in expiry order.
+ * @param wheel Timer wheel
+ * @param t Timer, not linked
+ */
+static void HalTimerWheelExpire(TimerWheel* wheel, Timer* t) {
+  Timer** last = &wheel->expired;
+  Timer* prev = NULL;
+
+  while (*last) {
+    prev = *last;
+    last = &prev->next;
+  }
+  t->level = HAL_TIMER_EXPIRED_LEVEL;
+  t->prev = prev;
+  t->next = NULL;
+  *last = t;
+}
+
+void HalTimerWheelInsert(TimerWheel* wheel, Timer* t) {
+  Timer** head;
+  uint64_t now = wheel->now;
+  uint64_t delta;
+  uint32_t level;
+  uint64_t slot;
+
+  if (t->expiry <= now) {
+    // This tick has been processed already, or is being processed: a timer
+    // cascaded down to its own tick
+    HalTimerWheelExpire(wheel, t);
+    return;
+  }
+
+  delta = t->expiry - now;
+  if (delta < HAL_TIMER_WHEEL_SLOTS) {
+    level = 0;
+    slot = t->expiry;
+  } else {
+    // Pick the lowest level the expiry fits in; up to 64 slots ahead, the
+    // slot of the current tick is reached again last
+    for (level = 1; level < HAL_TIMER_WHEEL_LEVELS; level++) {
+      uint32_t shift = level * HAL_TIMER_WHEEL_BITS;
+      if ((t->expiry >> shift) - (now >> shift) <= HAL_TIMER_WHEEL_SLOTS) {
+        break;
+      }
+    }
+    if (level < HAL_TIMER_WHEEL_LEVELS) {
+      slot = t->expiry >> (level * HAL_TIMER_WHEEL_BITS);
+    } else {
+      // Too far away, park it in the last slot and cascade it again later
+      level = HAL_TIMER_WHEEL_LEVELS - 1;
+      slot = now >> (level * HAL_TIMER_WHEEL_BITS);
+    }
+  }
+
+  t->level = level;
+  t->slot = slot & (HAL_TIMER_WHEEL_SLOTS - 1);
+  head = &wheel->slots[t->level][t->slot];
+  wheel->bitmap[t->level] |= 1ULL << t->slot;
+
+  t->prev = NULL;
+  t->next = *head;
+  if (*head) {
+    (*head)->prev = t;
+  }
+  *head = t;
+}
+
+/**
+ * Get the next tick at which the wheel has something to do: a level 0 slot
+ * to expire or a slot of a higher level to cascade.
+ * @param wheel Timer wheel
+ * @param tick Set to the next tick
+ * @return false if no timer is pending in the wheel
+ */
+static bool HalTimerWheelNextTick(TimerWheel* wheel, uint64_t* tick) {
+  bool found = false;
+  uint32_t level;
+  uint32_t distance;
+
+  for (level = 0; level < HAL_TIMER_WHEEL_LEVELS; level++) {
+    uint32_t shift = level * HAL_TIMER_WHEEL_BITS;
+    uint64_t first = (wheel->now >> shift) + 1;
+
+    if (HalTimerWheelFindSlot(wheel->bitmap[level], first, &distance)) {
+      uint64_t t = (first + distance) << shift;
+      if (!found || (t < *tick)) {
+        *tick = t;
+        found = true;
+      }
+    }
+  }
+
+  return found;
+}
+
+bool HalTimerWheelNextExpiry(TimerWheel* wheel, uint64_t* expiry) {
+  bool found = false;
+  uint32_t level;
+  uint32_t distance;
+
+  if (wheel->expired) {
+    *expiry = wheel->now;
+    return true;
+  }
+
+  // The first non-empty slot of each level holds the earliest timers of that
+  // level, only a few timers share a slot. The top level also holds the
+  // timers too far away for the wheel, all its slots are checked.
+  for (level = 0; level < HAL_TIMER_WHEEL_LEVELS; level++) {
+    uint32_t shift = level * HAL_TIMER_WHEEL_BITS;
+    uint64_t first = (wheel->now >> shift) + 1;
+    uint64_t bitmap = wheel->bitmap[level];
+
+    while (HalTimerWheelFindSlot(bitmap, first, &distance)) {
+      uint32_t slot = (first + distance) & (HAL_TIMER_WHEEL_SLOTS - 1);
+      for (Timer* t = wheel->slots[level][slot]; t; t = t->next) {
+        if (!found || (t->expiry < *expiry)) {
+          *expiry = t->expiry;
+          found = true;
+        }
+      }
+      if (level < HAL_TIMER_WHEEL_LEVELS - 1) {
+        break;
+      }
+      bitmap &= ~(1ULL << slot);
+    }
+  }
+
+  return found;
+}
+
+void HalTimerWheelAdvance(TimerWheel* wheel, uint64_t nowMs) {
+  uint64_t tick;
+  Timer* t;
+
+  while (wheel->now < nowMs) {
+    if (!HalTimerWheelNextTick(wheel, &tick) || (tick > nowMs)) {
+      // Nothing to do until then
+      wheel->now = nowMs;
+      break;
+    }
+    wheel->now = tick;
+
+    // Cascade the higher levels whose slot starts at this tick, top-down so
+    // timers can go down several levels at once
+    for (int level = HAL_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      uint32_t shift = level * HAL_TIMER_WHEEL_BITS;
+      if (tick & ((1ULL << shift) - 1)) {
+        continue;
+      }
+      uint32_t slot = (tick >> shift) & (HAL_TIMER_WHEEL_SLOTS - 1);
+      // Detach the slot first, a timer may go back to the same slot
+      t = wheel->slots[level][slot];
+      wheel->slots[level][slot] = NULL;
+      wheel->bitmap[level] &= ~(1ULL << slot);
+      while (t) {
+        Timer* next = t->next;
+        HalTimerWheelInsert(wheel, t);
+        t = next;
+      }
+    }
+
+    // Expire level 0 slot of this tick
+    uint32_t slot = tick & (HAL_TIMER_WHEEL_SLOTS - 1);
+    while ((t = wheel->slots[0][slot]) != NULL) {
+      HalTimerWheelUnlink(wheel, t);
+      HalTimerWheelExpire(wheel, t);
+    }
+  }
+}
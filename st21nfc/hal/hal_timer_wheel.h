@@ -0,0 +1,81 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+#ifndef __HAL_TIMER_WHEEL_H_
+#define __HAL_TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+/* timer wheel: 1 ms ticks, each level covers 64 slots of the level below */
+#define HAL_TIMER_WHEEL_LEVELS 3
+#define HAL_TIMER_WHEEL_BITS 6
+#define HAL_TIMER_WHEEL_SLOTS (1 << HAL_TIMER_WHEEL_BITS)
+#define HAL_TIMER_EXPIRED_LEVEL -1 /* timer is on the expired list */
+
+typedef struct tagTimer {
+  uint64_t expiry;   /* expiry time in ms (CLOCK_MONOTONIC) */
+  uint32_t duration; /* timer duration in milliseconds      */
+  uint32_t id;       /* HAL_TIMER_ID_*                      */
+  bool active;       /* true if timer is currently active   */
+  int level;         /* wheel level, or HAL_TIMER_EXPIRED_LEVEL */
+  uint32_t slot;     /* slot in the wheel level             */
+  struct tagTimer* prev;
+  struct tagTimer* next;
+} Timer;
+
+typedef struct tagTimerWheel {
+  uint64_t now; /* last tick processed, in ms (CLOCK_MONOTONIC) */
+  Timer* slots[HAL_TIMER_WHEEL_LEVELS][HAL_TIMER_WHEEL_SLOTS];
+  uint64_t bitmap[HAL_TIMER_WHEEL_LEVELS]; /* non-empty slots */
+  Timer* expired; /* expired timers, not notified yet */
+  uint32_t count; /* active timers */
+} TimerWheel;
+
+/**
+ * Link a timer into the slot matching its expiry, relative to the last tick
+ * processed. A timer already due goes to the expired list.
+ * @param wheel Timer wheel
+ * @param t Timer, expiry set
+ */
+void HalTimerWheelInsert(TimerWheel* wheel, Timer* t);
+
+/**
+ * Remove a timer from its slot or from the expired list.
+ * @param wheel Timer wheel
+ * @param t Timer linked in the wheel
+ */
+void HalTimerWheelUnlink(TimerWheel* wheel, Timer* t);
+
+/**
+ * Get the earliest expiry of the running timers.
+ * @param wheel Timer wheel
+ * @param expiry Set to the expiry time in ms
+ * @return false if no timer is running
+ */
+bool HalTimerWheelNextExpiry(TimerWheel* wheel, uint64_t* expiry);
+
+/**
+ * Move the wheel forward to the given time. Timers expiring on the way are
+ * put on the expired list, in expiry order.
+ * @param wheel Timer wheel
+ * @param nowMs Current time in ms
+ */
+void HalTimerWheelAdvance(TimerWheel* wheel, uint64_t nowMs);
+
+#endif
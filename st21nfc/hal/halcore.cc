@@ -19,20 +19,37 @@
 #define LOG_TAG "NfcHal"
 
 #include <hardware/nfc.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include "android_logmsg.h"
+#include "hal_config.h"
+#include "hal_latency.h"
+#include "hal_recorder.h"
 #include "halcore_private.h"
 
 extern int I2cWriteCmd(const uint8_t* x, size_t len);
+extern void I2cSendFrame(HalBuffer* buffer);
 extern void DispHal(const char* title, const void* data, size_t length);
 
 extern uint32_t ScrProtocolTraceFlag;  // = SCR_PROTO_TRACE_ALL;
 
 // HAL WRAPPER
-static void HalStopTimer(HalInstance* inst);
+static void HalStopTimer(HalInstance* inst, uint32_t id);
+static void HalStartTimer(HalInstance* inst, uint32_t id, uint32_t duration);
+static void HalProcessTimers(HalInstance* inst, struct timespec* now);
+static uint64_t HalTimespecToMs(struct timespec ts);
+
+/* true on the thread dispatching the HAL state machine */
+static thread_local bool onHalThread = false;
+
+/* buffer of the frame passed to HAL_EVENT_DSWRITE */
+static thread_local HalBuffer* dsFrameBuffer = NULL;
 
 typedef struct {
   struct nfc_nci_device nci_device;  // nci_device must be first struct member
@@ -49,16 +66,29 @@ typedef struct {
  **************************************************************************************************/
 
 static void* HalWorkerThread(void* arg);
+static void HalDispatchThreadMessage(HalInstance* inst, ThreadMesssage* msg);
 static inline int sem_wait_nointr(sem_t* sem);
 
 static void HalOnNewUpstreamFrame(HalInstance* inst, const uint8_t* data,
                                   size_t length);
 static void HalTriggerNextDsPacket(HalInstance* inst);
+static void HalQueueDsPacket(HalInstance* inst, HalBuffer* b);
+static bool HalDataQueuedBefore(HalInstance* inst, uint32_t seq);
+static void HalLogTxStats(HalInstance* inst);
+static void Hal_event_handler(HalInstance* inst, HalEvent e);
+static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now);
+struct timespec HalGetTimestamp(void);
+int HalTimeDiffInMs(struct timespec start, struct timespec end);
 static bool HalEnqueueThreadMessage(HalInstance* inst, ThreadMesssage* msg);
 static bool HalDequeueThreadMessage(HalInstance* inst, ThreadMesssage* msg);
-static HalBuffer* HalAllocBuffer(HalInstance* inst);
+static HalBuffer* HalAllocBuffer(HalInstance* inst, uint32_t timeout);
+static bool HalPostDownstream(HalInstance* inst, uint32_t command,
+                              const uint8_t* data, size_t size,
+                              uint32_t duration, uint32_t timeout);
 static HalBuffer* HalFreeBuffer(HalInstance* inst, HalBuffer* b);
-static uint32_t HalSemWait(sem_t* pSemaphore, uint32_t timeout);
+static void HalReleaseInstance(HalInstance* inst);
+static uint32_t HalWaitForMessage(HalInstance* inst, uint32_t timeout);
+static void HalUpdateRxStats(HalInstance* inst, size_t frames);
 
 /**************************************************************************************************
  *
@@ -88,12 +118,14 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
     case HAL_EVENT_DSWRITE:
       STLOG_HAL_V("!! got event HAL_EVENT_DSWRITE for %zu bytes\n", length);
       DispHal("TX DATA", (data), length);
+      HalRecorderFrame(HAL_REC_TX, data, length);
 
-      // Send write command to IO thread
-      cmd = 'W';
-      I2cWriteCmd(&cmd, sizeof(cmd));
-      I2cWriteCmd((const uint8_t*)&length, sizeof(length));
-      I2cWriteCmd(data, length);
+      // Hand the buffer itself over to the IO thread
+      if (dsFrameBuffer) {
+        I2cSendFrame(dsFrameBuffer);
+      } else {
+        STLOG_HAL_E("!! HAL_EVENT_DSWRITE without TX buffer\n");
+      }
       break;
 
     case HAL_EVENT_DATAIND:
@@ -105,6 +137,7 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
             data[2], length);
       }
 
+      HalRecorderFrame(HAL_REC_RX, data, length);
       dev->p_data_cback(length, (uint8_t*)data);
       break;
 
@@ -115,6 +148,7 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
 
     case HAL_EVENT_LINKLOST:
       STLOG_HAL_E("!! got event HAL_EVENT_LINKLOST or HAL_EVENT_ERROR\n");
+      HalRecorderDump("link lost");
 
       dev->p_cback(HAL_NFC_ERROR_EVT, HAL_NFC_STATUS_ERR_CMD_TIMEOUT);
 
@@ -123,10 +157,15 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
       I2cWriteCmd(&cmd, sizeof(cmd));
       break;
 
-    case HAL_EVENT_TIMER_TIMEOUT:
-      STLOG_HAL_D("!! got event HAL_EVENT_TIMER_TIMEOUT \n");
-      dev->p_cback(HAL_WRAPPER_TIMEOUT_EVT, HAL_NFC_STATUS_OK);
-      break;
+    case HAL_EVENT_TIMER_TIMEOUT: {
+      // The timer ID is passed as status, HAL_TIMER_ID_CMD is HAL_NFC_STATUS_OK
+      uint32_t id = HAL_TIMER_ID_CMD;
+      if (length == sizeof(id)) {
+        memcpy(&id, data, sizeof(id));
+      }
+      STLOG_HAL_D("!! got event HAL_EVENT_TIMER_TIMEOUT (timer %u)\n", id);
+      dev->p_cback(HAL_WRAPPER_TIMEOUT_EVT, id);
+    } break;
   }
 }
 
@@ -154,27 +193,72 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
     return NULL;
   }
 
-  // We need a semaphore to wakeup our protocol thread
-  if (0 != sem_init(&inst->semaphore, 0, 0)) {
-    STLOG_HAL_E("!sem_init failed\n");
-    free(inst);
+  // From here on, HalReleaseInstance frees whatever has been set up
+  inst->wakeupFd = -1;
+  inst->timerFd = -1;
+
+  HalRecorderInit();
+
+  // Depth of the RX pipeline between the I2C thread and our protocol thread
+  unsigned long num = 0;
+  size_t i;
+  inst->rxDepth = HAL_RX_QUEUE_DEPTH_DEFAULT;
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_RX_QUEUE_DEPTH>(&num)) {
+    if ((num >= 1) && (num <= HAL_RX_QUEUE_DEPTH_MAX)) {
+      inst->rxDepth = num;
+    } else {
+      STLOG_HAL_W("invalid RX queue depth %lu, using %d\n", num,
+                  HAL_RX_QUEUE_DEPTH_DEFAULT);
+    }
+  }
+
+  // TX buffer pool
+  inst->txPoolSize = NUM_BUFFERS;
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_TX_POOL_SIZE>(&num)) {
+    if ((num >= 1) && (num <= HAL_TX_POOL_SIZE_MAX)) {
+      inst->txPoolSize = num;
+    } else {
+      STLOG_HAL_W("invalid TX pool size %lu, using %d\n", num, NUM_BUFFERS);
+    }
+  }
+  inst->txPolicy = HAL_TX_POLICY_BLOCK;
+  if (HalConfigNum<HAL_CFG_STNFC_HAL_TX_OVERFLOW_POLICY>(&num)) {
+    if (num <= HAL_TX_POLICY_GROW) {
+      inst->txPolicy = num;
+    } else {
+      STLOG_HAL_W("invalid TX overflow policy %lu, blocking\n", num);
+    }
+  }
+
+  // We need an eventfd to wakeup our protocol thread when it is parked
+  inst->wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (inst->wakeupFd < 0) {
+    STLOG_HAL_E("!eventfd failed\n");
+    HalReleaseInstance(inst);
+    return NULL;
+  }
+
+  // Lock-free ring carrying the messages to our protocol thread, large enough
+  // for all the TX (including a second slab) and RX buffers to be in flight
+  // at the same time
+  if (!inst->ring.init(HAL_QUEUE_MAX + 2 * inst->txPoolSize + inst->rxDepth)) {
+    STLOG_HAL_E("!failed to allocate message ring\n");
+    HalReleaseInstance(inst);
     return NULL;
   }
 
   // We need a semaphore to manage buffers
-  if (0 != sem_init(&inst->bufferResourceSem, 0, NUM_BUFFERS)) {
+  if (0 != sem_init(&inst->bufferResourceSem, 0, inst->txPoolSize)) {
     STLOG_HAL_E("!sem_init failed\n");
-    sem_destroy(&inst->semaphore);
-    free(inst);
+    HalReleaseInstance(inst);
     return NULL;
   }
 
-  // We need a semaphore to block upstream data indications
-  if (0 != sem_init(&inst->upstreamBlock, 0, 0)) {
+  // We need a semaphore to block upstream data indications when all the RX
+  // buffers are in use
+  if (0 != sem_init(&inst->rxBufferSem, 0, inst->rxDepth)) {
     STLOG_HAL_E("!sem_init failed\n");
-    sem_destroy(&inst->semaphore);
-    sem_destroy(&inst->bufferResourceSem);
-    free(inst);
+    HalReleaseInstance(inst);
     return NULL;
   }
 
@@ -183,49 +267,58 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
   inst->callback = callback;
   inst->flags = flags;
   inst->freeBufferList = 0;
-  inst->pendingNciList = 0;
   inst->nciBuffer = 0;
-  inst->ringReadPos = 0;
-  inst->ringWritePos = 0;
+  inst->workerParked.store(false);
   inst->timeout = HAL_SLEEP_TIMER_DURATION;
+  inst->wheel.now = HalTimespecToMs(HalGetTimestamp());
+  for (i = 0; i < HAL_TIMER_MAX; i++) {
+    inst->timers[i].id = i;
+  }
 
-  inst->bufferData = (HalBuffer*)calloc(NUM_BUFFERS, sizeof(HalBuffer));
+  inst->bufferData = (HalBuffer*)calloc(inst->txPoolSize, sizeof(HalBuffer));
   if (!inst->bufferData) {
     STLOG_HAL_E("!failed to allocate memory\n");
-    sem_destroy(&inst->semaphore);
-    sem_destroy(&inst->bufferResourceSem);
-    sem_destroy(&inst->upstreamBlock);
-    free(inst);
+    HalReleaseInstance(inst);
     return NULL;
   }
 
   // Concatenate the buffers into a linked list for easy access
-  size_t i;
-  for (i = 0; i < NUM_BUFFERS; i++) {
+  for (i = 0; i < inst->txPoolSize; i++) {
     HalBuffer* b = &inst->bufferData[i];
     b->next = inst->freeBufferList;
     inst->freeBufferList = b;
   }
 
+  inst->rxBufferData = (HalRxBuffer*)calloc(inst->rxDepth, sizeof(HalRxBuffer));
+  if (!inst->rxBufferData || !inst->rxFreeRing.init(inst->rxDepth)) {
+    STLOG_HAL_E("!failed to allocate memory\n");
+    HalReleaseInstance(inst);
+    return NULL;
+  }
+
+  for (i = 0; i < inst->rxDepth; i++) {
+    inst->rxFreeRing.push(&inst->rxBufferData[i]);
+  }
+
   if (0 != pthread_mutex_init(&inst->hMutex, 0)) {
     STLOG_HAL_E("!failed to initialize Mutex \n");
-    sem_destroy(&inst->semaphore);
-    sem_destroy(&inst->bufferResourceSem);
-    sem_destroy(&inst->upstreamBlock);
-    free(inst->bufferData);
-    free(inst);
+    HalReleaseInstance(inst);
     return NULL;
   }
 
-  // Spawn the thread
-  if (0 != pthread_create(&inst->thread, NULL, HalWorkerThread, inst)) {
+  if (flags & HAL_FLAG_REACTOR) {
+    // The caller's thread polls our fds and dispatches, no worker thread
+    inst->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (inst->timerFd < 0) {
+      STLOG_HAL_E("!timerfd_create failed\n");
+      HalReleaseInstance(inst);
+      return NULL;
+    }
+    inst->exitRequest = false;
+  } else if (0 != pthread_create(&inst->thread, NULL, HalWorkerThread, inst)) {
+    // Spawn the thread
     STLOG_HAL_E("!failed to spawn workerthread \n");
-    sem_destroy(&inst->semaphore);
-    sem_destroy(&inst->bufferResourceSem);
-    sem_destroy(&inst->upstreamBlock);
-    pthread_mutex_destroy(&inst->hMutex);
-    free(inst->bufferData);
-    free(inst);
+    HalReleaseInstance(inst);
     return NULL;
   }
 
@@ -241,117 +334,191 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
  */
 void HalDestroy(HALHANDLE hHAL) {
   HalInstance* inst = (HalInstance*)hHAL;
-  // Tell the thread that we want to finish
-  ThreadMesssage msg;
-  msg.command = MSG_EXIT_REQUEST;
-  msg.payload = 0;
-  msg.length = 0;
 
-  HalEnqueueThreadMessage(inst, &msg);
+  if (!(inst->flags & HAL_FLAG_REACTOR)) {
+    // In reactor mode we are called from the reactor thread itself, and
+    // nothing is dispatched anymore
+    // Tell the thread that we want to finish
+    ThreadMesssage msg;
+    msg.command = MSG_EXIT_REQUEST;
+    msg.payload = 0;
+    msg.length = 0;
 
-  // Wait for thread to finish
-  pthread_join(inst->thread, NULL);
+    HalEnqueueThreadMessage(inst, &msg);
 
-  // Cleanup and exit
-  sem_destroy(&inst->semaphore);
-  sem_destroy(&inst->upstreamBlock);
-  sem_destroy(&inst->bufferResourceSem);
-  pthread_mutex_destroy(&inst->hMutex);
+    // Wait for thread to finish
+    pthread_join(inst->thread, NULL);
+  }
 
-  // Free resources
-  free(inst->bufferData);
-  free(inst);
+  // Log the last frames before the HAL is gone
+  DispHalFlush();
+
+  STLOG_HAL_D(
+      "HalDestroy: %llu messages, enqueue-to-dispatch avg %llu us max %llu "
+      "us, %llu worker wakeups\n",
+      (unsigned long long)inst->statMessages,
+      (unsigned long long)(inst->statMessages
+                               ? inst->statLatencyTotalUs / inst->statMessages
+                               : 0),
+      (unsigned long long)inst->statLatencyMaxUs,
+      (unsigned long long)inst->statWakeups);
+  STLOG_HAL_D(
+      "HalDestroy: %llu RX frames in %llu wakeups, reader stalled %llu "
+      "times\n",
+      (unsigned long long)inst->statRxFrames,
+      (unsigned long long)inst->statRxWakeups,
+      (unsigned long long)inst->statRxStalls);
+  HalLogTxStats(inst);
+  HalLatencyReport();
+  STLOG_HAL_D(
+      "HalDestroy: TX pool of %zu%s buffers exhausted %u times, %u sends "
+      "failed\n",
+      inst->txPoolSize, inst->slabData ? "(+slab)" : "",
+      inst->statTxExhausted.load(), inst->statTxFailed.load());
+
+  // Cleanup and exit
+  HalReleaseInstance(inst);
 
   STLOG_HAL_V("HalDestroy done\n");
 }
 
 /**
- * Send an NCI message downstream to HAL protocol layer (DH->NFCC transfer).
- * Block if more than NUM_BUFFERS (10) transfers are outstanding, otherwise will
- * return immediately.
+ * Hand every frame queued so far to the I2C layer through HAL_EVENT_DSWRITE,
+ * and return once they all were. Called by the I2C thread before it stops, so
+ * that the frames the stack sent before the close are still written.
  * @param hHAL HAL handle
- * @param data Data message
- * @param size Message size
- */ bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size)
-{
-  // Send an NCI frame downstream. will
+ */
+void HalFlushDownstream(HALHANDLE hHAL) {
   HalInstance* inst = (HalInstance*)hHAL;
 
-  if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
-    ThreadMesssage msg;
-    HalBuffer* b = HalAllocBuffer(inst);
+  if (inst->flags & HAL_FLAG_REACTOR) {
+    // We are on the reactor thread, the dispatch drains the ring and the TX
+    // queues
+    HalReactorDispatch(hHAL, false, false);
+    return;
+  }
 
-    if (!b) {
-      // Should never be reachable
-      return false;
-    }
+  ThreadMesssage msg;
+  sem_t done;
 
-    memcpy(b->data, data, size);
-    b->length = size;
+  sem_init(&done, 0, 0);
+  msg.command = MSG_FLUSH_REQUEST;
+  msg.payload = &done;
+  msg.length = 0;
+  msg.buffer = NULL;
 
-    msg.command = MSG_TX_DATA;
-    msg.payload = 0;
-    msg.length = 0;
-    msg.buffer = b;
+  if (HalEnqueueThreadMessage(inst, &msg)) {
+    sem_wait_nointr(&done);
+  }
+  sem_destroy(&done);
+}
 
-    return HalEnqueueThreadMessage(inst, &msg);
+/**
+ * Send an NCI message downstream to HAL protocol layer (DH->NFCC transfer).
+ * If all the TX buffers are in use, block, fail or grow the pool depending on
+ * STNFC_HAL_TX_OVERFLOW_POLICY, otherwise will return immediately.
+ * @param hHAL HAL handle
+ * @param data Data message
+ * @param size Message size
+ */
+bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
+  HalInstance* inst = (HalInstance*)hHAL;
 
-  } else {
-    STLOG_HAL_E("HalSendDownstream size to large %zu instead of %d\n", size,
-                MAX_BUFFER_SIZE);
-    return false;
-  }
+  return HalPostDownstream(inst, MSG_TX_DATA, data, size, 0,
+                           OS_SYNC_INFINITE);
 }
 
-// HAL WRAPPER
 /**
  * Send an NCI message downstream to HAL protocol layer (DH->NFCC transfer).
- * Block if more than NUM_BUFFERS (10) transfers are outstanding, otherwise will
- * return immediately.
+ * Wait at most timeoutMs for a free TX buffer, so a stuck bus shows up as a
+ * failed send instead of a blocked caller.
+ * @param hHAL HAL handle
+ * @param data Data message
+ * @param size Message size
+ * @param timeoutMs Maximum time to wait for a buffer, 0 to not wait
+ * @return false if no buffer could be allocated in time
+ */
+bool HalTrySendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size,
+                          uint32_t timeoutMs) {
+  HalInstance* inst = (HalInstance*)hHAL;
+
+  return HalPostDownstream(inst, MSG_TX_DATA, data, size, 0, timeoutMs);
+}
+
+// HAL WRAPPER
+/**
+ * Send an NCI message downstream to HAL protocol layer (DH->NFCC transfer)
+ * and start the command timer.
+ * If all the TX buffers are in use, behaves as HalSendDownstream.
  * @param hHAL HAL handle
  * @param data Data message
  * @param size Message size
+ * @param duration Timeout in milliseconds
  */
 bool HalSendDownstreamTimer(HALHANDLE hHAL, const uint8_t* data, size_t size,
                             uint32_t duration) {
-  // Send an NCI frame downstream. will
   HalInstance* inst = (HalInstance*)hHAL;
 
-  if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
-    ThreadMesssage msg;
-    HalBuffer* b = HalAllocBuffer(inst);
-
-    if (!b) {
-      // Should never be reachable
-      return false;
-    }
+  return HalPostDownstream(inst, MSG_TX_DATA_TIMER_START, data, size, duration,
+                           OS_SYNC_INFINITE);
+}
 
-    memcpy(b->data, data, size);
-    b->length = size;
+bool HalSendDownstreamTimer(HALHANDLE hHAL, uint32_t duration) {
+  return HalStartTimerId(hHAL, HAL_TIMER_ID_CMD, duration);
+}
 
-    msg.command = MSG_TX_DATA_TIMER_START;
-    msg.payload = 0;
-    msg.length = duration;
-    msg.buffer = b;
+/**
+ * Start or restart a HAL timer. HAL_WRAPPER_TIMEOUT_EVT is reported once
+ * with the timer ID as status when it expires.
+ * @param hHAL HAL handle
+ * @param id Timer ID, below HAL_TIMER_MAX
+ * @param duration Timeout in milliseconds
+ */
+bool HalStartTimerId(HALHANDLE hHAL, uint32_t id, uint32_t duration) {
+  HalInstance* inst = (HalInstance*)hHAL;
 
-    return HalEnqueueThreadMessage(inst, &msg);
+  ThreadMesssage msg;
 
-  } else {
-    STLOG_HAL_E("HalSendDownstreamTimer size to large %zu instead of %d\n",
-                size, MAX_BUFFER_SIZE);
+  if (id >= HAL_TIMER_MAX) {
+    STLOG_HAL_E("HalStartTimerId invalid timer %u\n", id);
     return false;
   }
+
+  msg.command = MSG_TIMER_START;
+  msg.payload = 0;
+  msg.length = duration;
+  msg.buffer = NULL;
+  msg.timerId = id;
+
+  return HalEnqueueThreadMessage(inst, &msg);
 }
 
-bool HalSendDownstreamTimer(HALHANDLE hHAL, uint32_t duration) {
+/**
+ * Stop a HAL timer. From the HAL thread, e.g. in a wrapper callback, the
+ * timer is stopped right away and cannot expire anymore.
+ * @param hHAL HAL handle
+ * @param id Timer ID, below HAL_TIMER_MAX
+ */
+bool HalStopTimerId(HALHANDLE hHAL, uint32_t id) {
   HalInstance* inst = (HalInstance*)hHAL;
 
+  if (id >= HAL_TIMER_MAX) {
+    STLOG_HAL_E("HalStopTimerId invalid timer %u\n", id);
+    return false;
+  }
+
+  if (onHalThread) {
+    HalStopTimer(inst, id);
+    return true;
+  }
+
   ThreadMesssage msg;
 
-  msg.command = MSG_TIMER_START;
+  msg.command = MSG_TIMER_STOP;
   msg.payload = 0;
-  msg.length = duration;
+  msg.length = 0;
   msg.buffer = NULL;
+  msg.timerId = id;
 
   return HalEnqueueThreadMessage(inst, &msg);
 }
@@ -364,11 +531,7 @@ bool HalSendDownstreamTimer(HALHANDLE hHAL, uint32_t duration) {
  * @param size Message size
  */
 bool HalSendDownstreamStopTimer(HALHANDLE hHAL) {
-  // Send an NCI frame downstream. will
-  HalInstance* inst = (HalInstance*)hHAL;
-
-  HalStopTimer(inst);
-  return 1;
+  return HalStopTimerId(hHAL, HAL_TIMER_ID_CMD);
 }
 
 /**
@@ -378,40 +541,198 @@ bool HalSendDownstreamStopTimer(HALHANDLE hHAL) {
  * @param size Message size
  */
 bool HalSendUpstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
+  return HalSendUpstreamBatch(hHAL, data, &size, 1);
+}
+
+/**
+ * Send several NCI messages upstream to NFC NCI layer (NFCC->DH transfer).
+ * They are copied into a single RX buffer and dispatched by the worker thread
+ * in one wakeup. Only blocks if all RX buffers are still in use.
+ * @param hHAL HAL handle
+ * @param data Messages, back to back
+ * @param lengths Size of each message
+ * @param count Number of messages, at most HAL_RX_BATCH_MAX
+ */
+bool HalSendUpstreamBatch(HALHANDLE hHAL, const uint8_t* data,
+                          const size_t* lengths, size_t count) {
   HalInstance* inst = (HalInstance*)hHAL;
-  if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
+  struct timespec rxTime = HalGetTimestamp();
+  size_t size = 0;
+  size_t i;
+
+  if ((count == 0) || (count > HAL_RX_BATCH_MAX)) {
+    STLOG_HAL_E("HalSendUpstreamBatch invalid batch of %zu frames\n", count);
+    return false;
+  }
+  for (i = 0; i < count; i++) {
+    if ((lengths[i] > MAX_BUFFER_SIZE) || (lengths[i] == 0)) {
+      STLOG_HAL_E("HalSendUpstream size to large %zu instead of %d\n",
+                  lengths[i], MAX_BUFFER_SIZE);
+      return false;
+    }
+    size += lengths[i];
+  }
+
+  {
     ThreadMesssage msg;
+    HalRxBuffer* b;
+
+    if (inst->flags & HAL_FLAG_REACTOR) {
+      // We are on the reactor thread, dispatch inline
+      inst->rxWakeupCounted = false;
+      inst->lastUsFrameTime = rxTime;
+      HalUpdateRxStats(inst, count);
+      for (i = 0; i < count; i++) {
+        HalOnNewUpstreamFrame(inst, data, lengths[i]);
+        data += lengths[i];
+      }
+      return true;
+    }
+
+    // Only block if the protocol thread still holds all the RX buffers
+    if (sem_trywait(&inst->rxBufferSem) != 0) {
+      inst->statRxStalls++;
+      sem_wait_nointr(&inst->rxBufferSem);
+    }
+    if (!inst->rxFreeRing.pop(&b)) {
+      // Should never be reachable
+      STLOG_HAL_E("! unable to allocate RX buffer. check rxBufferSem\n");
+      sem_post(&inst->rxBufferSem);
+      return false;
+    }
+
+    memcpy(b->data, data, size);
+    memcpy(b->frameLength, lengths, count * sizeof(size_t));
+    b->count = count;
+    b->rxTime = rxTime;
+    b->refCount.store(1);
+
     msg.command = MSG_RX_DATA;
-    msg.payload = data;
+    msg.payload = b;
     msg.length = size;
+    msg.buffer = NULL;
 
     if (HalEnqueueThreadMessage(inst, &msg)) {
-      // Block until the protocol has taken a copy of the data
-      sem_wait_nointr(&inst->upstreamBlock);
       return true;
     }
-    return false;
-  } else {
-    STLOG_HAL_E("HalSendUpstream size to large %zu instead of %d\n", size,
-                MAX_BUFFER_SIZE);
+    HalReleaseRxBuffer(inst, b);
     return false;
   }
 }
 
+/**
+ * Get the eventfd a reactor must poll for downstream requests.
+ * @param hHAL HAL handle
+ * @return eventfd, readable when HalReactorDispatch must be called
+ */
+int HalGetWakeupFd(HALHANDLE hHAL) {
+  HalInstance* inst = (HalInstance*)hHAL;
+  return inst->wakeupFd;
+}
+
+/**
+ * Get the timerfd a reactor must poll for the HAL timer (HAL_FLAG_REACTOR).
+ * @param hHAL HAL handle
+ * @return timerfd, readable when HalReactorDispatch must be called
+ */
+int HalGetTimerFd(HALHANDLE hHAL) {
+  HalInstance* inst = (HalInstance*)hHAL;
+  return inst->timerFd;
+}
+
+/**
+ * Run the HAL state machine inline on the reactor thread (HAL_FLAG_REACTOR).
+ * Drains the message ring, fires the expired timer and re-arms the timerfd
+ * for the next expiry. Must be called once before the first poll and after
+ * every poll wakeup.
+ * @param hHAL HAL handle
+ * @param wakeup true if the wakeup eventfd was reported readable
+ * @param timer true if the timerfd was reported readable
+ * @return false once an exit request has been processed
+ */
+bool HalReactorDispatch(HALHANDLE hHAL, bool wakeup, bool timer) {
+  HalInstance* inst = (HalInstance*)hHAL;
+  uint64_t count;
+  struct timespec now;
+
+  onHalThread = true;
+
+  if (wakeup) {
+    // Reset the eventfd counter, the ring holds the actual messages
+    if (read(inst->wakeupFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      STLOG_HAL_W("! failed to reset wakeup eventfd");
+    }
+    inst->statWakeups++;
+  }
+
+  if (timer && (read(inst->timerFd, &count, sizeof(count)) < 0) &&
+      (errno != EAGAIN)) {
+    STLOG_HAL_W("! failed to reset timerfd");
+  }
+
+  while (!inst->exitRequest) {
+    ThreadMesssage msg;
+
+    if (HalDequeueThreadMessage(inst, &msg)) {
+      HalDispatchThreadMessage(inst, &msg);
+      continue;
+    }
+
+    if (inst->txPending) {
+      HalTriggerNextDsPacket(inst);
+      continue;
+    }
+
+    // Same handshake as the worker thread before returning to poll
+    inst->workerParked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (inst->ring.empty()) {
+      break;
+    }
+    inst->workerParked.store(false);
+  }
+
+  // Fire the expired timers, they may have been restarted since the timerfd
+  // was armed
+  now = HalGetTimestamp();
+  if (!inst->exitRequest) {
+    HalProcessTimers(inst, &now);
+  }
+
+  // Arm the timerfd for the next expiry, or disarm it
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  now = HalGetTimestamp();
+  uint32_t waitTime = HalCalcSemWaitingTime(inst, &now);
+  if (waitTime != OS_SYNC_INFINITE) {
+    its.it_value.tv_sec = waitTime / 1000;
+    its.it_value.tv_nsec = (waitTime % 1000) * 1000000;
+  }
+  if (timerfd_settime(inst->timerFd, 0, &its, NULL) != 0) {
+    STLOG_HAL_E("! timerfd_settime failed");
+  }
+
+  return !inst->exitRequest;
+}
+
 /**************************************************************************************************
  *
  *                                      Private API Definition
  *
  **************************************************************************************************/
 /*
- * Get current time stamp
+ * Get current time stamp, not affected by wall-clock changes
  */
 struct timespec HalGetTimestamp(void) {
   struct timespec tm;
-  clock_gettime(CLOCK_REALTIME, &tm);
+  clock_gettime(CLOCK_MONOTONIC, &tm);
   return tm;
 }
 
+static uint64_t HalTimespecToMs(struct timespec ts) {
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int HalTimeDiffInMs(struct timespec start, struct timespec end) {
   struct timespec temp;
   if ((end.tv_nsec - start.tv_nsec) < 0) {
@@ -433,18 +754,18 @@ int HalTimeDiffInMs(struct timespec start, struct timespec end) {
 static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now) {
   // Default to infinite wait time
   uint32_t result = OS_SYNC_INFINITE;
+  uint64_t expiry;
 
-  if (inst->timer.active) {
-    int delta =
-        inst->timer.duration - HalTimeDiffInMs(inst->timer.startTime, *now);
+  if (HalTimerWheelNextExpiry(&inst->wheel, &expiry)) {
+    uint64_t nowMs = HalTimespecToMs(*now);
 
-    if (delta < 0) {
+    if (expiry <= nowMs) {
       // If we have a timer that has already expired, pick a zero wait time
       result = 0;
 
-    } else if ((uint32_t)delta < result) {
+    } else if (expiry - nowMs < result) {
       // Smaller time difference? If so take it
-      result = delta;
+      result = (uint32_t)(expiry - nowMs);
     }
   }
 
@@ -464,16 +785,65 @@ static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now) {
  *
  **************************************************************************************************/
 
-static void HalStopTimer(HalInstance* inst) {
-  inst->timer.active = false;
-  STLOG_HAL_D("HalStopTimer \n");
+/**
+ * Move the timers forward and report each expired timer with EVT_TIMER.
+ * Timers are one-shot. The callback may start and stop timers.
+ * @param inst HAL instance
+ * @param now Current time
+ */
+static void HalProcessTimers(HalInstance* inst, struct timespec* now) {
+  TimerWheel* wheel = &inst->wheel;
+  Timer* t;
+
+  HalTimerWheelAdvance(wheel, HalTimespecToMs(*now));
+
+  while ((t = wheel->expired) != NULL) {
+    HalTimerWheelUnlink(wheel, t);
+    t->active = false;
+    wheel->count--;
+
+    STLOG_HAL_W("OS_SYNC_TIMEOUT (timer %u)\n", t->id);
+    HalRecorderEvent(HAL_REC_TIMER_EXPIRED, t->id, 0);
+    inst->expiredTimerId = t->id;
+    Hal_event_handler(inst, EVT_TIMER);
+  }
+}
+
+static void HalStopTimer(HalInstance* inst, uint32_t id) {
+  Timer* t = &inst->timers[id];
+
+  if (t->active) {
+    HalTimerWheelUnlink(&inst->wheel, t);
+    t->active = false;
+    inst->wheel.count--;
+    HalRecorderEvent(HAL_REC_TIMER_STOP, id, 0);
+  }
+  STLOG_HAL_D("HalStopTimer %u\n", id);
 }
 
-static void HalStartTimer(HalInstance* inst, uint32_t duration) {
-  STLOG_HAL_D("HalStartTimer \n");
-  inst->timer.startTime = HalGetTimestamp();
-  inst->timer.active = true;
-  inst->timer.duration = duration;
+static void HalStartTimer(HalInstance* inst, uint32_t id, uint32_t duration) {
+  Timer* t = &inst->timers[id];
+
+  STLOG_HAL_D("HalStartTimer %u (%u ms)\n", id, duration);
+  HalRecorderEvent(HAL_REC_TIMER_START, id, duration);
+  if (t->active) {
+    HalTimerWheelUnlink(&inst->wheel, t);
+    inst->wheel.count--;
+  }
+
+  // Keep the wheel close to the current time, so the timer lands in the
+  // level matching its duration
+  struct timespec now = HalGetTimestamp();
+  uint64_t nowMs = HalTimespecToMs(now);
+  if (inst->wheel.count == 0) {
+    inst->wheel.now = nowMs;
+  }
+
+  t->expiry = nowMs + duration;
+  t->duration = duration;
+  t->active = true;
+  inst->wheel.count++;
+  HalTimerWheelInsert(&inst->wheel, t);
 }
 
 /**************************************************************************************************
@@ -483,78 +853,56 @@ static void HalStartTimer(HalInstance* inst, uint32_t duration) {
  **************************************************************************************************/
 
 /**
- * Write message pointer to small ring buffer for queuing HAL messages.
+ * Post a message to the lock-free ring of the HAL worker thread.
+ * The worker is only woken up through its eventfd if it is parked.
  * @param inst HAL instance
  * @param msg Message to send
  * @return true if message properly copied in ring buffer
  */
 static bool HalEnqueueThreadMessage(HalInstance* inst, ThreadMesssage* msg) {
-  // Put a message to the queue
-  int nextWriteSlot;
-  bool result = true;
-
-  pthread_mutex_lock(&inst->hMutex);
-
-  nextWriteSlot = inst->ringWritePos + 1;
+  msg->enqueueTime = HalGetTimestamp();
 
-  if (nextWriteSlot == HAL_QUEUE_MAX) {
-    nextWriteSlot = 0;
-  }
-
-  // Check that we don't overflow the queue entries
-  if (nextWriteSlot == inst->ringReadPos) {
+  if (!inst->ring.push(*msg)) {
     STLOG_HAL_E("HAL thread message ring: RNR (implement me!!)");
-    result = false;
-  }
-
-  if (result) {
-    // inst->ring[nextWriteSlot] = *msg;
-    memcpy(&(inst->ring[nextWriteSlot]), msg, sizeof(ThreadMesssage));
-    inst->ringWritePos = nextWriteSlot;
+    return false;
   }
 
-  pthread_mutex_unlock(&inst->hMutex);
-
-  if (result) {
-    sem_post(&inst->semaphore);
+  // Pairs with the fence in HalWorkerThread: either we see the worker parked,
+  // or the worker sees our message before going to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (inst->workerParked.exchange(false)) {
+    uint64_t one = 1;
+    if (write(inst->wakeupFd, &one, sizeof(one)) != sizeof(one)) {
+      STLOG_HAL_E("HAL thread message ring: failed to wake up worker");
+    }
   }
 
-  return result;
+  return true;
 }
 
 /**
- * Remove message pointer from stored ring buffer.
+ * Remove message from the ring buffer. Only called by the HAL worker thread.
  * @param inst HAL instance
  * @param msg Message received
  * @return true if there is a new message to pull, false otherwise.
  */
 static bool HalDequeueThreadMessage(HalInstance* inst, ThreadMesssage* msg) {
-  int nextCmdIndex;
-  bool result = true;
-  // New data available
-  pthread_mutex_lock(&inst->hMutex);
-
-  // Get new timer read index
-  nextCmdIndex = inst->ringReadPos + 1;
-
-  if (nextCmdIndex == HAL_QUEUE_MAX) {
-    nextCmdIndex = 0;
-  }
-  // check if ring buffer is empty
-  if (inst->ringReadPos == inst->ringWritePos) {
-    STLOG_HAL_E("HAL thread message ring: already read last valid data");
-    result = false;
+  if (!inst->ring.pop(msg)) {
+    return false;
   }
 
-  // Get new element from ringbuffer
-  if (result) {
-    memcpy(msg, &(inst->ring[nextCmdIndex]), sizeof(ThreadMesssage));
-    inst->ringReadPos = nextCmdIndex;
-  }
+  struct timespec now = HalGetTimestamp();
+  uint64_t latencyUs =
+      (uint64_t)((int64_t)(now.tv_sec - msg->enqueueTime.tv_sec) * 1000000 +
+                 (now.tv_nsec - msg->enqueueTime.tv_nsec) / 1000);
 
-  pthread_mutex_unlock(&inst->hMutex);
+  inst->statMessages++;
+  inst->statLatencyTotalUs += latencyUs;
+  if (latencyUs > inst->statLatencyMaxUs) {
+    inst->statLatencyMaxUs = latencyUs;
+  }
 
-  return result;
+  return true;
 }
 
 /**************************************************************************************************
@@ -564,15 +912,160 @@ static bool HalDequeueThreadMessage(HalInstance* inst, ThreadMesssage* msg) {
  **************************************************************************************************/
 
 /**
- * Allocate buffer from pre-allocated pool.
+ * Copy an NCI message into a TX buffer and post it to the worker thread. This
+ * is the only copy of the frame on its way down, the I2C layer writes it from
+ * the buffer.
  * @param inst HAL instance
- * @return Pointer to allocated HAL buffer
+ * @param command MSG_TX_DATA or MSG_TX_DATA_TIMER_START
+ * @param data Data message
+ * @param size Message size
+ * @param duration Timer duration for MSG_TX_DATA_TIMER_START
+ * @param timeout Maximum time to wait for a buffer, in milliseconds
  */
-static HalBuffer* HalAllocBuffer(HalInstance* inst) {
+static bool HalPostDownstream(HalInstance* inst, uint32_t command,
+                              const uint8_t* data, size_t size,
+                              uint32_t duration, uint32_t timeout) {
+  struct timespec postTime = HalGetTimestamp();
+
+  if ((size > MAX_BUFFER_SIZE) || (size == 0)) {
+    STLOG_HAL_E("HalSendDownstream size to large %zu instead of %d\n", size,
+                MAX_BUFFER_SIZE);
+    return false;
+  }
+
+  ThreadMesssage msg;
+  HalBuffer* b = HalAllocBuffer(inst, timeout);
+
+  if (!b) {
+    return false;
+  }
+
+  memcpy(b->data, data, size);
+  b->length = size;
+  b->postTime = postTime;
+
+  msg.command = command;
+  msg.payload = 0;
+  msg.length = duration;
+  msg.buffer = b;
+
+  if (!HalEnqueueThreadMessage(inst, &msg)) {
+    HalReleaseBuffer(inst, b);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Wait on a semaphore with a timeout.
+ * @param sem Semaphore
+ * @param timeout Timeout in milliseconds, OS_SYNC_INFINITE to wait forever
+ * @return true if the semaphore was taken
+ */
+static bool HalSemTimedWait(sem_t* sem, uint32_t timeout) {
+  int ret;
+
+  if (timeout == OS_SYNC_INFINITE) {
+    return sem_wait_nointr(sem) == 0;
+  }
+  if (timeout == 0) {
+    return sem_trywait(sem) == 0;
+  }
+
+  // sem_timedwait only takes CLOCK_REALTIME deadlines
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  do {
+    ret = sem_timedwait(sem, &deadline);
+  } while ((ret != 0) && (errno == EINTR));
+
+  return ret == 0;
+}
+
+/**
+ * Add a second slab of TX buffers, as large as the first one. Only done once.
+ * @param inst HAL instance
+ * @return true if buffers were added
+ */
+static bool HalGrowBufferPool(HalInstance* inst) {
+  HalBuffer* slab = NULL;
+  size_t i;
+
+  pthread_mutex_lock(&inst->hMutex);
+  if (!inst->slabData) {
+    slab = (HalBuffer*)calloc(inst->txPoolSize, sizeof(HalBuffer));
+    if (slab) {
+      for (i = 0; i < inst->txPoolSize; i++) {
+        slab[i].next = inst->freeBufferList;
+        inst->freeBufferList = &slab[i];
+      }
+      inst->slabData = slab;
+    }
+  }
+  pthread_mutex_unlock(&inst->hMutex);
+
+  if (!slab) {
+    return false;
+  }
+
+  STLOG_HAL_W("TX buffer pool exhausted, added %zu buffers\n",
+              inst->txPoolSize);
+  for (i = 0; i < inst->txPoolSize; i++) {
+    sem_post(&inst->bufferResourceSem);
+  }
+  return true;
+}
+
+/**
+ * Take a buffer from the TX pool, applying the overflow policy when it is
+ * exhausted. The HAL thread never waits, it gets a spare buffer instead.
+ * @param inst HAL instance
+ * @param timeout Maximum time to wait for a buffer, in milliseconds
+ * @return Buffer, NULL if none could be allocated
+ */
+static HalBuffer* HalAllocBuffer(HalInstance* inst, uint32_t timeout) {
   HalBuffer* b;
 
-  // Wait until we have a buffer resource
-  sem_wait_nointr(&inst->bufferResourceSem);
+  if (sem_trywait(&inst->bufferResourceSem) != 0) {
+    // Downstream does not drain as fast as the stack sends
+    inst->statTxExhausted++;
+
+    if (onHalThread) {
+      // The HAL thread drains the pool, it would wait for itself: the wrapper
+      // sends its commands from here while the stack data fills the pool
+      b = (HalBuffer*)calloc(1, sizeof(HalBuffer));
+      if (!b) {
+        inst->statTxFailed++;
+        STLOG_HAL_E("! no spare TX buffer (%u failures)\n",
+                    inst->statTxFailed.load());
+        return NULL;
+      }
+      b->spare = true;
+      b->refCount.store(1, std::memory_order_relaxed);
+      return b;
+    }
+
+    if (inst->txPolicy == HAL_TX_POLICY_FAIL) {
+      timeout = 0;
+    } else if (inst->txPolicy == HAL_TX_POLICY_GROW) {
+      HalGrowBufferPool(inst);
+    }
+
+    // Wait until we have a buffer resource
+    if (!HalSemTimedWait(&inst->bufferResourceSem, timeout)) {
+      inst->statTxFailed++;
+      STLOG_HAL_E("! no TX buffer available after %u ms (%u failures)\n",
+                  timeout, inst->statTxFailed.load());
+      return NULL;
+    }
+  }
 
   pthread_mutex_lock(&inst->hMutex);
 
@@ -580,6 +1073,7 @@ static HalBuffer* HalAllocBuffer(HalInstance* inst) {
   if (b) {
     inst->freeBufferList = b->next;
     b->next = 0;
+    b->refCount.store(1, std::memory_order_relaxed);
   }
 
   pthread_mutex_unlock(&inst->hMutex);
@@ -593,12 +1087,6 @@ static HalBuffer* HalAllocBuffer(HalInstance* inst) {
   return b;
 }
 
-/**
- * Return buffer to pool.
- * @param inst HAL instance
- * @param b Pointer of HAL buffer to free
- * @return Pointer of freed HAL buffer
- */
 static HalBuffer* HalFreeBuffer(HalInstance* inst, HalBuffer* b) {
   pthread_mutex_lock(&inst->hMutex);
 
@@ -613,6 +1101,86 @@ static HalBuffer* HalFreeBuffer(HalInstance* inst, HalBuffer* b) {
   return b;
 }
 
+/**
+ * Take an additional reference on a TX buffer.
+ * @param b TX buffer
+ */
+void HalRetainBuffer(HalBuffer* b) {
+  b->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Drop a reference on a TX buffer, the last one returns it to the pool and
+ * unblocks a sender waiting for a buffer. May be called from any thread.
+ * @param inst HAL instance
+ * @param b TX buffer
+ */
+void HalReleaseBuffer(HalInstance* inst, HalBuffer* b) {
+  if (b->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    if (b->spare) {
+      // Not part of the pool, nobody waits for it
+      free(b);
+    } else {
+      HalFreeBuffer(inst, b);
+    }
+  }
+}
+
+/**
+ * Take an additional reference on an RX buffer.
+ * @param b RX buffer
+ */
+void HalRetainRxBuffer(HalRxBuffer* b) {
+  b->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Drop a reference on an RX buffer, the last one returns it to the pool and
+ * unblocks the I2C thread if it was waiting for a buffer.
+ * @param inst HAL instance
+ * @param b RX buffer
+ */
+void HalReleaseRxBuffer(HalInstance* inst, HalRxBuffer* b) {
+  if (b->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    inst->rxFreeRing.push(b);
+    sem_post(&inst->rxBufferSem);
+  }
+}
+
+/**
+ * Free all the resources of a HAL instance, whether fully set up or not.
+ * @param inst HAL instance
+ */
+static void HalReleaseInstance(HalInstance* inst) {
+  // The pool buffers go with their slabs, the spare ones still queued not
+  for (int q = 0; q < HAL_TX_QUEUE_MAX; q++) {
+    HalBuffer* b = inst->txQueues[q].head;
+    while (b) {
+      HalBuffer* next = b->next;
+      if (b->spare) {
+        free(b);
+      }
+      b = next;
+    }
+  }
+  if (inst->timerFd >= 0) {
+    close(inst->timerFd);
+  }
+  if (inst->wakeupFd >= 0) {
+    close(inst->wakeupFd);
+  }
+  inst->ring.release();
+  inst->rxFreeRing.release();
+  sem_destroy(&inst->bufferResourceSem);
+  sem_destroy(&inst->rxBufferSem);
+  pthread_mutex_destroy(&inst->hMutex);
+
+  free(inst->rxBufferData);
+  free(inst->slabData);
+  free(inst->bufferData);
+  free(inst);
+}
+
 /**************************************************************************************************
  *
  *                                     State Machine
@@ -630,29 +1198,36 @@ static void Hal_event_handler(HalInstance* inst, HalEvent e) {
       // New data packet arrived
       const uint8_t* nciData;
       size_t nciLength;
+      struct timespec start;
 
       // Extract raw NCI data from frame
       nciData = inst->lastUsFrame;
       nciLength = inst->lastUsFrameSize;
 
       // Pass received raw NCI data to stack
+      HalLatencyRecord(HAL_LATENCY_RX, &inst->lastUsFrameTime);
+      clock_gettime(CLOCK_MONOTONIC, &start);
       inst->callback(inst->context, HAL_EVENT_DATAIND, nciData, nciLength);
+      HalLatencyRecord(HAL_LATENCY_UPSTREAM, &start);
     } break;
 
     case EVT_TX_DATA:
       // NCI data arrived from stack
       // Send data
+      dsFrameBuffer = inst->nciBuffer;
       inst->callback(inst->context, HAL_EVENT_DSWRITE, inst->nciBuffer->data,
                      inst->nciBuffer->length);
+      dsFrameBuffer = NULL;
 
-      // Free the buffer
-      HalFreeBuffer(inst, inst->nciBuffer);
+      // The I2C layer holds its own reference until the frame is written
+      HalReleaseBuffer(inst, inst->nciBuffer);
       inst->nciBuffer = 0;
       break;
 
     // HAL WRAPPER
     case EVT_TIMER:
-      inst->callback(inst->context, HAL_EVENT_TIMER_TIMEOUT, NULL, 0);
+      inst->callback(inst->context, HAL_EVENT_TIMER_TIMEOUT,
+                     &inst->expiredTimerId, sizeof(inst->expiredTimerId));
       break;
   }
 }
@@ -663,6 +1238,80 @@ static void Hal_event_handler(HalInstance* inst, HalEvent e) {
  *
  **************************************************************************************************/
 
+/**
+ * Process one message dequeued by the HAL worker thread.
+ * @param inst HAL instance
+ * @param msg Message to process
+ */
+static void HalDispatchThreadMessage(HalInstance* inst, ThreadMesssage* msg) {
+  switch (msg->command) {
+    case MSG_EXIT_REQUEST:
+
+      STLOG_HAL_V("received exit request from upper layer\n");
+      // The I2C layer is closed already, see HalFlushDownstream. Frames still
+      // queued are freed with the instance.
+      if (inst->txPending) {
+        STLOG_HAL_W("exit request, %u frame(s) not sent\n", inst->txPending);
+      }
+      inst->exitRequest = true;
+      break;
+
+    case MSG_FLUSH_REQUEST:
+      while (inst->txPending) {
+        HalTriggerNextDsPacket(inst);
+      }
+      sem_post((sem_t*)msg->payload);
+      break;
+
+    case MSG_TX_DATA:
+      STLOG_HAL_V("received new NCI data from stack\n");
+
+      // Queue it, it is sent once the message ring is drained
+      HalQueueDsPacket(inst, msg->buffer);
+      break;
+
+    // HAL WRAPPER
+    case MSG_TX_DATA_TIMER_START:
+      STLOG_HAL_V("received new NCI data from stack, need timer start\n");
+
+      // Queue it, it is sent once the message ring is drained. The wrapper
+      // waits for the answer to its own commands, don't let the data the
+      // stack sent before one go out meanwhile
+      HalQueueDsPacket(inst, msg->buffer);
+      msg->buffer->ordered = true;
+
+      // Start timer
+      HalStartTimer(inst, HAL_TIMER_ID_CMD, msg->length);
+      break;
+
+    case MSG_RX_DATA: {
+      HalRxBuffer* b = (HalRxBuffer*)msg->payload;
+      uint8_t* data = b->data;
+      STLOG_HAL_V("received %zu new frame(s) from CLF\n", b->count);
+      inst->lastUsFrameTime = b->rxTime;
+      HalUpdateRxStats(inst, b->count);
+      for (size_t i = 0; i < b->count; i++) {
+        HalOnNewUpstreamFrame(inst, data, b->frameLength[i]);
+        data += b->frameLength[i];
+      }
+      HalReleaseRxBuffer(inst, b);
+    } break;
+
+    case MSG_TIMER_START:
+      // Start timer
+      HalStartTimer(inst, msg->timerId, msg->length);
+      STLOG_HAL_D("MSG_TIMER_START \n");
+      break;
+
+    case MSG_TIMER_STOP:
+      HalStopTimer(inst, msg->timerId);
+      break;
+    default:
+      STLOG_HAL_E("!received unkown thread message?\n");
+      break;
+  }
+}
+
 /**
  * HAL worker thread to serialize all actions into a single thread.
  * RX/TX/TIMER are dispatched from here.
@@ -671,110 +1320,56 @@ static void Hal_event_handler(HalInstance* inst, HalEvent e) {
 static void* HalWorkerThread(void* arg) {
   HalInstance* inst = (HalInstance*)arg;
   inst->exitRequest = false;
+  onHalThread = true;
 
   STLOG_HAL_V("thread running\n");
 
   while (!inst->exitRequest) {
+    ThreadMesssage msg;
+
+    if (HalDequeueThreadMessage(inst, &msg)) {
+      HalDispatchThreadMessage(inst, &msg);
+      continue;
+    }
+
+    // Ring drained: send one queued frame, highest priority first, then look
+    // for more urgent frames again
+    if (inst->txPending) {
+      HalTriggerNextDsPacket(inst);
+      continue;
+    }
+
+    // Ring drained: announce that we park, then check again so that a
+    // producer racing with us either sees the flag or we see its message.
+    inst->workerParked.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!inst->ring.empty()) {
+      inst->workerParked.store(false);
+      continue;
+    }
+
     struct timespec now = HalGetTimestamp();
     uint32_t waitResult =
-        HalSemWait(&inst->semaphore, HalCalcSemWaitingTime(inst, &now));
+        HalWaitForMessage(inst, HalCalcSemWaitingTime(inst, &now));
+    inst->workerParked.store(false);
+    inst->statWakeups++;
+    inst->rxWakeupCounted = false;
 
     switch (waitResult) {
       case OS_SYNC_TIMEOUT: {
-        // One or more times have expired
-        STLOG_HAL_W("OS_SYNC_TIMEOUT\n");
+        // One or more timers have expired
         now = HalGetTimestamp();
-        // Data frame
-        Hal_event_handler(inst, EVT_TIMER);
+        HalProcessTimers(inst, &now);
       } break;
 
-      case OS_SYNC_RELEASED: {
-        // A message arrived
-        ThreadMesssage msg;
-
-        if (HalDequeueThreadMessage(inst, &msg)) {
-          switch (msg.command) {
-            case MSG_EXIT_REQUEST:
-
-              STLOG_HAL_V("received exit request from upper layer\n");
-              inst->exitRequest = true;
-              break;
-
-            case MSG_TX_DATA:
-              STLOG_HAL_V("received new NCI data from stack\n");
-
-              // Attack to end of list
-              if (!inst->pendingNciList) {
-                inst->pendingNciList = msg.buffer;
-                inst->pendingNciList->next = 0;
-              } else {
-                // Find last element of the list. b->next is zero for this
-                // element
-                HalBuffer* b;
-                for (b = inst->pendingNciList; b->next; b = b->next) {
-                };
-
-                // Concatenate to list
-                b->next = msg.buffer;
-                msg.buffer->next = 0;
-              }
-
-              // Start transmitting if we're in the correct state
-              HalTriggerNextDsPacket(inst);
-              break;
-
-            // HAL WRAPPER
-            case MSG_TX_DATA_TIMER_START:
-              STLOG_HAL_V(
-                  "received new NCI data from stack, need timer start\n");
-
-              // Attack to end of list
-              if (!inst->pendingNciList) {
-                inst->pendingNciList = msg.buffer;
-                inst->pendingNciList->next = 0;
-              } else {
-                // Find last element of the list. b->next is zero for this
-                // element
-                HalBuffer* b;
-                for (b = inst->pendingNciList; b->next; b = b->next) {
-                };
-
-                // Concatenate to list
-                b->next = msg.buffer;
-                msg.buffer->next = 0;
-              }
-
-              // Start timer
-              HalStartTimer(inst, msg.length);
-
-              // Start transmitting if we're in the correct state
-              HalTriggerNextDsPacket(inst);
-              break;
-
-            case MSG_RX_DATA:
-              STLOG_HAL_V("received new data from CLF\n");
-              HalOnNewUpstreamFrame(inst, (unsigned char*)msg.payload,
-                                    msg.length);
-              break;
-
-            case MSG_TIMER_START:
-              // Start timer
-              HalStartTimer(inst, msg.length);
-              STLOG_HAL_D("MSG_TIMER_START \n");
-              break;
-            default:
-              STLOG_HAL_E("!received unkown thread message?\n");
-              break;
-          }
-        } else {
-          STLOG_HAL_E("!got wakeup in workerthread, but no message here? ?\n");
-        }
-      } break;
+      case OS_SYNC_RELEASED:
+        // A message arrived, it is dequeued on next loop
+        break;
 
       case OS_SYNC_FAILED:
 
         STLOG_HAL_E(
-            "!Something went horribly wrong.. The semaphore wait function "
+            "!Something went horribly wrong.. The wakeup wait function "
             "failed\n");
         inst->exitRequest = true;
         break;
@@ -805,22 +1400,241 @@ static inline int sem_wait_nointr(sem_t* sem) {
   return 0;
 }
 
+/**
+ * Account RX frames about to be dispatched, and report the frames per wakeup
+ * and wakeups per second once per HAL_RX_STATS_PERIOD_MS of RX activity.
+ * @param inst HAL instance
+ * @param frames Number of frames
+ */
+static void HalUpdateRxStats(HalInstance* inst, size_t frames) {
+  struct timespec now = HalGetTimestamp();
+
+  if (inst->statWindowFrames == 0) {
+    // First frame after an idle period, don't account the idle time
+    inst->statWindowStart = now;
+  }
+
+  if (!inst->rxWakeupCounted) {
+    inst->rxWakeupCounted = true;
+    inst->statRxWakeups++;
+    inst->statWindowWakeups++;
+  }
+  inst->statRxFrames += frames;
+  inst->statWindowFrames += frames;
+
+  int elapsed = HalTimeDiffInMs(inst->statWindowStart, now);
+  if (elapsed >= HAL_RX_STATS_PERIOD_MS) {
+    STLOG_HAL_D(
+        "RX: %u frames in %u wakeups over %d ms, %u.%02u frames/wakeup, %u "
+        "wakeups/s\n",
+        inst->statWindowFrames, inst->statWindowWakeups, elapsed,
+        inst->statWindowFrames / inst->statWindowWakeups,
+        (inst->statWindowFrames * 100 / inst->statWindowWakeups) % 100,
+        (uint32_t)((uint64_t)inst->statWindowWakeups * 1000 / elapsed));
+    inst->statWindowFrames = 0;
+    inst->statWindowWakeups = 0;
+    inst->rxWakeupCounted = false;
+  }
+}
+
 /**
  * Handle RX frames here first in HAL context.
  * @param inst HAL instance
- * @param data HAL data received from I2C worker thread
+ * @param data HAL data received from I2C worker thread, in an RX buffer or on
+ * the reactor thread stack
  * @param length Size of HAL data
  */
 static void HalOnNewUpstreamFrame(HalInstance* inst, const uint8_t* data,
                                   size_t length) {
-  memcpy(inst->lastUsFrame, data, length);
+  // The frame stays in the caller's buffer, the upper layers may modify it
+  inst->lastUsFrame = (uint8_t*)data;
   inst->lastUsFrameSize = length;
 
   // Data frame
   Hal_event_handler(inst, EVT_RX_DATA);
-  // Allow the I2C thread to get the next message (if done early, it may
-  // overwrite before handled)
-  sem_post(&inst->upstreamBlock);
+  inst->lastUsFrame = NULL;
+}
+
+/**
+ * Append a buffer to the TX queue of its class: NCI control commands,
+ * proprietary commands, or data packets of its connection.
+ * The commands that act on a connection are marked ordered: RF and NFCEE
+ * management, and CORE_CONN_CLOSE_CMD. For instance an RF_DEACTIVATE_CMD must
+ * not overtake the data the stack sent before it. So are the commands of the
+ * HAL wrapper sent with a timer, see MSG_TX_DATA_TIMER_START.
+ * @param inst HAL instance
+ * @param b Buffer holding an NCI packet
+ */
+static void HalQueueDsPacket(HalInstance* inst, HalBuffer* b) {
+  uint8_t mt = (b->data[0] >> 5) & 0x07;
+  uint8_t gid = b->data[0] & 0x0F;
+  uint32_t q;
+
+  b->ordered = false;
+  if (mt == 0) {
+    q = HAL_TX_CLASS_DATA + (b->data[0] & 0x0F);
+  } else if ((mt == 1) && (gid == 0x0F)) {
+    q = HAL_TX_CLASS_PROP;
+  } else {
+    // Commands, and anything not NCI (e.g. loader frames) in order
+    q = HAL_TX_CLASS_CONTROL;
+    if ((mt == 1) && ((gid == 0x01) || (gid == 0x02) ||
+                      ((gid == 0x00) && (b->length >= 2) &&
+                       ((b->data[1] & 0x3F) == 0x05)))) {
+      b->ordered = true;
+    }
+  }
+
+  HalTxQueue* queue = &inst->txQueues[q];
+  b->next = 0;
+  b->seq = inst->txSeq++;
+  b->queueTime = HalGetTimestamp();
+  if (queue->tail) {
+    queue->tail->next = b;
+  } else {
+    queue->head = b;
+  }
+  queue->tail = b;
+
+  if (++queue->depth > queue->maxDepth) {
+    queue->maxDepth = queue->depth;
+  }
+  inst->txPending++;
+}
+
+/**
+ * Check if a data packet queued before a given one is still pending.
+ * @param inst HAL instance
+ * @param seq Queuing order of the packet
+ * @return true if a data queue holds an older packet
+ */
+static bool HalDataQueuedBefore(HalInstance* inst, uint32_t seq) {
+  uint32_t q;
+
+  for (q = HAL_TX_CLASS_DATA; q < HAL_TX_QUEUE_MAX; q++) {
+    HalBuffer* head = inst->txQueues[q].head;
+    if (head && ((int32_t)(head->seq - seq) < 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Check if the command at the head of a queue must wait for older data.
+ * @param inst HAL instance
+ * @param head Head of the control or proprietary queue, may be NULL
+ * @return true if head is an ordered command queued after pending data
+ */
+static bool HalCommandHeld(HalInstance* inst, HalBuffer* head) {
+  return head && head->ordered && HalDataQueuedBefore(inst, head->seq);
+}
+
+/**
+ * Pick the next buffer to send: control commands first, then proprietary
+ * commands, then data packets, one connection after the other.
+ * Preserved orderings: each queue is FIFO, so the control commands are sent
+ * in order, the proprietary ones too, and so are the packets of a connection.
+ * An ordered command (see HalQueueDsPacket) is sent after all the data packets
+ * queued before it and before those queued after it; until then the commands
+ * behind it wait too.
+ * @param inst HAL instance
+ * @return Buffer removed from its queue, NULL if nothing is pending
+ */
+static HalBuffer* HalDequeueDsPacket(HalInstance* inst) {
+  HalTxQueue* queue = NULL;
+  HalBuffer* control = inst->txQueues[HAL_TX_CLASS_CONTROL].head;
+  HalBuffer* prop = inst->txQueues[HAL_TX_CLASS_PROP].head;
+  HalBuffer* barrier = NULL; /* oldest command held */
+  bool controlHeld;
+  bool propHeld;
+  uint32_t q;
+
+  if (!inst->txPending) {
+    return NULL;
+  }
+
+  controlHeld = HalCommandHeld(inst, control);
+  propHeld = HalCommandHeld(inst, prop);
+  if (controlHeld) {
+    barrier = control;
+  }
+  if (propHeld && (!barrier || ((int32_t)(prop->seq - barrier->seq) < 0))) {
+    barrier = prop;
+  }
+
+  if (control && !controlHeld) {
+    queue = &inst->txQueues[HAL_TX_CLASS_CONTROL];
+  } else if (prop && !propHeld) {
+    queue = &inst->txQueues[HAL_TX_CLASS_PROP];
+  } else {
+    for (q = 0; q < HAL_TX_DATA_CONN_MAX; q++) {
+      uint32_t conn = (inst->txNextConn + q) % HAL_TX_DATA_CONN_MAX;
+      HalBuffer* head = inst->txQueues[HAL_TX_CLASS_DATA + conn].head;
+      // Behind an ordered command, only the packets queued before it
+      if (head &&
+          (!barrier || ((int32_t)(head->seq - barrier->seq) < 0))) {
+        queue = &inst->txQueues[HAL_TX_CLASS_DATA + conn];
+        inst->txNextConn = (conn + 1) % HAL_TX_DATA_CONN_MAX;
+        break;
+      }
+    }
+  }
+
+  HalBuffer* b = queue->head;
+  queue->head = b->next;
+  if (!queue->head) {
+    queue->tail = 0;
+  }
+  queue->depth--;
+  inst->txPending--;
+
+  struct timespec now = HalGetTimestamp();
+  uint64_t waitUs = (uint64_t)(now.tv_sec - b->queueTime.tv_sec) * 1000000 +
+                    (now.tv_nsec - b->queueTime.tv_nsec) / 1000;
+  queue->frames++;
+  queue->waitTotalUs += waitUs;
+  if (waitUs > queue->waitMaxUs) {
+    queue->waitMaxUs = waitUs;
+  }
+
+  return b;
+}
+
+/**
+ * Log the TX queue statistics, the data queues are merged.
+ * @param inst HAL instance
+ */
+static void HalLogTxStats(HalInstance* inst) {
+  static const char* const names[] = {"control", "proprietary", "data"};
+  HalTxQueue total[3];
+  uint32_t q;
+
+  memset(total, 0, sizeof(total));
+  for (q = 0; q < HAL_TX_QUEUE_MAX; q++) {
+    HalTxQueue* t = &total[(q < HAL_TX_CLASS_DATA) ? q : HAL_TX_CLASS_DATA];
+    HalTxQueue* queue = &inst->txQueues[q];
+    t->frames += queue->frames;
+    t->waitTotalUs += queue->waitTotalUs;
+    if (queue->waitMaxUs > t->waitMaxUs) {
+      t->waitMaxUs = queue->waitMaxUs;
+    }
+    if (queue->maxDepth > t->maxDepth) {
+      t->maxDepth = queue->maxDepth;
+    }
+  }
+
+  for (q = 0; q < 3; q++) {
+    if (!total[q].frames) {
+      continue;
+    }
+    STLOG_HAL_D(
+        "HalDestroy: TX %s: %llu frames, max depth %u, wait avg %llu us max "
+        "%llu us\n",
+        names[q], (unsigned long long)total[q].frames, total[q].maxDepth,
+        (unsigned long long)(total[q].waitTotalUs / total[q].frames),
+        (unsigned long long)total[q].waitMaxUs);
+  }
 }
 
 /**
@@ -829,11 +1643,9 @@ static void HalOnNewUpstreamFrame(HalInstance* inst, const uint8_t* data,
  */
 static void HalTriggerNextDsPacket(HalInstance* inst) {
   // Check if we have something to transmit downstream
-  HalBuffer* b = inst->pendingNciList;
+  HalBuffer* b = HalDequeueDsPacket(inst);
 
   if (b) {
-    // Get the buffer from the pending list
-    inst->pendingNciList = b->next;
     inst->nciBuffer = b;
 
     STLOG_HAL_V("trigger transport of next NCI data downstream\n");
@@ -846,73 +1658,46 @@ static void HalTriggerNextDsPacket(HalInstance* inst) {
 }
 
 /*
- * Wait for given semaphore signaling a specific time or ever
- * param sem_t * pSemaphore
- * param uint32_t timeout
+ * Park the worker thread until a producer signals the eventfd or the timeout
+ * elapses.
+ * param HalInstance * inst
+ * param uint32_t timeout in milliseconds, OS_SYNC_INFINITE to wait forever
  * return uint32_t
  */
-static uint32_t HalSemWait(sem_t* pSemaphore, uint32_t timeout) {
-  uint32_t result = OS_SYNC_RELEASED;
-  bool gotResult = false;
-
-  if (timeout == OS_SYNC_INFINITE) {
-    while (!gotResult) {
-      if (sem_wait(pSemaphore) == -1) {
-        int e = errno;
-        char msg[200];
-
-        if (e == EINTR) {
-          STLOG_HAL_W(
-              "! semaphore (infin) wait interrupted by system signal. re-enter "
-              "wait");
-          continue;
-        }
-
-        strerror_r(e, msg, sizeof(msg) - 1);
-        STLOG_HAL_E("! semaphore (infin) wait failed. sem=0x%p, %s", pSemaphore,
-                    msg);
-        gotResult = true;
-        result = OS_SYNC_FAILED;
-      } else {
-        gotResult = true;
-      }
-    };
-  } else {
-    struct timespec tm;
-    long oneSecInNs = (int)1e9;
+static uint32_t HalWaitForMessage(HalInstance* inst, uint32_t timeout) {
+  struct pollfd pfd;
+  int pollTimeout = (timeout == OS_SYNC_INFINITE) ? -1 : (int)timeout;
 
-    clock_gettime(CLOCK_REALTIME, &tm);
+  pfd.fd = inst->wakeupFd;
+  pfd.events = POLLIN;
 
-    /* add timeout (can't overflow): */
-    tm.tv_sec += (timeout / 1000);
-    tm.tv_nsec += ((timeout % 1000) * 1000000);
+  for (;;) {
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, pollTimeout);
 
-    /* make sure nanoseconds are below a million */
-    if (tm.tv_nsec >= oneSecInNs) {
-      tm.tv_sec++;
-      tm.tv_nsec -= oneSecInNs;
+    if (ret == 0) {
+      return OS_SYNC_TIMEOUT;
     }
 
-    while (!gotResult) {
-      if (sem_timedwait(pSemaphore, &tm) == -1) {
-        int e = errno;
-
-        if (e == EINTR) {
-          /* interrupted by signal? repeat sem_wait again */
-          continue;
-        }
+    if (ret < 0) {
+      int e = errno;
+      char msg[200];
 
-        if (e == ETIMEDOUT) {
-          result = OS_SYNC_TIMEOUT;
-          gotResult = true;
-        } else {
-          result = OS_SYNC_FAILED;
-          gotResult = true;
-        }
-      } else {
-        gotResult = true;
+      if (e == EINTR) {
+        /* interrupted by signal? repeat wait again */
+        continue;
       }
+
+      strerror_r(e, msg, sizeof(msg) - 1);
+      STLOG_HAL_E("! wakeup wait failed. fd=%d, %s", inst->wakeupFd, msg);
+      return OS_SYNC_FAILED;
     }
+
+    // Reset the eventfd counter, the ring holds the actual messages
+    uint64_t count;
+    if (read(inst->wakeupFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      STLOG_HAL_W("! failed to reset wakeup eventfd");
+    }
+    return OS_SYNC_RELEASED;
   }
-  return result;
 }
@@ -23,7 +23,10 @@
 #include <semaphore.h>
 #include <stdint.h>
 #include <time.h>
+#include <atomic>
+#include "hal_timer_wheel.h"
 #include "halcore.h"
+#include "halring.h"
 
 #define MAX_NCIFRAME_PAYLOAD_SIZE 255
 #define MAX_HEADER_SIZE 3
@@ -40,8 +43,7 @@
 /* ----------------------------------------------------------------------------------------------*/
 /* ----------------------------------------------------------------------------------------------*/
 
-#define HAL_QUEUE_MAX \
-  8 /* max. # of messages enqueued before going into blocking mode */
+#define HAL_QUEUE_MAX 8 /* max. # of messages enqueued in the worker ring */
 
 /* thread messages  */
 #define MSG_EXIT_REQUEST 0 /* worker thread should terminate itself */
@@ -51,9 +53,30 @@
 // HAL _WRAPPER
 #define MSG_TX_DATA_TIMER_START 3
 #define MSG_TIMER_START 4
+#define MSG_TIMER_STOP 5
+#define MSG_FLUSH_REQUEST 6 /* hand the queued frames to the I2C layer */
+
+/* downstream scheduling classes, served in strict priority order, except
+ * that the commands acting on a connection (RF and NFCEE management, core
+ * connection close) wait for the data packets queued before them */
+#define HAL_TX_CLASS_CONTROL 0 /* NCI control commands */
+#define HAL_TX_CLASS_PROP 1    /* proprietary commands (GID 0xF) */
+#define HAL_TX_CLASS_DATA 2    /* data packets, one queue per conn ID */
+#define HAL_TX_DATA_CONN_MAX 16
+#define HAL_TX_QUEUE_MAX (HAL_TX_CLASS_DATA + HAL_TX_DATA_CONN_MAX)
 
 /* number of buffers used for incoming & outgoing data */
 #define NUM_BUFFERS 10
+#define HAL_TX_POOL_SIZE_MAX 64
+
+/* what HalSendDownstream does when all the TX buffers are in use */
+#define HAL_TX_POLICY_BLOCK 0 /* wait for a buffer */
+#define HAL_TX_POLICY_FAIL 1  /* fail right away */
+#define HAL_TX_POLICY_GROW 2  /* add a second slab of buffers, once */
+
+/* number of RX frames the I2C thread may hand over before it has to wait */
+#define HAL_RX_QUEUE_DEPTH_DEFAULT 4
+#define HAL_RX_QUEUE_DEPTH_MAX 64
 
 /* constants for the return value of osWait */
 #define OS_SYNC_INFINITE 0xffffffffu
@@ -61,6 +84,9 @@
 #define OS_SYNC_TIMEOUT 1
 #define OS_SYNC_FAILED 0xffffffffu
 
+/* period of the RX batching report */
+#define HAL_RX_STATS_PERIOD_MS 1000
+
 /* default timeouts */
 #define HAL_SLEEP_TIMER 0
 #define HAL_SLEEP_TIMER_DURATION 500 /* ordinary t1 timeout to resent data */
@@ -69,13 +95,40 @@ typedef struct tagHalBuffer {
   uint8_t data[MAX_BUFFER_SIZE];
   size_t length;
   struct tagHalBuffer* next;
+  struct timespec queueTime; /* when it entered its TX queue */
+  struct timespec postTime;  /* when the sender posted it */
+  uint32_t seq;              /* queuing order, across all the TX queues */
+  bool ordered;              /* command kept behind the data queued before */
+  bool spare;                /* allocated off the pool by the HAL thread */
+  std::atomic<int> refCount; /* returned to the pool when it drops to 0 */
 } HalBuffer;
 
+typedef struct tagHalTxQueue {
+  HalBuffer* head;
+  HalBuffer* tail;
+  uint32_t depth;
+  /* statistics, reported on HalDestroy */
+  uint32_t maxDepth;
+  uint64_t frames;
+  uint64_t waitTotalUs;
+  uint64_t waitMaxUs;
+} HalTxQueue;
+
+typedef struct tagHalRxBuffer {
+  uint8_t data[MAX_BUFFER_SIZE * HAL_RX_BATCH_MAX]; /* frames back to back */
+  size_t frameLength[HAL_RX_BATCH_MAX];
+  size_t count;
+  struct timespec rxTime; /* when the I2C layer handed the frames over */
+  std::atomic<int> refCount; /* returned to the pool when it drops to 0 */
+} HalRxBuffer;
+
 typedef struct tagThreadMessage {
   uint32_t command;    /* message type / command */
   const void* payload; /* ptr to message related data item */
   size_t length;       /* length of above payload */
   HalBuffer* buffer;   /* buffer object (optional) */
+  uint32_t timerId;    /* MSG_TIMER_START / MSG_TIMER_STOP */
+  struct timespec enqueueTime; /* when the message was posted */
 } ThreadMesssage;
 
 typedef enum {
@@ -85,12 +138,6 @@ typedef enum {
   EVT_TIMER = 2,
 } HalEvent;
 
-typedef struct tagTimer {
-  struct timespec startTime; /* start time (CLOCK_REALTIME)       */
-  uint32_t duration;         /* timer duration in milliseconds    */
-  bool active;               /* true if timer is currently active */
-} Timer;
-
 typedef struct tagHalInstance {
   uint32_t flags;
 
@@ -99,36 +146,71 @@ typedef struct tagHalInstance {
 
   /* current timeout values */
   uint32_t timeout;
-  Timer timer;
+  Timer timers[HAL_TIMER_MAX];
+  TimerWheel wheel;
+  uint32_t expiredTimerId; /* timer reported by EVT_TIMER */
 
   /* threading and runtime support */
   bool exitRequest;
-  sem_t semaphore;
+  int wakeupFd; /* eventfd signaled when the parked worker must wake up */
+  int timerFd;  /* timerfd of the HAL timer, HAL_FLAG_REACTOR only */
+  std::atomic<bool> workerParked;
   pthread_t thread;
-  pthread_mutex_t hMutex; /* guards the message ringbuffer */
+  pthread_mutex_t hMutex; /* guards the buffer lists */
 
   /* IOBuffers for read/writes */
   HalBuffer* bufferData;
+  HalBuffer* slabData; /* HAL_TX_POLICY_GROW, allocated on exhaustion */
+  size_t txPoolSize;
+  uint32_t txPolicy;
   HalBuffer* freeBufferList;
-  HalBuffer* pendingNciList; /* outgoing packages waiting to be processed */
-  HalBuffer* nciBuffer;      /* current buffer in progress */
+  HalTxQueue txQueues[HAL_TX_QUEUE_MAX]; /* outgoing packages by class */
+  uint32_t txPending;  /* packages in all TX queues */
+  uint32_t txNextConn; /* data queue served next, round robin */
+  uint32_t txSeq;      /* seq of the next queued package */
+  HalBuffer* nciBuffer; /* current buffer in progress */
   sem_t bufferResourceSem;
 
-  sem_t upstreamBlock;
-
-  /* message ring-buffer */
-  ThreadMesssage ring[HAL_QUEUE_MAX];
-  int ringReadPos;
-  int ringWritePos;
+  /* RX frames handed over by the I2C thread */
+  HalRxBuffer* rxBufferData;
+  HalRing<HalRxBuffer*> rxFreeRing;
+  sem_t rxBufferSem; /* counts the free RX buffers */
+  size_t rxDepth;
+
+  /* lock-free message ring, many producers and the worker as consumer */
+  HalRing<ThreadMesssage> ring;
+
+  /* enqueue-to-dispatch statistics, reported on HalDestroy */
+  uint64_t statMessages;
+  uint64_t statWakeups;
+  uint64_t statLatencyTotalUs;
+  uint64_t statLatencyMaxUs;
+  uint64_t statRxFrames;
+  uint64_t statRxStalls; /* I2C thread had to wait for a free RX buffer */
+  uint64_t statRxWakeups; /* worker wakeups which dispatched RX frames */
+  /* TX buffer pool exhaustion, counted by the senders */
+  std::atomic<uint32_t> statTxExhausted; /* no free buffer on first try */
+  std::atomic<uint32_t> statTxFailed;    /* no buffer before the deadline */
+  bool rxWakeupCounted;
+  /* current RX report window, see HAL_RX_STATS_PERIOD_MS */
+  struct timespec statWindowStart;
+  uint32_t statWindowFrames;
+  uint32_t statWindowWakeups;
 
   /* current frame going downstream */
   uint8_t lastDsFrame[MAX_BUFFER_SIZE];
   size_t lastDsFrameSize;
 
-  /* current frame from CLF */
-  uint8_t lastUsFrame[MAX_BUFFER_SIZE];
+  /* current frame from CLF, valid while it is dispatched */
+  uint8_t* lastUsFrame;
   size_t lastUsFrameSize;
+  struct timespec lastUsFrameTime;
 
 } HalInstance;
 
+void HalRetainBuffer(HalBuffer* b);
+void HalReleaseBuffer(HalInstance* inst, HalBuffer* b);
+void HalRetainRxBuffer(HalRxBuffer* b);
+void HalReleaseRxBuffer(HalInstance* inst, HalRxBuffer* b);
+
 #endif
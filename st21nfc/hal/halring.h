@@ -0,0 +1,151 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef __HALRING_H_
+#define __HALRING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+
+/**
+ * Bounded lock-free queue (multi-producer / multi-consumer).
+ * Each cell carries a sequence number telling whether it is free for the
+ * producer owning position 'pos' (sequence == pos) or holds data for the
+ * consumer owning position 'pos' (sequence == pos + 1).
+ * The object may live in zero-initialized memory (calloc), init() must be
+ * called before use and release() once no thread accesses it anymore.
+ */
+template <typename T>
+class HalRing {
+ public:
+  /**
+   * Allocate the cells.
+   * @param capacity Number of entries, rounded up to a power of two
+   * @return true if memory could be allocated
+   */
+  bool init(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    mCells = (Cell*)calloc(size, sizeof(Cell));
+    if (!mCells) return false;
+
+    mMask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+      mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    mEnqueuePos.store(0, std::memory_order_relaxed);
+    mDequeuePos.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  void release() {
+    free(mCells);
+    mCells = NULL;
+  }
+
+  size_t capacity() const { return mMask + 1; }
+
+  /**
+   * Copy an item into the queue.
+   * @return false if the queue is full
+   */
+  bool push(const T& item) {
+    Cell* cell;
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+
+    for (;;) {
+      cell = &mCells[pos & mMask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+      if (diff == 0) {
+        if (mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = mEnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Remove the oldest item from the queue.
+   * @return false if the queue is empty
+   */
+  bool pop(T* item) {
+    Cell* cell;
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+
+    for (;;) {
+      cell = &mCells[pos & mMask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+      if (diff == 0) {
+        if (mDequeuePos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = mDequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    *item = cell->data;
+    cell->sequence.store(pos + mMask + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Check for published items. A producer still copying its item is not
+   * seen, it has to wake up the consumer itself afterwards.
+   */
+  bool empty() const {
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    return mCells[pos & mMask].sequence.load(std::memory_order_acquire) !=
+           pos + 1;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  Cell* mCells;
+  size_t mMask;
+  /* keep producers and consumer on separate cache lines */
+  uint8_t mPad0[64];
+  std::atomic<size_t> mEnqueuePos;
+  uint8_t mPad1[64];
+  std::atomic<size_t> mDequeuePos;
+  uint8_t mPad2[64];
+};
+
+#endif
@@ -20,11 +20,18 @@
 #include <cutils/properties.h>
 #include <errno.h>
 #include <hardware/nfc.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <string.h>
 #include <unistd.h>
+#include <atomic>
 #include "android_logmsg.h"
+#include "hal_config.h"
 #include "hal_fd.h"
+#include "hal_latency.h"
+#include "hal_recorder.h"
 #include "halcore.h"
+#include "halring.h"
 
 extern void HalCoreCallback(void* context, uint32_t event, const void* d,
                             size_t length);
@@ -41,10 +48,13 @@ typedef struct {
 
 static void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data);
 static void halWrapperCallback(uint8_t event, uint8_t event_status);
+static void halWrapperSetState(hal_wrapper_state_e state);
+static void halWrapperForwardData(uint16_t data_len, uint8_t* p_data);
 
 nfc_stack_callback_t* mHalWrapperCallback = NULL;
 nfc_stack_data_callback_t* mHalWrapperDataCallback = NULL;
-hal_wrapper_state_e mHalWrapperState = HAL_WRAPPER_STATE_CLOSED;
+/* set by the caller thread at post init, read by HAL Core */
+std::atomic<hal_wrapper_state_e> mHalWrapperState(HAL_WRAPPER_STATE_CLOSED);
 HALHANDLE mHalHandle = NULL;
 
 uint8_t mClfMode;
@@ -56,6 +66,9 @@ uint8_t mError_count = 0;
 bool mIsActiveRW = false;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+/* on CLOCK_MONOTONIC, a wall clock change must not stretch the close wait */
+static pthread_cond_t close_cond;
+static pthread_once_t closeCondOnce = PTHREAD_ONCE_INIT;
 
 static const uint8_t ApduGetAtr[] = {0x2F, 0x04, 0x05, 0x80,
                                      0x8A, 0x00, 0x00, 0x04};
@@ -72,6 +85,17 @@ bool mfactoryReset = false;
 bool ready_flag = 0;
 bool mTimerStarted = false;
 bool forceRecover = false;
+bool mCloseDone = false;
+/* hal_wrapper_close waits for the answer to PROP_NFC_MODE_SET_CMD, taken
+   whatever the state, the open sequence may still be running */
+std::atomic<bool> mClosePending(false);
+/* a post-init command got no answer, the NFCC is being reset */
+std::atomic<bool> mPostInitTimeout(false);
+
+/* PROP_NFC_MODE_SET_CMD timer at close, HAL_WRAPPER_TIMEOUT_EVT then closes */
+#define HAL_WRAPPER_CLOSE_TIMER_MS 100
+/* max. wait at close if the HAL Core thread reports neither answer nor timer */
+#define HAL_WRAPPER_CLOSE_TIMEOUT_MS 500
 
 void wait_ready() {
   pthread_mutex_lock(&mutex);
@@ -88,6 +112,198 @@ void set_ready(bool ready) {
   pthread_mutex_unlock(&mutex);
 }
 
+/**
+ * Initialize close_cond, once.
+ */
+static void halWrapperCloseCondInit() {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&close_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Let hal_wrapper_close go on, the NFCC has answered the mode change or the
+ * close timer has expired.
+ */
+static void halWrapperCloseDone() {
+  pthread_once(&closeCondOnce, halWrapperCloseCondInit);
+  mClosePending = false;
+  pthread_mutex_lock(&mutex);
+  mCloseDone = true;
+  pthread_cond_signal(&close_cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Wait for halWrapperCloseDone, or HAL_WRAPPER_CLOSE_TIMEOUT_MS.
+ * @return false on timeout
+ */
+static bool halWrapperWaitCloseDone() {
+  struct timespec deadline;
+  int ret = 0;
+
+  pthread_once(&closeCondOnce, halWrapperCloseCondInit);
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += HAL_WRAPPER_CLOSE_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (HAL_WRAPPER_CLOSE_TIMEOUT_MS % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&mutex);
+  while (!mCloseDone && (ret != ETIMEDOUT)) {
+    ret = pthread_cond_timedwait(&close_cond, &mutex, &deadline);
+  }
+  bool done = mCloseDone;
+  pthread_mutex_unlock(&mutex);
+  return done;
+}
+
+/* Upstream data delivery stage, see STNFC_HAL_DATA_THREAD */
+#define HAL_WRAPPER_DATA_QUEUE_SIZE 16
+#define HAL_WRAPPER_DATA_FRAME_SIZE 258 /* NCI header + max payload */
+
+typedef struct {
+  uint16_t length;
+  uint8_t data[HAL_WRAPPER_DATA_FRAME_SIZE];
+} HalWrapperDataFrame;
+
+static HalWrapperDataFrame mDataFrames[HAL_WRAPPER_DATA_QUEUE_SIZE];
+static HalRing<HalWrapperDataFrame*> mDataFree;
+static HalRing<HalWrapperDataFrame*> mDataPending;
+static sem_t mDataFreeSem;    // frames in mDataFree
+static sem_t mDataPendingSem; // frames in mDataPending, + 1 to stop
+static pthread_t mDataThread;
+static bool mDataThreadRunning = false;
+static uint32_t mDataFrameCount;
+static uint32_t mDataMaxDepth;
+static uint32_t mDataStalls;
+
+/**
+ * Deliver the queued frames to the stack, in order, until stopped.
+ * The frames queued before the stop request are all delivered.
+ */
+static void* halWrapperDataThread(void* arg) {
+  HalWrapperDataFrame* frame;
+  (void)arg;
+
+  for (;;) {
+    while (sem_wait(&mDataPendingSem) != 0) {
+    }
+    if (!mDataPending.pop(&frame)) {
+      // Stop request, posted after the last frame
+      break;
+    }
+    mHalWrapperDataCallback(frame->length, frame->data);
+    mDataFree.push(frame);
+    sem_post(&mDataFreeSem);
+  }
+  return NULL;
+}
+
+/**
+ * Start the data delivery thread if STNFC_HAL_DATA_THREAD is set, before
+ * HAL Core forwards anything.
+ */
+static void halWrapperDataThreadStart() {
+  if (mDataThreadRunning ||
+      (HalConfigNum<HAL_CFG_STNFC_HAL_DATA_THREAD>() == 0)) {
+    return;
+  }
+
+  if (!mDataFree.init(HAL_WRAPPER_DATA_QUEUE_SIZE) ||
+      !mDataPending.init(HAL_WRAPPER_DATA_QUEUE_SIZE)) {
+    STLOG_HAL_E("%s - unable to allocate the data queue", __func__);
+    mDataFree.release();
+    mDataPending.release();
+    return;
+  }
+  for (int i = 0; i < HAL_WRAPPER_DATA_QUEUE_SIZE; i++) {
+    mDataFree.push(&mDataFrames[i]);
+  }
+  sem_init(&mDataFreeSem, 0, HAL_WRAPPER_DATA_QUEUE_SIZE);
+  sem_init(&mDataPendingSem, 0, 0);
+  mDataFrameCount = 0;
+  mDataMaxDepth = 0;
+  mDataStalls = 0;
+
+  if (pthread_create(&mDataThread, NULL, halWrapperDataThread, NULL) != 0) {
+    STLOG_HAL_E("%s - unable to start the data thread, delivering inline",
+                __func__);
+    sem_destroy(&mDataFreeSem);
+    sem_destroy(&mDataPendingSem);
+    mDataFree.release();
+    mDataPending.release();
+    return;
+  }
+  mDataThreadRunning = true;
+}
+
+/**
+ * Stop the data delivery thread once HAL Core is stopped, after it has
+ * delivered the frames still queued.
+ */
+static void halWrapperDataThreadStop() {
+  if (!mDataThreadRunning) {
+    return;
+  }
+
+  sem_post(&mDataPendingSem);
+  pthread_join(mDataThread, NULL);
+  mDataThreadRunning = false;
+
+  STLOG_HAL_D("%s - %u frames, max queue depth %u, %u waits for room",
+              __func__, mDataFrameCount, mDataMaxDepth, mDataStalls);
+  sem_destroy(&mDataFreeSem);
+  sem_destroy(&mDataPendingSem);
+  mDataFree.release();
+  mDataPending.release();
+}
+
+/**
+ * Forward a frame to the stack: queued for the data thread if it runs, so
+ * HAL Core does not wait for the stack, delivered right away otherwise.
+ * Called from the HAL Core thread only.
+ * @param data_len Size of the frame
+ * @param p_data Frame, only valid during the call
+ */
+static void halWrapperForwardData(uint16_t data_len, uint8_t* p_data) {
+  HalWrapperDataFrame* frame;
+  int depth;
+
+  if (!mDataThreadRunning) {
+    mHalWrapperDataCallback(data_len, p_data);
+    return;
+  }
+  if (data_len > HAL_WRAPPER_DATA_FRAME_SIZE) {
+    STLOG_HAL_E("%s - frame of %u bytes dropped", __func__, data_len);
+    return;
+  }
+
+  if (sem_trywait(&mDataFreeSem) != 0) {
+    // All frames wait for the stack
+    mDataStalls++;
+    while (sem_wait(&mDataFreeSem) != 0) {
+    }
+  }
+  mDataFree.pop(&frame);
+  frame->length = data_len;
+  memcpy(frame->data, p_data, data_len);
+  mDataPending.push(frame);
+  sem_post(&mDataPendingSem);
+
+  mDataFrameCount++;
+  sem_getvalue(&mDataFreeSem, &depth);
+  depth = HAL_WRAPPER_DATA_QUEUE_SIZE - depth;
+  if ((uint32_t)depth > mDataMaxDepth) {
+    mDataMaxDepth = depth;
+  }
+}
+
 bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
                       nfc_stack_data_callback_t* p_data_cback,
                       HALHANDLE* pHandle) {
@@ -99,7 +315,7 @@ bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
   mRetryFwDwl = 5;
   mFwUpdateTaskMask = 0;
 
-  mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
+  halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
   mHciCreditLent = false;
   mReadFwConfigDone = false;
   mError_count = 0;
@@ -110,32 +326,52 @@ bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
   dev->p_data_cback = halWrapperDataCallback;
   dev->p_cback = halWrapperCallback;
 
+  halWrapperDataThreadStart();
   result = I2cOpenLayer(dev, HalCoreCallback, pHandle);
 
   if (!result || !(*pHandle)) {
+    halWrapperDataThreadStop();
     return -1;  // We are doomed, stop it here, NOW !
   }
 
   mHalHandle = *pHandle;
 
+  // The NFCC boots meanwhile
+  HalConfigSaveCache();
+
   return 1;
 }
 
 int hal_wrapper_close(int call_cb, int nfc_mode) {
   STLOG_HAL_V("%s - Sending PROP_NFC_MODE_SET_CMD(%d)", __func__, nfc_mode);
   uint8_t propNfcModeSetCmdQb[] = {0x2f, 0x02, 0x02, 0x02, (uint8_t)nfc_mode};
+  struct timespec start;
 
-  mHalWrapperState = HAL_WRAPPER_STATE_CLOSING;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&mutex);
+  mCloseDone = false;
+  pthread_mutex_unlock(&mutex);
+  mClosePending = true;
+
+  halWrapperSetState(HAL_WRAPPER_STATE_CLOSING);
   // Send PROP_NFC_MODE_SET_CMD
   if (!HalSendDownstreamTimer(mHalHandle, propNfcModeSetCmdQb,
-                              sizeof(propNfcModeSetCmdQb), 100)) {
+                              sizeof(propNfcModeSetCmdQb),
+                              HAL_WRAPPER_CLOSE_TIMER_MS)) {
     STLOG_HAL_E("NFC-NCI HAL: %s  HalSendDownstreamTimer failed", __func__);
+    mClosePending = false;
     return -1;
   }
-  // Let the CLF receive and process this
-  usleep(50000);
+  // Let the CLF receive and process this, until its answer or the timer
+  if (!halWrapperWaitCloseDone()) {
+    STLOG_HAL_E("NFC-NCI HAL: %s  no answer nor timeout, close anyway",
+                __func__);
+    mClosePending = false;
+  }
+  HalLatencyRecord(HAL_LATENCY_CLOSE, &start);
 
   I2cCloseLayer();
+  halWrapperDataThreadStop();
   if (call_cb) mHalWrapperCallback(HAL_NFC_CLOSE_CPLT_EVT, HAL_NFC_STATUS_OK);
 
   return 1;
@@ -148,17 +384,19 @@ void hal_wrapper_send_core_config_prop() {
   // allocate buffer for setting parameters
   ConfigBuffer = (uint8_t*)malloc(256 * sizeof(uint8_t));
   if (ConfigBuffer != NULL) {
-    isfound = GetByteArrayValue(NAME_CORE_CONF_PROP, (char*)ConfigBuffer, 256,
-                                &retlen);
+    isfound =
+        HalConfigBytes<HAL_CFG_CORE_CONF_PROP>(ConfigBuffer, 256, &retlen);
 
-    if (isfound > 0) {
+    // retlen is -1 if the value does not fit
+    if ((isfound > 0) && (retlen >= 0)) {
       STLOG_HAL_V("%s - Enter", __func__);
       set_ready(0);
+      // Before sending, the response may come back at once
+      halWrapperSetState(HAL_WRAPPER_STATE_PROP_CONFIG);
 
       if (!HalSendDownstreamTimer(mHalHandle, ConfigBuffer, retlen, 500)) {
         STLOG_HAL_E("NFC-NCI HAL: %s  SendDownstream failed", __func__);
       }
-      mHalWrapperState = HAL_WRAPPER_STATE_PROP_CONFIG;
       wait_ready();
     }
     free(ConfigBuffer);
@@ -169,18 +407,23 @@ void hal_wrapper_send_core_config_prop() {
 void hal_wrapper_send_vs_config() {
   STLOG_HAL_V("%s - Enter", __func__);
   set_ready(0);
+  // Before sending, the response may come back at once
+  mReadFwConfigDone = true;
 
   if (!HalSendDownstreamTimer(mHalHandle, nciPropGetFwDbgTracesConfig,
                               sizeof(nciPropGetFwDbgTracesConfig), 500)) {
     STLOG_HAL_E("%s - SendDownstream failed", __func__);
   }
-  mReadFwConfigDone = true;
   wait_ready();
 }
 
 void hal_wrapper_send_config() {
+  mPostInitTimeout = false;
   hal_wrapper_send_core_config_prop();
-  mHalWrapperState = HAL_WRAPPER_STATE_PROP_CONFIG;
+  if (mPostInitTimeout) {
+    return;
+  }
+  halWrapperSetState(HAL_WRAPPER_STATE_PROP_CONFIG);
   hal_wrapper_send_vs_config();
 }
 
@@ -194,6 +437,15 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
   uint8_t coreResetCmd[] = {0x20, 0x00, 0x01, 0x01};
   unsigned long num = 0;
 
+  if (mClosePending && (data_len >= 2) && (p_data[0] == 0x4f) &&
+      (p_data[1] == 0x02)) {
+    // Answer to the PROP_NFC_MODE_SET_CMD of hal_wrapper_close, don t forward
+    HalSendDownstreamStopTimer(mHalHandle);
+    halWrapperSetState(HAL_WRAPPER_STATE_CLOSED);
+    halWrapperCloseDone();
+    return;
+  }
+
   switch (mHalWrapperState) {
     case HAL_WRAPPER_STATE_CLOSED:  // 0
       STLOG_HAL_V("%s - mHalWrapperState = HAL_WRAPPER_STATE_CLOSED", __func__);
@@ -237,14 +489,14 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                                         FW_TIMER_DURATION)) {
               STLOG_HAL_E("%s - SendDownstream failed", __func__);
             }
-            mHalWrapperState = HAL_WRAPPER_STATE_UPDATE;
+            halWrapperSetState(HAL_WRAPPER_STATE_UPDATE);
           }
         } else if (mFwUpdateTaskMask == 0 || mRetryFwDwl == 0) {
           STLOG_HAL_V("%s - Proceeding with normal startup", __func__);
           if (p_data[3] == 0x01) {
             // Normal mode, start HAL
             mHalWrapperCallback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_OK);
-            mHalWrapperState = HAL_WRAPPER_STATE_OPEN_CPLT;
+            halWrapperSetState(HAL_WRAPPER_STATE_OPEN_CPLT);
           } else {
             // No more retries or CLF not in correct mode
             mHalWrapperCallback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_FAILED);
@@ -262,18 +514,18 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                                    sizeof(coreResetCmd))) {
               STLOG_HAL_E("%s - SendDownstream failed", __func__);
             }
-            mHalWrapperState = HAL_WRAPPER_STATE_EXIT_HIBERNATE_INTERNAL;
+            halWrapperSetState(HAL_WRAPPER_STATE_EXIT_HIBERNATE_INTERNAL);
           } else if ((mFwUpdateTaskMask & CONF_UPDATE_NEEDED) &&
                      (mFwUpdateResMask & FW_CUSTOM_PARAM_AVAILABLE)) {
             if (!HalSendDownstream(mHalHandle, coreResetCmd,
                                    sizeof(coreResetCmd))) {
               STLOG_HAL_E("%s - SendDownstream failed", __func__);
             }
-            mHalWrapperState = HAL_WRAPPER_STATE_APPLY_CUSTOM_PARAM;
+            halWrapperSetState(HAL_WRAPPER_STATE_APPLY_CUSTOM_PARAM);
           }
         }
       } else {
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperForwardData(data_len, p_data);
       }
       break;
     case HAL_WRAPPER_STATE_OPEN_CPLT:  // 2
@@ -289,9 +541,9 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
           STLOG_HAL_E("NFC-NCI HAL: %s  HalSendDownstreamTimer failed",
                       __func__);
         }
-        mHalWrapperState = HAL_WRAPPER_STATE_NFC_ENABLE_ON;
+        halWrapperSetState(HAL_WRAPPER_STATE_NFC_ENABLE_ON);
       } else {
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperForwardData(data_len, p_data);
       }
       break;
 
@@ -323,8 +575,8 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
           mHciCreditLent = true;
         }
 
-        mHalWrapperState = HAL_WRAPPER_STATE_READY;
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperSetState(HAL_WRAPPER_STATE_READY);
+        halWrapperForwardData(data_len, p_data);
       }
       break;
 
@@ -352,19 +604,18 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
             }
           }
         }
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperForwardData(data_len, p_data);
       } else if (p_data[0] == 0x4f) {
         // PROP_RSP
         if (mReadFwConfigDone == true) {
           mReadFwConfigDone = false;
           HalSendDownstreamStopTimer(mHalHandle);
-          set_ready(1);
           // NFC_STATUS_OK
           if (p_data[3] == 0x00) {
             bool confNeeded = false;
 
             // Check if FW DBG shall be set
-            if (GetNumValue(NAME_STNFC_FW_DEBUG_ENABLED, &num, sizeof(num))) {
+            if (HalConfigNum<HAL_CFG_STNFC_FW_DEBUG_ENABLED>(&num)) {
               // If conf file indicate set needed and not yet enabled
               if ((num == 1) && (p_data[7] == 0x00)) {
                 STLOG_HAL_D("%s - FW DBG traces enabling needed", __func__);
@@ -385,8 +636,10 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                        p_data[6] - 1);
                 confNeeded = false;
 
-                if (!HalSendDownstream(mHalHandle, nciPropEnableFwDbgTraces,
-                                       sizeof(nciPropEnableFwDbgTraces))) {
+                if (!HalSendDownstreamTimer(mHalHandle,
+                                            nciPropEnableFwDbgTraces,
+                                            sizeof(nciPropEnableFwDbgTraces),
+                                            500)) {
                   STLOG_HAL_E("%s - SendDownstream failed", __func__);
                 }
 
@@ -397,8 +650,11 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
         }
 
         // Exit state, all processing done
+        HalSendDownstreamStopTimer(mHalHandle);  // FW DBG config, if sent
         mHalWrapperCallback(HAL_NFC_POST_INIT_CPLT_EVT, HAL_NFC_STATUS_OK);
-        mHalWrapperState = HAL_WRAPPER_STATE_READY;
+        halWrapperSetState(HAL_WRAPPER_STATE_READY);
+        // hal_wrapper_send_config returns once READY, FW DBG config included
+        set_ready(1);
       }
       break;
 
@@ -422,12 +678,12 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
         } else if ((p_data[0] == 0x6f) && (p_data[1] == 0x05)) {
           // start timer
           mTimerStarted = true;
-          HalSendDownstreamTimer(mHalHandle, 1000);
+          HalStartTimerId(mHalHandle, HAL_TIMER_ID_RF_WATCHDOG, 1000);
           mIsActiveRW = true;
         } else if ((p_data[0] == 0x6f) && (p_data[1] == 0x06)) {
           // stop timer
           if (mTimerStarted) {
-            HalSendDownstreamStopTimer(mHalHandle);
+            HalStopTimerId(mHalHandle, HAL_TIMER_ID_RF_WATCHDOG);
             mTimerStarted = false;
           }
           if(mIsActiveRW == true) {
@@ -438,8 +694,9 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
             if(mError_count > 20) {
               mError_count = 0;
               STLOG_HAL_E("NFC Recovery Start");
+              HalRecorderDump("NFC recovery");
               mTimerStarted = true;
-              HalSendDownstreamTimer(mHalHandle, 1);
+              HalStartTimerId(mHalHandle, HAL_TIMER_ID_RF_WATCHDOG, 1);
             }
           }
         } else if (((p_data[0] == 0x61) && (p_data[1] == 0x05)) ||
@@ -447,14 +704,14 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
           mError_count = 0;
           // stop timer
           if (mTimerStarted) {
-            HalSendDownstreamStopTimer(mHalHandle);
+            HalStopTimerId(mHalHandle, HAL_TIMER_ID_RF_WATCHDOG);
             mTimerStarted = false;
           }
         }
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperForwardData(data_len, p_data);
       } else if (forceRecover == true) {
         forceRecover = false;
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperForwardData(data_len, p_data);
       } else {
         STLOG_HAL_V("%s - Core reset notification - Nfc mode ", __func__);
       }
@@ -465,9 +722,9 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                   __func__);
       if ((p_data[0] == 0x4f) && (p_data[1] == 0x02)) {
         // intercept this expected message, don t forward.
-        mHalWrapperState = HAL_WRAPPER_STATE_CLOSED;
+        halWrapperSetState(HAL_WRAPPER_STATE_CLOSED);
       } else {
-        mHalWrapperDataCallback(data_len, p_data);
+        halWrapperForwardData(data_len, p_data);
       }
       break;
 
@@ -495,6 +752,30 @@ static void halWrapperCallback(uint8_t event, uint8_t event_status) {
   uint8_t coreInitCmd[] = {0x20, 0x01, 0x02, 0x00, 0x00};
   uint8_t propNfcModeSetCmdOn[] = {0x2f, 0x02, 0x02, 0x02, 0x01};
 
+  if ((event == HAL_WRAPPER_TIMEOUT_EVT) &&
+      (event_status == HAL_TIMER_ID_RF_WATCHDOG)) {
+    // RF activity watchdog, runs next to the command timer
+    if ((mHalWrapperState == HAL_WRAPPER_STATE_READY) && mTimerStarted) {
+      STLOG_HAL_D("NFC-NCI HAL: %s  Timeout.. Recover", __func__);
+      HalRecorderDump("RF watchdog recovery");
+      mTimerStarted = false;
+      forceRecover = true;
+      if (!HalSendDownstream(mHalHandle, propNfcModeSetCmdOn,
+                             sizeof(propNfcModeSetCmdOn))) {
+        STLOG_HAL_E("NFC-NCI HAL: %s  SendDownstream failed", __func__);
+      }
+    }
+    return;
+  }
+
+  if ((event == HAL_WRAPPER_TIMEOUT_EVT) && mClosePending) {
+    STLOG_HAL_W("NFC-NCI HAL: %s  No answer to mode set. Close anyway",
+                __func__);
+    halWrapperSetState(HAL_WRAPPER_STATE_CLOSED);
+    halWrapperCloseDone();
+    return;
+  }
+
   switch (mHalWrapperState) {
     case HAL_WRAPPER_STATE_CLOSED:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
@@ -508,10 +789,11 @@ static void halWrapperCallback(uint8_t event, uint8_t event_status) {
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_E("%s - Timer for FW update procedure timeout, retry",
                     __func__);
+        HalRecorderDump("FW update timeout");
         HalSendDownstreamStopTimer(mHalHandle);
         resetHandlerState();
         I2cResetPulse();
-        mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
+        halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
       }
       break;
 
@@ -532,22 +814,17 @@ static void halWrapperCallback(uint8_t event, uint8_t event_status) {
         HalSendDownstreamStopTimer(mHalHandle);
         resetHandlerState();
         I2cResetPulse();
-        mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
+        halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
+        // Don't leave hal_wrapper_send_config waiting for the answer
+        mReadFwConfigDone = false;
+        mPostInitTimeout = true;
+        set_ready(1);
       }
       break;
 
     case HAL_WRAPPER_STATE_READY:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
-        if (mTimerStarted) {
-          STLOG_HAL_D("NFC-NCI HAL: %s  Timeout.. Recover", __func__);
-          HalSendDownstreamStopTimer(mHalHandle);
-          mTimerStarted = false;
-          forceRecover = true;
-          if (!HalSendDownstream(mHalHandle, propNfcModeSetCmdOn,
-                                 sizeof(propNfcModeSetCmdOn))) {
-            STLOG_HAL_E("NFC-NCI HAL: %s  SendDownstream failed", __func__);
-          }
-        }
+        // Command timer, the RF watchdog is handled above
         return;
       }
       break;
@@ -569,7 +846,26 @@ static void halWrapperCallback(uint8_t event, uint8_t event_status) {
  **
  *******************************************************************************/
 void hal_wrapper_set_state(hal_wrapper_state_e new_wrapper_state) {
-  ALOGD("nfc_set_state %d->%d", mHalWrapperState, new_wrapper_state);
+  ALOGD("nfc_set_state %d->%d", (int)mHalWrapperState.load(),
+        new_wrapper_state);
+
+  halWrapperSetState(new_wrapper_state);
+}
 
-  mHalWrapperState = new_wrapper_state;
+/*******************************************************************************
+ **
+ ** Function         halWrapperSetState
+ **
+ ** Description      Change the wrapper state, recording the transition
+ **
+ ** Returns          void
+ **
+ *******************************************************************************/
+static void halWrapperSetState(hal_wrapper_state_e state) {
+  // One step, the caller thread and HAL Core both change the state
+  hal_wrapper_state_e old = mHalWrapperState.exchange(state);
+
+  if (old != state) {
+    HalRecorderEvent(HAL_REC_STATE, old, state);
+  }
 }
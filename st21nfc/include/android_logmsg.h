@@ -37,6 +37,9 @@ extern int GetNumValue(const char* name, void* p_value, unsigned long len);
 extern int GetByteArrayValue(const char* name, char* pValue, long bufflen,
                              long* len);
 extern int GetStrValue(const char* name, char* pValue, unsigned long l);
+/* called from the config reload thread, must not add listeners */
+typedef void (*ConfigListener)(const char* name);
+extern void AddConfigListener(const char* name, ConfigListener listener);
 
 /* #######################
  * Set the log module name in .conf file
@@ -49,6 +52,20 @@ extern int GetStrValue(const char* name, char* pValue, unsigned long l);
 #define NAME_STNFC_FW_BIN_NAME "STNFC_FW_BIN_NAME"
 #define NAME_STNFC_FW_DEBUG_ENABLED "STNFC_FW_DEBUG_ENABLED"
 #define NAME_CORE_CONF_PROP "CORE_CONF_PROP"
+#define NAME_STNFC_HAL_REACTOR_MODE "STNFC_HAL_REACTOR_MODE"
+#define NAME_STNFC_HAL_RX_QUEUE_DEPTH "STNFC_HAL_RX_QUEUE_DEPTH"
+#define NAME_STNFC_HAL_RX_BATCH "STNFC_HAL_RX_BATCH"
+#define NAME_STNFC_HAL_DATA_THREAD "STNFC_HAL_DATA_THREAD"
+#define NAME_STNFC_HAL_TX_POOL_SIZE "STNFC_HAL_TX_POOL_SIZE"
+#define NAME_STNFC_HAL_TX_OVERFLOW_POLICY "STNFC_HAL_TX_OVERFLOW_POLICY"
+#define NAME_STNFC_I2C_WRITE_RETRIES "STNFC_I2C_WRITE_RETRIES"
+#define NAME_STNFC_I2C_WRITE_RETRY_DELAY "STNFC_I2C_WRITE_RETRY_DELAY"
+#define NAME_STNFC_I2C_WRITE_BACKOFF_ROUNDS "STNFC_I2C_WRITE_BACKOFF_ROUNDS"
+#define NAME_STNFC_I2C_WRITE_BACKOFF_DELAY "STNFC_I2C_WRITE_BACKOFF_DELAY"
+#define NAME_STNFC_I2C_READ_CHUNK "STNFC_I2C_READ_CHUNK"
+#define NAME_STNFC_HAL_TRACE_DEFERRED "STNFC_HAL_TRACE_DEFERRED"
+#define NAME_STNFC_HAL_RECORDER_SECONDS "STNFC_HAL_RECORDER_SECONDS"
+#define NAME_STNFC_HAL_CONFIG_RELOAD "STNFC_HAL_CONFIG_RELOAD"
 
 /* #######################
  * Set the logging level
@@ -103,6 +120,8 @@ extern int GetStrValue(const char* name, char* pValue, unsigned long l);
 unsigned char InitializeSTLogLevel();
 
 void DispHal(const char* title, const void* data, size_t length);
+void DispHalFlush();
+bool DispHalPrivate(const void* data, size_t length);
 
 #ifdef __cplusplus
 };
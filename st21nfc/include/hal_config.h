@@ -20,6 +20,11 @@
 #ifndef __CONFIG_H
 #define __CONFIG_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "android_logmsg.h"
+
 #define NAME_STNFC_HAL_LOGLEVEL "STNFC_HAL_LOGLEVEL"
 #define NAME_POLL_BAIL_OUT_MODE "POLL_BAIL_OUT_MODE"
 #define NAME_ISO_DEP_MAX_TRANSCEIVE "ISO_DEP_MAX_TRANSCEIVE"
@@ -43,4 +48,174 @@
 #define NAME_STNFC_USB_CHARGING_MODE "STNFC_USB_CHARGING_MODE"
 #define NAME_CORE_CONF_PROP "CORE_CONF_PROP"
 
+/* setting types */
+#define HAL_CONFIG_NUM 0   /* number, or a byte array of up to 3 bytes */
+#define HAL_CONFIG_STR 1   /* quoted string */
+#define HAL_CONFIG_BYTES 2 /* byte array */
+
+/*
+ * Settings known at build time: X(name, type, default), the name being the
+ * one of the NAME_ macro without its prefix. The default is returned by the
+ * accessors below when the setting is absent, it is ignored for byte arrays.
+ */
+#define HAL_CONFIG_KEYS(X)                                   \
+  X(STNFC_HAL_LOGLEVEL, NUM, 1)                              \
+  X(STNFC_HAL_TRACE_DEFERRED, NUM, 1)                        \
+  X(STNFC_HAL_RECORDER_SECONDS, NUM, 10)                     \
+  X(STNFC_HAL_CONFIG_RELOAD, NUM, 1)                         \
+  X(STNFC_FW_PATH_STORAGE, STR, "/vendor/firmware")          \
+  X(STNFC_FW_BIN_NAME, STR, "/st21nfc_fw.bin")               \
+  X(STNFC_FW_CONF_NAME, STR, "/st21nfc_conf.bin")            \
+  X(STNFC_FW_DEBUG_ENABLED, NUM, 0)                          \
+  X(CORE_CONF_PROP, BYTES, nullptr)                          \
+  X(STNFC_HAL_REACTOR_MODE, NUM, 0)                          \
+  X(STNFC_HAL_RX_QUEUE_DEPTH, NUM, 4)                        \
+  X(STNFC_HAL_RX_BATCH, NUM, 0)                              \
+  X(STNFC_HAL_DATA_THREAD, NUM, 0)                           \
+  X(STNFC_HAL_TX_POOL_SIZE, NUM, 10)                         \
+  X(STNFC_HAL_TX_OVERFLOW_POLICY, NUM, 0)                    \
+  X(STNFC_I2C_WRITE_RETRIES, NUM, 3)                         \
+  X(STNFC_I2C_WRITE_RETRY_DELAY, NUM, 4)                     \
+  X(STNFC_I2C_WRITE_BACKOFF_ROUNDS, NUM, 10)                 \
+  X(STNFC_I2C_WRITE_BACKOFF_DELAY, NUM, 500)                 \
+  X(STNFC_I2C_READ_CHUNK, NUM, 0)                            \
+  X(CE_ON_SWITCH_OFF_STATE, NUM, 0)                          \
+  X(POLL_BAIL_OUT_MODE, NUM, 0)                              \
+  X(ISO_DEP_MAX_TRANSCEIVE, NUM, 0)                          \
+  X(DEFAULT_ROUTE, NUM, 0)                                   \
+  X(DEFAULT_OFFHOST_ROUTE, NUM, 0)                           \
+  X(DEFAULT_NFCF_ROUTE, NUM, 0)                              \
+  X(DEFAULT_SYS_CODE_ROUTE, NUM, 0)                          \
+  X(DEFAULT_SYS_CODE_PWR_STATE, NUM, 0)                      \
+  X(DEFAULT_ISODEP_ROUTE, NUM, 0)                            \
+  X(DEVICE_HOST_WHITE_LIST, BYTES, nullptr)                  \
+  X(OFF_HOST_ESE_PIPE_ID, NUM, 0)                            \
+  X(OFF_HOST_SIM_PIPE_ID, NUM, 0)                            \
+  X(NFA_PROPRIETARY_CFG, BYTES, nullptr)                     \
+  X(PRESENCE_CHECK_ALGORITHM, NUM, 0)                        \
+  X(OFFHOST_ROUTE_UICC, BYTES, nullptr)                      \
+  X(OFFHOST_ROUTE_ESE, BYTES, nullptr)                       \
+  X(STNFC_USB_CHARGING_MODE, NUM, 0)
+
+/* HAL_CFG_<name>, index of the setting in each config snapshot */
+typedef enum {
+#define HAL_CONFIG_ENUM(name, type, def) HAL_CFG_##name,
+  HAL_CONFIG_KEYS(HAL_CONFIG_ENUM)
+#undef HAL_CONFIG_ENUM
+  HAL_CFG_KEY_COUNT
+} HalConfigKey;
+
+/* FNV-1a hash of a setting name, the one used by the config index */
+constexpr uint32_t HalConfigHash(const char* name) {
+  uint32_t hash = 2166136261u;
+
+  while (*name != '\0') {
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* name, hash, type and default of a setting, all known at build time */
+template <HalConfigKey K>
+struct HalConfigKeyInfo;
+#define HAL_CONFIG_INFO(name, type, def)                           \
+  template <>                                                      \
+  struct HalConfigKeyInfo<HAL_CFG_##name> {                        \
+    static constexpr const char* kName = NAME_##name;              \
+    static constexpr uint32_t kHash = HalConfigHash(NAME_##name);  \
+    static constexpr int kType = HAL_CONFIG_##type;                \
+    static constexpr auto kDefault = def;                          \
+  };
+HAL_CONFIG_KEYS(HAL_CONFIG_INFO)
+#undef HAL_CONFIG_INFO
+
+/**
+ * Read a setting of the current config snapshot, by its index. These are
+ * the implementation of the accessors below, which check the type.
+ * @return true if the setting is present with a value of that type
+ */
+bool HalConfigGetNum(HalConfigKey key, unsigned long* value);
+bool HalConfigGetStr(HalConfigKey key, char* buffer, size_t size);
+bool HalConfigGetBytes(HalConfigKey key, uint8_t* buffer, size_t size,
+                       long* length);
+
+/**
+ * Generation of the current config snapshot, it changes each time the files
+ * are reloaded or an optional file is read. Values derived from the settings
+ * can be kept until it changes.
+ */
+uint32_t HalConfigGeneration();
+
+/**
+ * Save the compiled form of the base config file if it had to be parsed, so
+ * that the next start maps it instead. Called at HAL open rather than on the
+ * first lookup, which must not wait for storage.
+ */
+void HalConfigSaveCache();
+
+/**
+ * Read the config files from dir instead of /odm/etc, /vendor/etc or /etc,
+ * for the tests and benchmarks. The optional files read so far are dropped.
+ * @param dir Directory, ending with '/'
+ */
+void HalConfigSetDir(const char* dir);
+
+/**
+ * Read a numerical setting, like GetNumValue.
+ * @param value Set to the value if the setting is present
+ * @return true if the setting is present
+ */
+template <HalConfigKey K>
+inline bool HalConfigNum(unsigned long* value) {
+  static_assert(HalConfigKeyInfo<K>::kType == HAL_CONFIG_NUM,
+                "not a numerical setting");
+  return HalConfigGetNum(K, value);
+}
+
+/**
+ * Read a numerical setting.
+ * @return the value, or the default if the setting is absent
+ */
+template <HalConfigKey K>
+inline unsigned long HalConfigNum() {
+  unsigned long value;
+
+  if (!HalConfigNum<K>(&value)) {
+    value = HalConfigKeyInfo<K>::kDefault;
+  }
+  return value;
+}
+
+/**
+ * Read a string setting, like GetStrValue.
+ * @param buffer Set to the value, or to the default if the setting is absent
+ * @param size Size of buffer
+ * @return true if the setting is present
+ */
+template <HalConfigKey K>
+inline bool HalConfigStr(char* buffer, size_t size) {
+  static_assert(HalConfigKeyInfo<K>::kType == HAL_CONFIG_STR,
+                "not a string setting");
+  if (HalConfigGetStr(K, buffer, size)) {
+    return true;
+  }
+  snprintf(buffer, size, "%s", HalConfigKeyInfo<K>::kDefault);
+  return false;
+}
+
+/**
+ * Read a byte array setting, like GetByteArrayValue.
+ * @param buffer Set to the value
+ * @param size Size of buffer
+ * @param length Set to the size of the value, -1 if buffer is too small
+ * @return true if the setting is present
+ */
+template <HalConfigKey K>
+inline bool HalConfigBytes(uint8_t* buffer, size_t size, long* length) {
+  static_assert(HalConfigKeyInfo<K>::kType == HAL_CONFIG_BYTES,
+                "not a byte array setting");
+  return HalConfigGetBytes(K, buffer, size, length);
+}
+
 #endif
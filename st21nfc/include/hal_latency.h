@@ -0,0 +1,49 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef __HAL_LATENCY_H_
+#define __HAL_LATENCY_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/* measured paths */
+#define HAL_LATENCY_TX 0       /* StNfc_hal_write to transport write */
+#define HAL_LATENCY_RX 1       /* hand-over by the I2C layer to p_data_cback */
+#define HAL_LATENCY_OPEN 2     /* StNfc_hal_open to HAL_NFC_OPEN_CPLT_EVT */
+#define HAL_LATENCY_EVENT 3    /* event posted to its delivery to the stack */
+#define HAL_LATENCY_UPSTREAM 4 /* HAL Core busy with p_data_cback */
+#define HAL_LATENCY_CLOSE 5    /* hal_wrapper_close to the NFCC's answer */
+#define HAL_LATENCY_PATH_MAX 6
+
+/**
+ * Account one sample of a path, from the given start until now.
+ * Lock-free, may be called from any thread.
+ * @param path HAL_LATENCY_*
+ * @param start CLOCK_MONOTONIC time the path was entered
+ */
+void HalLatencyRecord(uint32_t path, const struct timespec* start);
+
+/**
+ * Log the sample count, p50/p99/p999 and max of every path with samples,
+ * one "latency path=<name> count=<n> p50_us=<us> ..." line each.
+ * The histograms cover the whole process lifetime.
+ */
+void HalLatencyReport();
+
+#endif
@@ -0,0 +1,64 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef __HAL_RECORDER_H_
+#define __HAL_RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* flight recorder entries */
+#define HAL_REC_TX 0            /* NCI frame to the NFCC */
+#define HAL_REC_RX 1            /* NCI frame from the NFCC */
+#define HAL_REC_TIMER_START 2   /* arg0: timer ID, arg1: duration in ms */
+#define HAL_REC_TIMER_STOP 3    /* arg0: timer ID */
+#define HAL_REC_TIMER_EXPIRED 4 /* arg0: timer ID */
+#define HAL_REC_STATE 5         /* arg0: old, arg1: new wrapper state */
+
+/**
+ * Read the recorder settings (STNFC_HAL_RECORDER_SECONDS).
+ */
+void HalRecorderInit();
+
+/**
+ * Record an NCI frame. Lock-free, may be called from any thread.
+ * Only the beginning of the frame is kept, and only its header if it falls
+ * under the privacy rules of DispHal.
+ * @param type HAL_REC_TX or HAL_REC_RX
+ * @param data NCI frame
+ * @param length Size of the frame
+ */
+void HalRecorderFrame(uint32_t type, const uint8_t* data, size_t length);
+
+/**
+ * Record an event. Lock-free, may be called from any thread.
+ * @param type HAL_REC_TIMER_* or HAL_REC_STATE
+ * @param arg0 First argument, see the type
+ * @param arg1 Second argument, see the type
+ */
+void HalRecorderEvent(uint32_t type, uint32_t arg0, uint32_t arg1);
+
+/**
+ * Save the recent entries to a file under /data/vendor/nfc. The entries are
+ * copied right away, the file is written by a separate thread, so this never
+ * waits for storage. Ignored while a previous dump is still being written.
+ * @param reason Short static string, written in the file header
+ */
+void HalRecorderDump(const char* reason);
+
+#endif
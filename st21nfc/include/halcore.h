@@ -42,6 +42,7 @@
 
 #define HAL_FLAG_NO_DEBUG 0 /* disable debug output */
 #define HAL_FLAG_DEBUG 1    /* enable debug output */
+#define HAL_FLAG_REACTOR 2  /* no worker thread, see HalReactorDispatch */
 
 typedef enum {
   HAL_WRAPPER_STATE_CLOSED,
@@ -68,18 +69,44 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags);
 
 void HalDestroy(HALHANDLE hHAL);
 
+/* hand all the frames queued so far over to HAL_EVENT_DSWRITE */
+void HalFlushDownstream(HALHANDLE hHAL);
+
 /* send an NCI frame from the HOST to the CLF */
 bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size);
 
+/* same, but give up after timeoutMs if all the TX buffers are in use */
+bool HalTrySendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size,
+                          uint32_t timeoutMs);
+
 // HAL WRAPPER
 bool HalSendDownstreamTimer(HALHANDLE hHAL, const uint8_t* data, size_t size,
                             uint32_t duration);
 bool HalSendDownstreamTimer(HALHANDLE hHAL, uint32_t duration);
 bool HalSendDownstreamStopTimer(HALHANDLE hHAL);
 
+/* HAL timers, HAL_WRAPPER_TIMEOUT_EVT carries the ID of the expired timer as
+ * status */
+#define HAL_TIMER_ID_CMD 0         /* command-response guard (default timer) */
+#define HAL_TIMER_ID_RF_WATCHDOG 1 /* RF activity watchdog of the wrapper */
+#define HAL_TIMER_MAX 32           /* number of timer IDs */
+
+bool HalStartTimerId(HALHANDLE hHAL, uint32_t id, uint32_t duration);
+bool HalStopTimerId(HALHANDLE hHAL, uint32_t id);
+
 /* send a complete HDLC frame from the CLF to the HOST */
 bool HalSendUpstream(HALHANDLE hHAL, const uint8_t* data, size_t size);
 
+/* send up to HAL_RX_BATCH_MAX frames, concatenated in data, in one message */
+#define HAL_RX_BATCH_MAX 8
+bool HalSendUpstreamBatch(HALHANDLE hHAL, const uint8_t* data,
+                          const size_t* lengths, size_t count);
+
+/* reactor mode (HAL_FLAG_REACTOR): fds to poll and dispatch entry-point */
+int HalGetWakeupFd(HALHANDLE hHAL);
+int HalGetTimerFd(HALHANDLE hHAL);
+bool HalReactorDispatch(HALHANDLE hHAL, bool wakeup, bool timer);
+
 void hal_wrapper_set_state(hal_wrapper_state_e new_wrapper_state);
 void I2cResetPulse();
 #endif
@@ -0,0 +1,53 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef __I2CTRANSPORT_H_
+#define __I2CTRANSPORT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Access to the NFCC used by the I2C layer.
+ * open() returns a file descriptor the I2C thread polls for incoming data,
+ * the other functions get it back as their first parameter.
+ * read() and write() follow read(2) and write(2) semantics.
+ * The control functions return 0 (getWakeup: the pin state) or -1 on error.
+ */
+typedef struct {
+  const char* name;
+  int (*open)();
+  void (*close)(int fd);
+  ssize_t (*read)(int fd, uint8_t* buffer, size_t length);
+  ssize_t (*write)(int fd, const uint8_t* buffer, size_t length);
+  int (*getWakeup)(int fd);
+  int (*resetPulse)(int fd);
+  int (*setPolarity)(int fd, bool low, bool edge);
+} I2cTransport;
+
+/* /dev/st21nfc, implemented in i2clayer.cc */
+extern const I2cTransport i2cDeviceTransport;
+
+/* NFCC simulator over a socketpair, implemented in i2csim.cc. Only linked
+ * in the test library libnfc_nci.st21nfc_sim, never in the HAL itself. */
+extern const I2cTransport i2cSimTransport;
+
+/* use another transport at the next open, NULL for /dev/st21nfc */
+void I2cSetTransport(const I2cTransport* t);
+
+#endif
@@ -0,0 +1,310 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2016 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "hal_timer_wheel.h"
+
+/* 1 ms ticks: a level 1 slot covers 64 ticks, a level 2 slot 4096 ticks */
+#define LEVEL1_TICKS (1ULL << HAL_TIMER_WHEEL_BITS)
+#define LEVEL2_TICKS (1ULL << (2 * HAL_TIMER_WHEEL_BITS))
+
+class HalTimerWheelTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    memset(&wheel, 0, sizeof(wheel));
+    memset(timers, 0, sizeof(timers));
+  }
+
+  /* Start at the wheel time, like HalStartTimer does with a fresh wheel */
+  void SetNow(uint64_t now) { wheel.now = now; }
+
+  void Start(uint32_t id, uint64_t expiry) {
+    Timer* t = &timers[id];
+    t->id = id;
+    t->expiry = expiry;
+    t->active = true;
+    wheel.count++;
+    HalTimerWheelInsert(&wheel, t);
+  }
+
+  void Stop(uint32_t id) {
+    Timer* t = &timers[id];
+    ASSERT_TRUE(t->active);
+    HalTimerWheelUnlink(&wheel, t);
+    t->active = false;
+    wheel.count--;
+  }
+
+  /* Advance to now and take the expired timers, in report order */
+  std::vector<uint32_t> Advance(uint64_t now) {
+    std::vector<uint32_t> ids;
+    Timer* t;
+
+    HalTimerWheelAdvance(&wheel, now);
+    while ((t = wheel.expired) != NULL) {
+      HalTimerWheelUnlink(&wheel, t);
+      t->active = false;
+      wheel.count--;
+      ids.push_back(t->id);
+    }
+    return ids;
+  }
+
+  TimerWheel wheel;
+  Timer timers[64];
+};
+
+TEST_F(HalTimerWheelTest, EmptyWheelHasNoExpiry) {
+  uint64_t expiry;
+
+  EXPECT_FALSE(HalTimerWheelNextExpiry(&wheel, &expiry));
+  EXPECT_TRUE(Advance(100000).empty());
+  EXPECT_EQ(100000u, wheel.now);
+}
+
+TEST_F(HalTimerWheelTest, ExpiresInExpiryOrder) {
+  SetNow(1000);
+  Start(1, 1005);
+  Start(2, 1001);
+  Start(3, 1003);
+
+  EXPECT_TRUE(Advance(1000).empty());
+  EXPECT_EQ(std::vector<uint32_t>({2, 3, 1}), Advance(1010));
+  EXPECT_EQ(0u, wheel.count);
+}
+
+TEST_F(HalTimerWheelTest, ExpiresAtItsTickNotBefore) {
+  SetNow(0);
+  Start(1, 10);
+
+  EXPECT_TRUE(Advance(9).empty());
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(10));
+}
+
+TEST_F(HalTimerWheelTest, StoppedTimerDoesNotExpire) {
+  uint64_t expiry;
+
+  SetNow(0);
+  Start(1, 10);
+  Start(2, 20);
+  Stop(1);
+
+  ASSERT_TRUE(HalTimerWheelNextExpiry(&wheel, &expiry));
+  EXPECT_EQ(20u, expiry);
+  EXPECT_EQ(std::vector<uint32_t>({2}), Advance(30));
+
+  Start(3, 5000);
+  Stop(3);
+  EXPECT_FALSE(HalTimerWheelNextExpiry(&wheel, &expiry));
+  EXPECT_TRUE(Advance(10000).empty());
+}
+
+TEST_F(HalTimerWheelTest, RestartMovesTheTimer) {
+  SetNow(0);
+  Start(1, 5000);
+  Stop(1);
+  Start(1, 50);
+
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(100));
+  EXPECT_TRUE(Advance(10000).empty());
+}
+
+TEST_F(HalTimerWheelTest, TimerAlreadyDueGoesToExpiredList) {
+  uint64_t expiry;
+
+  SetNow(100);
+  Start(1, 100);
+  EXPECT_EQ(HAL_TIMER_EXPIRED_LEVEL, timers[1].level);
+  ASSERT_TRUE(HalTimerWheelNextExpiry(&wheel, &expiry));
+  EXPECT_EQ(100u, expiry);
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(100));
+}
+
+TEST_F(HalTimerWheelTest, TimersGoToTheLevelOfTheirDistance) {
+  SetNow(0);
+  Start(1, LEVEL1_TICKS - 1);
+  Start(2, LEVEL1_TICKS);
+  // Up to 64 level 1 slots ahead
+  Start(3, LEVEL2_TICKS + LEVEL1_TICKS - 1);
+  Start(4, LEVEL2_TICKS + LEVEL1_TICKS);
+
+  EXPECT_EQ(0, timers[1].level);
+  EXPECT_EQ(1, timers[2].level);
+  EXPECT_EQ(1, timers[3].level);
+  EXPECT_EQ(2, timers[4].level);
+}
+
+TEST_F(HalTimerWheelTest, OrderAcrossLevels) {
+  uint64_t expiry;
+
+  SetNow(0);
+  Start(1, 3 * LEVEL2_TICKS + 7);  // level 2
+  Start(2, 100);                   // level 1
+  Start(3, 10);                    // level 0
+  Start(4, 2 * LEVEL2_TICKS);      // level 2
+
+  ASSERT_TRUE(HalTimerWheelNextExpiry(&wheel, &expiry));
+  EXPECT_EQ(10u, expiry);
+  EXPECT_EQ(std::vector<uint32_t>({3, 2, 4, 1}), Advance(4 * LEVEL2_TICKS));
+}
+
+TEST_F(HalTimerWheelTest, NextExpiryFollowsTheWheel) {
+  uint64_t expiry;
+
+  SetNow(0);
+  Start(1, 10);
+  Start(2, 700);
+  Start(3, 9000);
+
+  for (uint32_t id = 1; id <= 3; id++) {
+    ASSERT_TRUE(HalTimerWheelNextExpiry(&wheel, &expiry));
+    EXPECT_EQ(timers[id].expiry, expiry);
+    EXPECT_TRUE(Advance(expiry - 1).empty());
+    EXPECT_EQ(std::vector<uint32_t>({id}), Advance(expiry));
+  }
+  EXPECT_FALSE(HalTimerWheelNextExpiry(&wheel, &expiry));
+}
+
+/* A level 1 slot is cascaded to level 0 when the wheel reaches its first
+ * tick: the timers around the 64-tick boundary expire at their own tick. */
+TEST_F(HalTimerWheelTest, CascadeAt64TickBoundary) {
+  SetNow(0);
+  Start(1, LEVEL1_TICKS - 1);
+  Start(2, LEVEL1_TICKS);
+  Start(3, LEVEL1_TICKS + 1);
+  Start(4, 2 * LEVEL1_TICKS - 1);
+  Start(5, 2 * LEVEL1_TICKS);
+
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(LEVEL1_TICKS - 1));
+  EXPECT_EQ(std::vector<uint32_t>({2}), Advance(LEVEL1_TICKS));
+  EXPECT_EQ(0, timers[3].level);
+  EXPECT_EQ(std::vector<uint32_t>({3}), Advance(LEVEL1_TICKS + 1));
+  EXPECT_TRUE(Advance(2 * LEVEL1_TICKS - 2).empty());
+  EXPECT_EQ(std::vector<uint32_t>({4, 5}), Advance(2 * LEVEL1_TICKS));
+}
+
+/* Same for a level 2 slot at the 4096-tick boundary, the timers going down
+ * two levels at once. */
+TEST_F(HalTimerWheelTest, CascadeAt4096TickBoundary) {
+  SetNow(0);
+  Start(1, LEVEL2_TICKS - 1);
+  Start(2, LEVEL2_TICKS);
+  Start(3, LEVEL2_TICKS + 1);
+  Start(4, LEVEL2_TICKS + LEVEL1_TICKS);
+  Start(5, 2 * LEVEL2_TICKS + 1);
+
+  EXPECT_TRUE(Advance(LEVEL2_TICKS - 2).empty());
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(LEVEL2_TICKS - 1));
+  EXPECT_EQ(std::vector<uint32_t>({2}), Advance(LEVEL2_TICKS));
+  EXPECT_EQ(0, timers[3].level);
+  EXPECT_EQ(std::vector<uint32_t>({3}), Advance(LEVEL2_TICKS + 1));
+  EXPECT_TRUE(Advance(LEVEL2_TICKS + LEVEL1_TICKS - 1).empty());
+  EXPECT_EQ(std::vector<uint32_t>({4}), Advance(LEVEL2_TICKS + LEVEL1_TICKS));
+  EXPECT_TRUE(Advance(2 * LEVEL2_TICKS).empty());
+  EXPECT_EQ(std::vector<uint32_t>({5}), Advance(2 * LEVEL2_TICKS + 1));
+}
+
+/* Started just before a boundary, the timers cross it. */
+TEST_F(HalTimerWheelTest, CascadeFromAnUnalignedStart) {
+  SetNow(LEVEL2_TICKS - 3);
+  Start(1, LEVEL2_TICKS + 2);
+  Start(2, LEVEL2_TICKS + LEVEL1_TICKS + 5);
+  Start(3, 3 * LEVEL2_TICKS - 1);
+
+  EXPECT_TRUE(Advance(LEVEL2_TICKS + 1).empty());
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(LEVEL2_TICKS + 2));
+  EXPECT_TRUE(Advance(LEVEL2_TICKS + LEVEL1_TICKS + 4).empty());
+  EXPECT_EQ(std::vector<uint32_t>({2}),
+            Advance(LEVEL2_TICKS + LEVEL1_TICKS + 5));
+  EXPECT_TRUE(Advance(3 * LEVEL2_TICKS - 2).empty());
+  EXPECT_EQ(std::vector<uint32_t>({3}), Advance(3 * LEVEL2_TICKS - 1));
+}
+
+/* Beyond the 64 slots of the top level, a timer is parked and cascaded
+ * again until it fits. */
+TEST_F(HalTimerWheelTest, TimerBeyondTheWheel) {
+  uint64_t far = 2 * LEVEL1_TICKS * LEVEL2_TICKS + 123;
+
+  SetNow(0);
+  Start(1, far);
+
+  EXPECT_TRUE(Advance(far - 1).empty());
+  EXPECT_EQ(std::vector<uint32_t>({1}), Advance(far));
+}
+
+/* Random starts, stops and time steps checked against a plain list. */
+TEST_F(HalTimerWheelTest, MatchesAReferenceModel) {
+  uint64_t now = 5000;
+  unsigned int seed = 1;
+
+  SetNow(now);
+  for (int step = 0; step < 20000; step++) {
+    uint32_t id = rand_r(&seed) % 64;
+    int action = rand_r(&seed) % 4;
+
+    if (action == 0 && !timers[id].active) {
+      // Mostly short timers, some up to beyond the wheel
+      uint64_t duration = (rand_r(&seed) % 8) ? rand_r(&seed) % 5000
+                                              : rand_r(&seed) % 600000;
+      if (wheel.count == 0) {
+        SetNow(now);
+      }
+      Start(id, now + duration);
+    } else if (action == 1 && timers[id].active) {
+      Stop(id);
+    } else {
+      uint64_t target = now + rand_r(&seed) % ((action == 2) ? 10 : 3000);
+      std::vector<std::pair<uint64_t, uint32_t>> due;
+      for (uint32_t i = 0; i < 64; i++) {
+        if (timers[i].active && timers[i].expiry <= target) {
+          due.push_back(std::make_pair(timers[i].expiry, i));
+        }
+      }
+      std::vector<uint32_t> expired = Advance(target);
+      ASSERT_EQ(due.size(), expired.size()) << "at " << target;
+      // Expiry order, any order within the same tick
+      for (size_t i = 0; i < expired.size(); i++) {
+        EXPECT_LE(timers[expired[i]].expiry, target);
+        if (i > 0) {
+          EXPECT_LE(timers[expired[i - 1]].expiry, timers[expired[i]].expiry);
+        }
+      }
+      now = target;
+    }
+
+    uint64_t expiry;
+    uint64_t earliest = UINT64_MAX;
+    for (uint32_t i = 0; i < 64; i++) {
+      if (timers[i].active) {
+        earliest = std::min(earliest, timers[i].expiry);
+      }
+    }
+    if (earliest == UINT64_MAX) {
+      ASSERT_FALSE(HalTimerWheelNextExpiry(&wheel, &expiry));
+    } else {
+      ASSERT_TRUE(HalTimerWheelNextExpiry(&wheel, &expiry));
+      ASSERT_EQ(earliest, expiry);
+    }
+  }
+}